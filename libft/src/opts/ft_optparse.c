@@ -13,6 +13,7 @@
 #include "ft/opts.h"
 #include "ft/string.h"
 #include "ft/stdio.h"
+#include "ft/stdlib.h"
 
 #include <stdbool.h>
 
@@ -55,7 +56,7 @@ static int	get_value(char **c_opt, const t_opt opts[], char *optv[], int i[2])
 		if (opts->type == FT_OPT_STRING)
 			*(char **)opts->value = value;
 		else if (opts->type == FT_OPT_INTEGER)
-			*(int *)opts->value = 0;
+			*(int *)opts->value = ft_atoi(value);
 	}
 	return (0);
 }
@@ -15,7 +15,9 @@ ifeq (,$(OUTLIB_DIR))
 endif
 
 # Configuration
-FT_P_LISTEN_QUEUE := 6
+FT_P_LISTEN_QUEUE := 1024
+FT_P_IO_URING     := 1
+FT_P_FSM_STATS    := 0
 
 LIBFT_ROOT_DIR := libft
 include $(LIBFT_ROOT_DIR)/makefile.mk
@@ -0,0 +1,192 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   ascii.c                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "ascii.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define ASCII_X86 1
+#else
+# define ASCII_X86 0
+#endif
+
+#if ASCII_X86
+
+/**
+ * Encode 16 bytes blocks until less than a block is left. Blocks are
+ * stored whole, then the output moves past their first line feed only:
+ * the bytes after it are stored again along with the next block. Text
+ * rarely holds more than a line per block.
+ */
+static void encode_sse2(char const **in, char **out, char const *end)
+{
+	__m128i const lf = _mm_set1_epi8('\n');
+	char const *i = *in;
+	char *o = *out;
+
+	while (i + 16 <= end) {
+		__m128i const v = _mm_loadu_si128((__m128i const *)i);
+		uint32_t const m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+
+		_mm_storeu_si128((__m128i *)o, v);
+		if (m == 0) {
+			i += 16;
+			o += 16;
+			continue;
+		}
+		unsigned const n = (unsigned)__builtin_ctz(m);
+		o[n] = '\r';
+		o[n + 1] = '\n';
+		i += n + 1;
+		o += n + 2;
+	}
+	*in = i;
+	*out = o;
+}
+
+/**
+ * Same as `encode_sse2` with 32 bytes blocks
+ */
+__attribute__((target("avx2")))
+static void encode_avx2(char const **in, char **out, char const *end)
+{
+	__m256i const lf = _mm256_set1_epi8('\n');
+	char const *i = *in;
+	char *o = *out;
+
+	while (i + 32 <= end) {
+		__m256i const v = _mm256_loadu_si256((__m256i const *)i);
+		uint32_t const m =
+			(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+
+		_mm256_storeu_si256((__m256i *)o, v);
+		if (m == 0) {
+			i += 32;
+			o += 32;
+			continue;
+		}
+		unsigned const n = (unsigned)__builtin_ctz(m);
+		o[n] = '\r';
+		o[n + 1] = '\n';
+		i += n + 1;
+		o += n + 2;
+	}
+	*in = i;
+	*out = o;
+}
+
+/**
+ * Decode blocks followed by a byte at least: a carriage return is told
+ * from a line ending by the next byte, already stored when it is kept
+ */
+static void decode_sse2(char const **in, char **out, char const *end)
+{
+	__m128i const cr = _mm_set1_epi8('\r');
+	char const *i = *in;
+	char *o = *out;
+
+	while (i + 16 < end) {
+		__m128i const v = _mm_loadu_si128((__m128i const *)i);
+		uint32_t const m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+
+		_mm_storeu_si128((__m128i *)o, v);
+		if (m == 0) {
+			i += 16;
+			o += 16;
+			continue;
+		}
+		unsigned const n = (unsigned)__builtin_ctz(m);
+		i += n + 1;
+		o += n + (*i != '\n');
+	}
+	*in = i;
+	*out = o;
+}
+
+/**
+ * Same as `decode_sse2` with 32 bytes blocks
+ */
+__attribute__((target("avx2")))
+static void decode_avx2(char const **in, char **out, char const *end)
+{
+	__m256i const cr = _mm256_set1_epi8('\r');
+	char const *i = *in;
+	char *o = *out;
+
+	while (i + 32 < end) {
+		__m256i const v = _mm256_loadu_si256((__m256i const *)i);
+		uint32_t const m =
+			(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+
+		_mm256_storeu_si256((__m256i *)o, v);
+		if (m == 0) {
+			i += 32;
+			o += 32;
+			continue;
+		}
+		unsigned const n = (unsigned)__builtin_ctz(m);
+		i += n + 1;
+		o += n + (*i != '\n');
+	}
+	*in = i;
+	*out = o;
+}
+
+#endif
+
+size_t ascii_encode(char *out, char const *in, size_t len)
+{
+	char const *const end = in + len;
+	char *o = out;
+
+#if ASCII_X86
+	if (__builtin_cpu_supports("avx2"))
+		encode_avx2(&in, &o, end);
+	encode_sse2(&in, &o, end);
+#endif
+	while (in < end) {
+		if (*in == '\n') *o++ = '\r';
+		*o++ = *in++;
+	}
+	return (size_t)(o - out);
+}
+
+size_t ascii_decode(char *out, char const *in, size_t len, bool *cr)
+{
+	char const *const end = in + len;
+	char *o = out;
+
+	if (len == 0) return 0;
+
+	/* Held carriage return, now that the byte after it is known */
+	if (*cr && *in != '\n') *o++ = '\r';
+	*cr = false;
+
+#if ASCII_X86
+	if (__builtin_cpu_supports("avx2"))
+		decode_avx2(&in, &o, end);
+	decode_sse2(&in, &o, end);
+#endif
+	while (in < end) {
+		char const c = *in++;
+
+		if (c != '\r')
+			*o++ = c;
+		else if (in == end)
+			*cr = true;
+		else if (*in != '\n')
+			*o++ = c;
+	}
+	return (size_t)(o - out);
+}
@@ -0,0 +1,45 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   ascii.h                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file ascii.h
+ * @brief
+ * TYPE A line endings (RFC 959): files end their lines with LF, the data
+ * connection with CRLF. Vectorized when available.
+ */
+#ifndef __ASCII_H
+# define __ASCII_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Expand every line feed to CRLF
+ * @param out [out] Room for twice `len` bytes, apart from `in`
+ * @param in   [in] File bytes
+ * @param len  [in] Number of file bytes
+ * @return          Number of bytes written
+ */
+size_t ascii_encode(char *out, char const *in, size_t len);
+
+/**
+ * Strip the carriage return of every CRLF, bare ones are data. One ending
+ * `in` is held until the next byte is known.
+ * @param out    [out] Room for `len + 1` bytes, apart from `in`
+ * @param in      [in] Received bytes
+ * @param len     [in] Number of received bytes
+ * @param cr  [in,out] Whether a carriage return is held
+ * @return             Number of bytes written
+ */
+size_t ascii_decode(char *out, char const *in, size_t len, bool *cr);
+
+#endif /* !__ASCII_H */
@@ -0,0 +1,85 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   bench.c                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "clock.h"
+#include "ftp.h"
+
+#include <ft/opts.h>
+#include <ft/stdio.h>
+#include <ft/stdlib.h>
+#include <ft/string.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BENCH_COUNT (1000000) /**< Dispatches per benchmarked command */
+
+int main(int ac, char *av[])
+{
+	static char const *const lines[] = {
+		"NOOP", "SYST", "TYPE I", "MODE S", "PWD", "REST 42", "XXXX",
+	};
+	int help = 0;
+	int count = BENCH_COUNT;
+
+	t_opt const opts[] = {
+		{ FT_OPT_BOOLEAN, 'h', "help", &help, "Display available options", 1 },
+		{ FT_OPT_INTEGER, 'n', "count", &count,
+		  "Dispatches per benchmarked command", 0 },
+		{ FT_OPT_END, 0, 0, 0, 0, 0 }
+	};
+
+	int idx = 1;
+
+	if (ft_optparse(opts, &idx, ac, av) || help || idx != ac) {
+		ft_optusage(opts, av[0], "",
+		            "Print the mean dispatch time of a few commands");
+		return help ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (count <= 0) {
+		ft_fprintf(g_stderr, "%s: invalid count: %d\n", av[0], count);
+		return EXIT_FAILURE;
+	}
+
+	char root[PATH_MAX];
+
+	if (getcwd(root, PATH_MAX) == NULL || clk_init()) {
+		ft_fprintf(g_stderr, "%s: %s\n", av[0], ft_strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* Sessions are dispatched only, nothing is ever sent or listened */
+	static struct ftp_usr users[] = {
+		{ .user = NULL, .pswd = NULL },
+	};
+	struct ftp_conf const conf = {
+		.root = root,
+		.users = users,
+		.max_clients = 1,
+		.threads = 1,
+		.max_output = FTP_MAX_OUTPUT,
+	};
+
+	for (size_t i = 0; i < sizeof lines / sizeof *lines; ++i) {
+		uint64_t ns;
+
+		if (ftp_bench(&conf, lines[i], (unsigned)count, &ns))
+			ft_printf("%-8s: %s\n", lines[i], ft_strerror(errno));
+		else
+			ft_printf("%-8s: %lu ns\n", lines[i], ns);
+	}
+
+	return EXIT_SUCCESS;
+}
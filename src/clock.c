@@ -0,0 +1,55 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   clock.c                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "clock.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <cpuid.h>
+#endif
+
+#define CLK_CALIBRATION (20) /**< TSC calibration period, ms */
+
+struct clk g_clk;
+
+static uint64_t clk_mono(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+int clk_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned eax, ebx, ecx, edx;
+
+	/* Only an invariant TSC ticks at a constant rate on every core */
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+	    !(edx & (1U << 8)))
+		return 0;
+
+	struct timespec const period = { 0, CLK_CALIBRATION * 1000000 };
+	uint64_t const ns = clk_mono();
+	uint64_t const tsc = __rdtsc();
+
+	if (nanosleep(&period, NULL)) return -1;
+
+	uint64_t const dns = clk_mono() - ns;
+	uint64_t const dtsc = __rdtsc() - tsc;
+
+	if (dtsc == 0) return 0;
+	g_clk.mult = (uint64_t)(((unsigned __int128)dns << 32) / dtsc);
+	g_clk.tsc = true;
+#endif
+	return 0;
+}
@@ -0,0 +1,79 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   clock.h                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file clock.h
+ * @brief
+ * Monotonic clocks: coarse milliseconds for timeouts, read once per
+ * reactor iteration, and ticks for short intervals (invariant TSC when
+ * available) converted to nanoseconds once calibrated
+ */
+#ifndef __CLOCK_H
+# define __CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+
+struct clk {
+	bool tsc;      /**< Ticks are TSC cycles, nanoseconds otherwise */
+	uint64_t mult; /**< Nanoseconds per tick, 32.32 fixed point     */
+};
+
+extern struct clk g_clk;
+
+/**
+ * Calibrate ticks against the monotonic clock, ticks are nanoseconds
+ * until then
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int clk_init(void);
+
+/**
+ * @return Monotonic time in milliseconds, at the kernel tick resolution
+ */
+static inline uint64_t clk_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/**
+ * @return Current tick, only meaningful to compute intervals
+ */
+static inline uint64_t clk_ticks(void)
+{
+	struct timespec now;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (g_clk.tsc) return __rdtsc();
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @return Ticks interval in nanoseconds
+ */
+static inline uint64_t clk_ns(uint64_t ticks)
+{
+	if (!g_clk.tsc) return ticks;
+	return (uint64_t)(((unsigned __int128)ticks * g_clk.mult) >> 32);
+}
+
+#endif /* !__CLOCK_H */
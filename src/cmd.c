@@ -0,0 +1,915 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   cmd.c                                              :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "cmd.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#define CMD_STOU_NAME  (16) /**< Unique names, `stou.` and 8 hex digits */
+#define CMD_STOU_TRIES (8)  /**< Names tried before giving up           */
+
+/**
+ * Resolve a client path against the session working directory, `..`
+ * never goes above the served root
+ * @param path [out] Normalized absolute path, `PATH_MAX` bytes
+ * @return           0 on success, -1 otherwise (errno is set)
+ */
+static int cmd_path(struct ftp_cli const *cli, char const *arg, char *path)
+{
+	char const *const parts[] = { *arg == '/' ? "" : cli->cwd, arg };
+	size_t len = 1;
+
+	path[0] = '/';
+	for (unsigned i = 0; i < sizeof parts / sizeof *parts; ++i) {
+		for (char const *p = parts[i], *end; *p; p = end) {
+			while (*p == '/') ++p;
+			if ((end = strchrnul(p, '/')) == p) break;
+
+			size_t const n = (size_t)(end - p);
+
+			if (n == 1 && p[0] == '.')
+				continue;
+			if (n == 2 && p[0] == '.' && p[1] == '.') {
+				while (len > 1 && path[--len] != '/');
+				continue;
+			}
+			if (len + n + 2 > PATH_MAX)
+				return (errno = ENAMETOOLONG), -1;
+			if (len > 1) path[len++] = '/';
+			memcpy(path + len, p, n);
+			len += n;
+		}
+	}
+	path[len] = '\0';
+	return 0;
+}
+
+/**
+ * @return  Path relative to the served root, as expected by `*at` calls
+ */
+static __always_inline char const *cmd_rel(char const *path)
+{
+	return path[1] ? path + 1 : ".";
+}
+
+/**
+ * Quote a path in a reply, embedded quotes are doubled (RFC 959)
+ * @param dst [out] Quoted path, twice the size of `src` at most
+ * @return          Length of the quoted path
+ */
+static size_t cmd_quote(char *dst, char const *src)
+{
+	char *p = dst;
+
+	for (; *src; *p++ = *src++)
+		if (*src == '"') *p++ = '"';
+	return (size_t)(p - dst);
+}
+
+/**
+ * Write `n` zero padded decimal digits
+ * @return  End of the written digits
+ */
+static char *cmd_digits(char *dst, uint64_t v, unsigned n)
+{
+	for (char *p = dst + n; p != dst; v /= 10)
+		*--p = (char)('0' + v % 10);
+	return dst + n;
+}
+
+/**
+ * @param dst [out] Decimal representation, 20 bytes at most
+ * @return          Length of the representation
+ */
+static size_t cmd_u64(char *dst, uint64_t v)
+{
+	unsigned n = 1;
+
+	for (uint64_t x = v; x >= 10; x /= 10) ++n;
+	return (size_t)(cmd_digits(dst, v, n) - dst);
+}
+
+static struct ftp_tmpl const g_pwd = FTP_TMPL("257 \"",
+                                              "\" is the current directory.");
+static struct ftp_tmpl const g_mkd = FTP_TMPL("257 \"", "\" created.");
+static struct ftp_tmpl const g_stat = FTP_TMPL("213 ", "");
+static struct ftp_tmpl const g_rest = FTP_TMPL("350 Restarting at ",
+                                               ". Send STORE or RETRIEVE.");
+static struct ftp_tmpl const g_feat = FTP_TMPL("211-Features:\r\n"
+                                               " MDTM\r\n"
+                                               " MODE Z\r\n"
+                                               " REST STREAM\r\n"
+                                               " SIZE\r\n"
+                                               " TVFS\r\n"
+                                               " UTF8\r\n", "211 End");
+static struct ftp_tmpl const g_help = FTP_TMPL("214 ", " is supported.");
+
+static int cmd_reply(struct ftp_cli *cli, unsigned code)
+{
+	return ftp_reply(cli, code), 0;
+}
+
+static int cmd_noop(struct ftp_cli *cli, char *arg)
+{
+	(void)arg;
+	return cmd_reply(cli, 200);
+}
+
+static int cmd_superfluous(struct ftp_cli *cli, char *arg)
+{
+	(void)arg;
+	return cmd_reply(cli, 202);
+}
+
+static int cmd_unimplemented(struct ftp_cli *cli, char *arg)
+{
+	(void)arg;
+	return cmd_reply(cli, 502);
+}
+
+static int cmd_quit(struct ftp_cli *cli, char *arg)
+{
+	(void)arg;
+	return ftp_reply(cli, 221), C_CLOSE;
+}
+
+static int cmd_rein(struct ftp_cli *cli, char *arg)
+{
+	(void)cli;
+	(void)arg;
+	return C_REIN;
+}
+
+static int cmd_cwd(struct ftp_cli *cli, char *arg)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (cmd_path(cli, arg, path) ||
+	    fstatat(cli->srv->root, cmd_rel(path), &st, 0) ||
+	    !S_ISDIR(st.st_mode))
+		return cmd_reply(cli, 550);
+
+	strcpy(cli->cwd, path);
+	return cmd_reply(cli, 250);
+}
+
+static int cmd_cdup(struct ftp_cli *cli, char *arg)
+{
+	(void)arg;
+	return cmd_cwd(cli, "..");
+}
+
+static int cmd_pwd(struct ftp_cli *cli, char *arg)
+{
+	(void)arg;
+	char quoted[2 * PATH_MAX];
+
+	ftp_reply_arg(cli, &g_pwd, quoted, cmd_quote(quoted, cli->cwd));
+	return 0;
+}
+
+static int cmd_mkd(struct ftp_cli *cli, char *arg)
+{
+	char path[PATH_MAX], quoted[2 * PATH_MAX];
+
+	if (cmd_path(cli, arg, path) ||
+	    mkdirat(cli->srv->root, cmd_rel(path), 0755))
+		return cmd_reply(cli, 550);
+
+	ftp_reply_arg(cli, &g_mkd, quoted, cmd_quote(quoted, path));
+	return 0;
+}
+
+static int cmd_rmd(struct ftp_cli *cli, char *arg)
+{
+	char path[PATH_MAX];
+
+	if (cmd_path(cli, arg, path))
+		return cmd_reply(cli, 550);
+
+	/* Root, or the working directory and its parents, stays */
+	size_t const len = strlen(path);
+
+	if (len == 1 || (!strncmp(cli->cwd, path, len) &&
+	                 (cli->cwd[len] == '\0' || cli->cwd[len] == '/')) ||
+	    unlinkat(cli->srv->root, cmd_rel(path), AT_REMOVEDIR))
+		return cmd_reply(cli, 550);
+	return cmd_reply(cli, 250);
+}
+
+static int cmd_dele(struct ftp_cli *cli, char *arg)
+{
+	char path[PATH_MAX];
+
+	if (cmd_path(cli, arg, path) ||
+	    unlinkat(cli->srv->root, cmd_rel(path), 0))
+		return cmd_reply(cli, 550);
+	return cmd_reply(cli, 250);
+}
+
+static int cmd_rnfr(struct ftp_cli *cli, char *arg)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (cmd_path(cli, arg, path) ||
+	    fstatat(cli->srv->root, cmd_rel(path), &st, AT_SYMLINK_NOFOLLOW))
+		return cmd_reply(cli, 550);
+
+	free(cli->rnfr);
+	if ((cli->rnfr = strdup(path)) == NULL)
+		return cmd_reply(cli, 451);
+	return cmd_reply(cli, 350);
+}
+
+static int cmd_rnto(struct ftp_cli *cli, char *arg)
+{
+	char path[PATH_MAX];
+
+	if (cli->rnfr == NULL)
+		return cmd_reply(cli, 503);
+
+	if (cmd_path(cli, arg, path) || path[1] == '\0' ||
+	    renameat(cli->srv->root, cmd_rel(cli->rnfr),
+	             cli->srv->root, cmd_rel(path)))
+		return cmd_reply(cli, 553);
+	return cmd_reply(cli, 250);
+}
+
+static int cmd_size(struct ftp_cli *cli, char *arg)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (cmd_path(cli, arg, path) ||
+	    fstatat(cli->srv->root, cmd_rel(path), &st, 0) ||
+	    !S_ISREG(st.st_mode))
+		return cmd_reply(cli, 550);
+
+	char num[20];
+
+	ftp_reply_arg(cli, &g_stat, num, cmd_u64(num, (uint64_t)st.st_size));
+	return 0;
+}
+
+static int cmd_mdtm(struct ftp_cli *cli, char *arg)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	struct tm tm;
+
+	if (cmd_path(cli, arg, path) ||
+	    fstatat(cli->srv->root, cmd_rel(path), &st, 0) ||
+	    !S_ISREG(st.st_mode) || gmtime_r(&st.st_mtime, &tm) == NULL)
+		return cmd_reply(cli, 550);
+
+	/* YYYYMMDDHHMMSS (RFC 3659) */
+	char date[14], *p = date;
+
+	p = cmd_digits(p, (uint64_t)tm.tm_year + 1900, 4);
+	p = cmd_digits(p, (uint64_t)tm.tm_mon + 1, 2);
+	p = cmd_digits(p, (uint64_t)tm.tm_mday, 2);
+	p = cmd_digits(p, (uint64_t)tm.tm_hour, 2);
+	p = cmd_digits(p, (uint64_t)tm.tm_min, 2);
+	p = cmd_digits(p, (uint64_t)tm.tm_sec, 2);
+	ftp_reply_arg(cli, &g_stat, date, sizeof date);
+	return 0;
+}
+
+static int cmd_type(struct ftp_cli *cli, char *arg)
+{
+	char const t = (char)toupper(arg[0]);
+
+	/* A [N], I and L 8, other formats and byte sizes are refused */
+	if (t == 'A' && (!arg[1] || strcasecmp(arg + 1, " N") == 0))
+		cli->type = FTP_TYPE_ASCII;
+	else if ((t == 'I' && !arg[1]) || (t == 'L' && strcmp(arg + 1, " 8") == 0))
+		cli->type = FTP_TYPE_IMAGE;
+	else if (t == 'A' || t == 'E' || t == 'L')
+		return cmd_reply(cli, 504);
+	else
+		return cmd_reply(cli, 501);
+	return cmd_reply(cli, 200);
+}
+
+static int cmd_mode(struct ftp_cli *cli, char *arg)
+{
+	char const m = (char)toupper(arg[0]);
+
+	if (arg[1] || !strchr("SBCZ", m))
+		return cmd_reply(cli, 501);
+	if (m == 'C')
+		return cmd_reply(cli, 504);
+	cli->mode = m == 'Z' ? FTP_MODE_DEFLATE
+		: m == 'B' ? FTP_MODE_BLOCK : FTP_MODE_STREAM;
+	return cmd_reply(cli, 200);
+}
+
+static int cmd_stru(struct ftp_cli *cli, char *arg)
+{
+	char const s = (char)toupper(arg[0]);
+
+	if (arg[1] || !strchr("FRP", s))
+		return cmd_reply(cli, 501);
+	if (s != 'F')
+		return cmd_reply(cli, 504);
+	cli->stru = FTP_STRUCTURE_FILE;
+	return cmd_reply(cli, 200);
+}
+
+/**
+ * Parse a decimal number, the whole string must be consumed
+ * @return  0 on success, -1 otherwise
+ */
+static int cmd_number(char const *arg, uint64_t max, uint64_t *res)
+{
+	uint64_t n = 0;
+
+	if (!isdigit(*arg)) return -1;
+	for (; isdigit(*arg); ++arg) {
+		unsigned const d = (unsigned)(*arg - '0');
+
+		if (n > (max - d) / 10) return -1;
+		n = n * 10 + d;
+	}
+	if (*arg) return -1;
+	return (*res = n), 0;
+}
+
+/**
+ * Keep an active mode data address, of the session peer only and on an
+ * unprivileged port: the server must not be used to reach anything else
+ * (RFC 2577)
+ */
+static int cmd_data_addr(struct ftp_cli *cli, struct sockaddr_in const *addr)
+{
+	if (cli->epsv_all)
+		return cmd_reply(cli, 503);
+	if (addr->sin_addr.s_addr != cli->addr.sin_addr.s_addr ||
+	    ntohs(addr->sin_port) < 1024)
+		return cmd_reply(cli, 504);
+	cli->port = *addr;
+	return cmd_reply(cli, 200);
+}
+
+static int cmd_port(struct ftp_cli *cli, char *arg)
+{
+	uint8_t b[6];
+
+	/* h1,h2,h3,h4,p1,p2 */
+	for (unsigned i = 0; i < 6; ++i) {
+		char *const sep = strchrnul(arg, ',');
+		char const c = *sep;
+		uint64_t n;
+
+		*sep = '\0';
+		if (cmd_number(arg, UINT8_MAX, &n) || (c == ',') != (i < 5))
+			return cmd_reply(cli, 501);
+		b[i] = (uint8_t)n;
+		arg = sep + 1;
+	}
+
+	return cmd_data_addr(cli, &(struct sockaddr_in){
+		.sin_family = AF_INET,
+		.sin_port = htons((uint16_t)(b[4] << 8 | b[5])),
+		.sin_addr.s_addr = htonl((uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 |
+		                         (uint32_t)b[2] << 8 | b[3]) });
+}
+
+static int cmd_eprt(struct ftp_cli *cli, char *arg)
+{
+	char const delim = arg[0];
+	char *field[3];
+	uint64_t af, port;
+	struct in_addr addr;
+
+	/* <d>af<d>addr<d>port<d>, any printable delimiter */
+	if (delim < 33 || delim > 126)
+		return cmd_reply(cli, 501);
+	for (unsigned i = 0; i < 3; ++i) {
+		field[i] = ++arg;
+		if ((arg = strchr(arg, delim)) == NULL)
+			return cmd_reply(cli, 501);
+		*arg = '\0';
+	}
+	if (arg[1] || cmd_number(field[0], UINT16_MAX, &af) ||
+	    cmd_number(field[2], UINT16_MAX, &port))
+		return cmd_reply(cli, 501);
+	if (af != 1)
+		return cmd_reply(cli, 522);
+	if (inet_pton(AF_INET, field[1], &addr) != 1)
+		return cmd_reply(cli, 501);
+
+	return cmd_data_addr(cli, &(struct sockaddr_in){
+		.sin_family = AF_INET,
+		.sin_port = htons((uint16_t)port),
+		.sin_addr = addr });
+}
+
+static int cmd_pasv(struct ftp_cli *cli, char *arg)
+{
+	struct sockaddr_in addr;
+
+	(void)arg;
+	if (cli->epsv_all)
+		return cmd_reply(cli, 503);
+	if (ftp_pasv(cli, &addr))
+		return cmd_reply(cli, errno == ENOTSUP ? 502 : 425);
+
+	uint32_t const ip = ntohl(addr.sin_addr.s_addr);
+	unsigned const port = ntohs(addr.sin_port);
+
+	ftp_replyf(cli, "227 Entering Passive Mode (%u,%u,%u,%u,%u,%u).",
+	           ip >> 24, ip >> 16 & 0xFF, ip >> 8 & 0xFF, ip & 0xFF,
+	           port >> 8, port & 0xFF);
+	return 0;
+}
+
+static int cmd_epsv(struct ftp_cli *cli, char *arg)
+{
+	struct sockaddr_in addr;
+
+	/* EPSV [<af> | ALL], ALL forbids any other data address from now
+	 * on (RFC 2428) */
+	if (arg && strcasecmp(arg, "ALL") == 0) {
+		cli->epsv_all = true;
+		return cmd_reply(cli, 200);
+	}
+	if (arg && strcmp(arg, "1"))
+		return cmd_reply(cli, 522);
+	if (ftp_pasv(cli, &addr))
+		return cmd_reply(cli, errno == ENOTSUP ? 502 : 425);
+
+	ftp_replyf(cli, "229 Entering Extended Passive Mode (|||%u|).",
+	           ntohs(addr.sin_port));
+	return 0;
+}
+
+static int cmd_rest(struct ftp_cli *cli, char *arg)
+{
+	uint64_t off;
+
+	if (cmd_number(arg, INT64_MAX, &off))
+		return cmd_reply(cli, 501);
+	cli->rest = off;
+	cli->restart = true;
+	char num[20];
+
+	ftp_reply_arg(cli, &g_rest, num, cmd_u64(num, off));
+	return 0;
+}
+
+static int cmd_retr(struct ftp_cli *cli, char *arg)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t const rest = cli->rest;
+
+	/* Restart offset only applies to the transfer right after REST */
+	cli->rest = 0;
+	cli->restart = false;
+
+	/* Non-blocking: opening a FIFO must not block the reactor */
+	int const file = cmd_path(cli, arg, path) ? -1
+		: openat(cli->srv->root, cmd_rel(path),
+		         O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (file < 0)
+		return cmd_reply(cli, 550);
+	if (fstat(file, &st) || !S_ISREG(st.st_mode)) {
+		close(file);
+		return cmd_reply(cli, 550);
+	}
+
+	uint64_t const size = (uint64_t)st.st_size;
+	uint64_t const off = rest < size ? rest : size;
+
+	/* Read ahead aggressively, the file is sent once from start to end */
+	posix_fadvise(file, (off_t)off, 0, POSIX_FADV_SEQUENTIAL);
+	return ftp_retr(cli, file, off, size);
+}
+
+/**
+ * LIST and NLST, of the working directory by default. Options some
+ * clients give (`LIST -la`) are ignored. Only the listed path is opened
+ * here, its entries are listed as they are sent.
+ */
+static int cmd_list_send(struct ftp_cli *cli, char *arg, uint32_t verb)
+{
+	bool const names = verb == FTP_VERB('N', 'L', 'S', 'T');
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (arg && arg[0] == '-') {
+		arg = strchr(arg, ' ');
+		arg = arg ? arg + 1 : NULL;
+	}
+	if (arg == NULL) arg = ".";
+
+	if (cmd_path(cli, arg, path))
+		return cmd_reply(cli, 550);
+
+	int const file = openat(cli->srv->root, cmd_rel(path),
+	                        O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (file < 0 || fstat(file, &st)) {
+		int const err = errno;
+
+		if (file >= 0) close(file);
+		return cmd_reply(cli, err == ENOENT || err == EACCES ||
+		                      err == ENOTDIR ? 550 : 451);
+	}
+
+	/* Single entry, listed by the name it was given */
+	return ftp_list(cli, file, names, S_ISDIR(st.st_mode) ? NULL
+	                : names ? arg : strrchr(path, '/') + 1, verb);
+}
+
+static int cmd_list(struct ftp_cli *cli, char *arg)
+{
+	return cmd_list_send(cli, arg, FTP_VERB('L', 'I', 'S', 'T'));
+}
+
+static int cmd_nlst(struct ftp_cli *cli, char *arg)
+{
+	return cmd_list_send(cli, arg, FTP_VERB('N', 'L', 'S', 'T'));
+}
+
+/**
+ * Open a file of a unique name in the working directory (STOU)
+ * @param name [out] Chosen name, `CMD_STOU_NAME` bytes
+ * @param path [out] Normalized path of the file, `PATH_MAX` bytes
+ * @return           Opened file, -1 on failure (errno is set)
+ */
+static int cmd_unique(struct ftp_cli *cli, char *name, char *path)
+{
+	for (unsigned i = 0; i < CMD_STOU_TRIES; ++i) {
+		uint32_t rnd;
+
+		if (getrandom(&rnd, sizeof rnd, GRND_NONBLOCK) != sizeof rnd)
+			return -1;
+		snprintf(name, CMD_STOU_NAME, "stou.%08x", rnd);
+		if (cmd_path(cli, name, path))
+			return -1;
+
+		int const file = openat(cli->srv->root, cmd_rel(path),
+		                        O_WRONLY | O_CREAT | O_EXCL | O_NONBLOCK |
+		                        O_CLOEXEC, 0644);
+		if (file >= 0 || errno != EEXIST)
+			return file;
+	}
+	return -1;
+}
+
+/**
+ * Receive a file: STOR writes from the start or the restart offset,
+ * APPE past the file end and STOU to a file of its own
+ */
+static int cmd_upload(struct ftp_cli *cli, char const *arg, uint32_t verb)
+{
+	char path[PATH_MAX], name[CMD_STOU_NAME];
+	struct stat st;
+	uint64_t const allo = cli->allo;
+	uint64_t const rest = cli->rest;
+	bool const append = verb == FTP_VERB('A', 'P', 'P', 'E');
+	bool const unique = verb == FTP_VERB('S', 'T', 'O', 'U');
+	bool const restart = cli->restart && !append && !unique;
+	int file;
+
+	/* Announced size and restart offset only apply to the upload right
+	 * after ALLO and REST */
+	cli->rest = 0;
+	cli->restart = false;
+	cli->allo = 0;
+
+	/* Restarted uploads only write from their offset on, the file is
+	 * kept: several sessions may each store a range of it at once */
+	if (unique) {
+		file = cmd_unique(cli, name, path);
+	} else {
+		if (cmd_path(cli, arg, path))
+			return cmd_reply(cli, 553);
+		file = openat(cli->srv->root, cmd_rel(path),
+		              O_WRONLY | O_CREAT | (restart || append ? 0 : O_TRUNC) |
+		              O_NONBLOCK | O_CLOEXEC, 0644);
+	}
+	if (file < 0)
+		return cmd_reply(cli, 550);
+	if (fstat(file, &st) || !S_ISREG(st.st_mode)) {
+		close(file);
+		return cmd_reply(cli, 553);
+	}
+
+	/* Appended bytes go past the current end, the announced size too */
+	uint64_t const base = append ? (uint64_t)st.st_size : 0;
+
+	/* Reserve the announced size at once, sparing the file system from
+	 * growing the file extent after extent. Released at the end when the
+	 * upload turns out shorter, unless other ranges may still come. */
+	if (allo && fallocate(file, FALLOC_FL_KEEP_SIZE, (off_t)base,
+	                      (off_t)allo) && errno != EOPNOTSUPP) {
+		close(file);
+		return cmd_reply(cli, 452);
+	}
+
+	return ftp_stor(cli, file, restart ? rest : base,
+	                restart ? rest : base + allo, verb, unique ? name : NULL);
+}
+
+static int cmd_stor(struct ftp_cli *cli, char *arg)
+{
+	return cmd_upload(cli, arg, FTP_VERB('S', 'T', 'O', 'R'));
+}
+
+static int cmd_appe(struct ftp_cli *cli, char *arg)
+{
+	return cmd_upload(cli, arg, FTP_VERB('A', 'P', 'P', 'E'));
+}
+
+static int cmd_stou(struct ftp_cli *cli, char *arg)
+{
+	(void)arg;
+	return cmd_upload(cli, NULL, FTP_VERB('S', 'T', 'O', 'U'));
+}
+
+static int cmd_allo(struct ftp_cli *cli, char *arg)
+{
+	char *const record = strchr(arg, ' ');
+	uint64_t size, max;
+
+	/* ALLO <size> [R <max record size>], records are not used */
+	if (record) {
+		*record = '\0';
+		if (toupper((unsigned char)record[1]) != 'R' ||
+		    record[2] != ' ' || cmd_number(record + 3, INT64_MAX, &max))
+			return cmd_reply(cli, 501);
+	}
+	if (cmd_number(arg, INT64_MAX, &size))
+		return cmd_reply(cli, 501);
+	cli->allo = size;
+	return cmd_reply(cli, 200);
+}
+
+static int cmd_abor(struct ftp_cli *cli, char *arg)
+{
+	(void)arg;
+	if (xfer_active(&cli->xfer))
+		return C_ABOR;
+	return cmd_reply(cli, 225);
+}
+
+static int cmd_syst(struct ftp_cli *cli, char *arg)
+{
+	(void)arg;
+	return cmd_reply(cli, 215);
+}
+
+static int cmd_feat(struct ftp_cli *cli, char *arg)
+{
+	(void)arg;
+	ftp_reply_arg(cli, &g_feat, NULL, 0);
+	return 0;
+}
+
+static int cmd_opts(struct ftp_cli *cli, char *arg)
+{
+	/* Paths are passed through untouched, UTF-8 is always on */
+	if (strcasecmp(arg, "UTF8 ON") == 0 || strcasecmp(arg, "UTF8") == 0)
+		return cmd_reply(cli, 200);
+
+	/* MODE Z LEVEL <n>, from 0 (stored) to 9 */
+	if (strncasecmp(arg, "MODE Z LEVEL ", 13) == 0) {
+		uint64_t level;
+
+		if (cmd_number(arg + 13, 9, &level))
+			return cmd_reply(cli, 501);
+		cli->zlevel = (int)level;
+		return cmd_reply(cli, 200);
+	}
+	return cmd_reply(cli, 501);
+}
+
+#if FT_P_FSM_STATS
+static void site_fsm_line(void *ctx, char const *line)
+{
+	ftp_replyf(ctx, " %s", line);
+}
+#endif
+
+static int cmd_site(struct ftp_cli *cli, char *arg)
+{
+#if FT_P_FSM_STATS
+	/* Statistics of the reactor serving the session only */
+	if (strcasecmp(arg, "FSM") == 0) {
+		ftp_replyf(cli, "211-Sessions state machine:");
+		ftp_fsm_stats_print(&cli->srv->fsm, site_fsm_line, cli);
+		ftp_replyf(cli, "211 End");
+		return 0;
+	}
+#else
+	(void)arg;
+#endif
+	return cmd_reply(cli, 504);
+}
+
+static int cmd_stat(struct ftp_cli *cli, char *arg)
+{
+	/* Listing over the control connection is not supported */
+	if (arg)
+		return cmd_reply(cli, 504);
+
+	struct xfer const *const xfer = &cli->xfer;
+	uint64_t total;
+
+	if (xfer_active(xfer) && xfer->dir == XFER_RECV) {
+		ftp_replyf(cli, "213 Received %lu bytes.",
+		           ftp_xfer_count(cli, &total));
+		return 0;
+	}
+	if (xfer_active(xfer)) {
+		uint64_t const count = ftp_xfer_count(cli, &total);
+
+		/* Listing size is only known once listed */
+		if (xfer->list)
+			ftp_replyf(cli, "213 Transferred %lu bytes.", count);
+		else
+			ftp_replyf(cli, "213 Transferred %lu of %lu bytes.", count,
+			           total);
+		return 0;
+	}
+
+	ftp_replyf(cli, "211-Status of %s:\r\n"
+	                " Logged in as %s\r\n"
+	                " TYPE: %s, STRUcture: File, MODE: %s\r\n"
+	                "211 End of status",
+	           inet_ntoa(cli->addr.sin_addr),
+	           cli->user ? cli->user->user : "nobody",
+	           cli->type == FTP_TYPE_ASCII ? "ASCII" : "BINARY",
+	           cli->mode == FTP_MODE_DEFLATE ? "Deflate"
+	           : cli->mode == FTP_MODE_BLOCK ? "Block" : "Stream");
+	return 0;
+}
+
+static int cmd_help(struct ftp_cli *cli, char *arg);
+
+/* Commands latency is accounted per registry slot */
+_Static_assert(FTP_LAT_SLOTS == (1 << FTP_CMD_BITS) + 1, "latency slots");
+
+/**
+ * Known verbs in alphabetical order, flags and handler
+ * Data transfer commands are registered, so that they are refused as not
+ * implemented rather than unknown. While a transfer runs, only those
+ * flagged `FTP_CMD_XFER` are dispatched, the others wait for its end.
+ */
+#define FTP_CMDS(X) \
+	X('A','B','O','R', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_NOARG | FTP_CMD_XFER, cmd_abor) \
+	X('A','C','C','T', C_CMD,  FTP_CMD_ARG,                 cmd_superfluous) \
+	X('A','L','L','O', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_allo) \
+	X('A','P','P','E', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_appe) \
+	X('C','D','U','P', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_NOARG, cmd_cdup) \
+	X('C','W','D', 0 , C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_cwd) \
+	X('D','E','L','E', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_dele) \
+	X('E','P','R','T', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_eprt) \
+	X('E','P','S','V', C_CMD,  FTP_CMD_LOGIN,               cmd_epsv) \
+	X('F','E','A','T', C_CMD,  FTP_CMD_NOARG,               cmd_feat) \
+	X('H','E','L','P', C_CMD,  0,                           cmd_help) \
+	X('L','I','S','T', C_CMD,  FTP_CMD_LOGIN,               cmd_list) \
+	X('M','D','T','M', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_mdtm) \
+	X('M','K','D', 0 , C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_mkd) \
+	X('M','O','D','E', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_mode) \
+	X('N','L','S','T', C_CMD,  FTP_CMD_LOGIN,               cmd_nlst) \
+	X('N','O','O','P', C_CMD,  FTP_CMD_NOARG | FTP_CMD_XFER, cmd_noop) \
+	X('O','P','T','S', C_CMD,  FTP_CMD_ARG,                 cmd_opts) \
+	X('P','A','S','S', C_PASS, 0,                           NULL) \
+	X('P','A','S','V', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_NOARG, cmd_pasv) \
+	X('P','O','R','T', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_port) \
+	X('P','W','D', 0 , C_CMD,  FTP_CMD_LOGIN | FTP_CMD_NOARG, cmd_pwd) \
+	X('Q','U','I','T', C_CMD,  FTP_CMD_NOARG,               cmd_quit) \
+	X('R','E','I','N', C_CMD,  FTP_CMD_NOARG,               cmd_rein) \
+	X('R','E','S','T', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_rest) \
+	X('R','E','T','R', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_retr) \
+	X('R','M','D', 0 , C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_rmd) \
+	X('R','N','F','R', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_rnfr) \
+	X('R','N','T','O', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_rnto) \
+	X('S','I','T','E', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_site) \
+	X('S','I','Z','E', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_size) \
+	X('S','M','N','T', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_unimplemented) \
+	X('S','T','A','T', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_XFER, cmd_stat) \
+	X('S','T','O','R', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_stor) \
+	X('S','T','O','U', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_NOARG, cmd_stou) \
+	X('S','T','R','U', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_stru) \
+	X('S','Y','S','T', C_CMD,  FTP_CMD_NOARG,               cmd_syst) \
+	X('T','Y','P','E', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_type) \
+	X('U','S','E','R', C_USER, 0,                           NULL) \
+	X('X','C','U','P', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_NOARG, cmd_cdup) \
+	X('X','C','W','D', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_cwd) \
+	X('X','M','K','D', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_mkd) \
+	X('X','P','W','D', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_NOARG, cmd_pwd) \
+	X('X','R','M','D', C_CMD,  FTP_CMD_LOGIN | FTP_CMD_ARG, cmd_rmd)
+
+#define CMD_SLOT(A, B, C, D, EV, FLAGS, FN) \
+	[FTP_CMD_HASH(FTP_VERB(A, B, C, D))] = { \
+		FTP_VERB(A, B, C, D), (EV), (FLAGS), (FN) },
+#define CMD_VERB(A, B, C, D, EV, FLAGS, FN) FTP_VERB(A, B, C, D),
+
+static struct ftp_cmd const g_cmds[1 << FTP_CMD_BITS] = { FTP_CMDS(CMD_SLOT) };
+static uint32_t const g_verbs[] = { FTP_CMDS(CMD_VERB) };
+
+/**
+ * Unpack a verb
+ * @param name [out] NUL terminated verb, 5 bytes
+ */
+static char *cmd_name(uint32_t verb, char *name)
+{
+	for (unsigned i = 0; i < 4; ++i, verb >>= 8)
+		name[i] = (char)(verb & 0xff);
+	name[4] = '\0';
+	return name;
+}
+
+static int cmd_help(struct ftp_cli *cli, char *arg)
+{
+	char name[5];
+
+	if (arg) {
+		struct ftp_req req = { .line = arg };
+
+		if (ftp_cmd_parse(&req) == NULL)
+			return cmd_reply(cli, 502);
+		cmd_name(req.cmd->verb, name);
+		ftp_reply_arg(cli, &g_help, name, strlen(name));
+		return 0;
+	}
+
+	/* 8 verbs per line, 3 letters verbs are padded */
+	char txt[sizeof g_verbs / sizeof *g_verbs * 6 + 32], *p = txt;
+
+	for (size_t i = 0; i < sizeof g_verbs / sizeof *g_verbs; ++i)
+		p += sprintf(p, "%s%-4s", i % 8 ? " " : "\r\n ",
+		             cmd_name(g_verbs[i], name));
+	ftp_replyf(cli, "214-The following commands are recognized:%s\r\n"
+	                "214 Help OK.", txt);
+	return 0;
+}
+
+struct ftp_cmd const *ftp_cmd_parse(struct ftp_req *req)
+{
+	char const *const line = req->line;
+	uint32_t verb = 0;
+	unsigned len = 0;
+
+	/* Verbs are 3 or 4 letters, case insensitive */
+	for (; len < 4 && isalpha(line[len]); ++len)
+		verb |= (uint32_t)toupper(line[len]) << (len * 8);
+	if (len < 3 || (line[len] != ' ' && line[len] != '\0'))
+		return NULL;
+
+	struct ftp_cmd const *const cmd = g_cmds + FTP_CMD_HASH(verb);
+	if (cmd->verb != verb)
+		return NULL;
+
+	req->cmd = cmd;
+	req->arg = line[len] == ' ' && line[len + 1] ? req->line + len + 1 : NULL;
+	return cmd;
+}
+
+int ftp_cmd_run(struct ftp_cli *cli, struct ftp_req const *req)
+{
+	struct ftp_cmd const *const cmd = req->cmd;
+	int ret;
+
+	if ((cmd->flags & FTP_CMD_LOGIN) && !cli->login)
+		ret = cmd_reply(cli, 530);
+	else if ((cmd->flags & FTP_CMD_ARG) && req->arg == NULL)
+		ret = cmd_reply(cli, 501);
+	else if ((cmd->flags & FTP_CMD_NOARG) && req->arg != NULL)
+		ret = cmd_reply(cli, 501);
+	else
+		ret = cmd->fn(cli, req->arg);
+
+	/* RNTO is only valid right after RNFR */
+	if (cli->rnfr && cmd->fn != cmd_rnfr) {
+		free(cli->rnfr);
+		cli->rnfr = NULL;
+	}
+	return ret;
+}
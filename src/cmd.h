@@ -0,0 +1,198 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   cmd.h                                              :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file cmd.h
+ * @brief
+ * Control connection commands registry, verbs are packed in 32 bits and
+ * looked up through a perfect hash: dispatch cost does not depend on the
+ * number of commands
+ */
+#ifndef __CMD_H
+# define __CMD_H
+
+#include "ftp.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Session FSM events, commands are chained from `E_RECV`
+ */
+enum {
+	E_OPEN,
+	E_RECV,
+	E_TIMEOUT,
+	E_DONE,
+
+	C_ERROR,
+	C_WAIT,
+	C_LOGIN,
+	C_CLOSE,
+	C_REIN,
+	C_XFER,
+	C_ABOR,
+
+	C_USER,
+	C_PASS,
+	C_CMD,
+	C_CMD_MAX,
+};
+
+#define IS_CMD(CMD) ((CMD) >= C_USER && (CMD) < C_CMD_MAX)
+
+/**
+ * Pack a verb, shorter ones are padded with zeros
+ */
+#define FTP_VERB(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | \
+                              (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+/**
+ * Registry slot of a packed verb, the multiplier is chosen so that every
+ * known verb lands in its own slot: adding a verb which collides is
+ * reported at build time (initialized field overwritten), pick another one
+ */
+#define FTP_CMD_BITS  (7)
+#define FTP_CMD_MAGIC (0x662db45U)
+#define FTP_CMD_HASH(v) \
+	((uint32_t)((uint32_t)(v) * FTP_CMD_MAGIC) >> (32 - FTP_CMD_BITS))
+
+enum ftp_cmd_flag {
+	FTP_CMD_LOGIN = 1 << 0, /**< Only once logged in */
+	FTP_CMD_ARG   = 1 << 1, /**< Argument required   */
+	FTP_CMD_NOARG = 1 << 2, /**< Argument refused    */
+	FTP_CMD_XFER  = 1 << 3, /**< Run during transfers, others wait */
+};
+
+/**
+ * Command handler
+ * @param arg [in] Command argument, NULL when none given
+ * @return         0 or a chained FSM event
+ */
+typedef int ftp_cmd_fn(struct ftp_cli *cli, char *arg);
+
+struct ftp_cmd {
+	uint32_t verb;  /**< Packed verb, 0 for an empty slot          */
+	uint8_t event;  /**< FSM event raised, `C_CMD` to run `fn`     */
+	uint8_t flags;  /**< `enum ftp_cmd_flag` mask                  */
+	ftp_cmd_fn *fn;
+};
+
+/**
+ * Command line being dispatched, argument of `E_RECV` and of the events
+ * chained from it
+ */
+struct ftp_req {
+	char *line;                /**< NUL terminated, CRLF stripped */
+	struct ftp_cmd const *cmd; /**< Set once parsed               */
+	char *arg;                 /**< NULL when none given          */
+};
+
+/**
+ * Split a command line into its verb and argument
+ * @param req [in,out] Request to parse, `line` set
+ * @return             Registered command, NULL if unknown
+ */
+struct ftp_cmd const *ftp_cmd_parse(struct ftp_req *req);
+
+/**
+ * Check a parsed command may run in the session and run it
+ * @return  0 or a chained FSM event
+ */
+int ftp_cmd_run(struct ftp_cli *cli, struct ftp_req const *req);
+
+/**
+ * Queue a constant reply
+ */
+void ftp_reply(struct ftp_cli *cli, unsigned code);
+
+/**
+ * Hand a passive mode port to the session, the next transfer waits for
+ * the peer to connect to it. Replaces the previous data address.
+ * @param addr [out] Address to give the peer
+ * @return           0 on success, -1 otherwise (errno is set)
+ */
+int ftp_pasv(struct ftp_cli *cli, struct sockaddr_in *addr);
+
+/**
+ * Send a file over the data connection, the session waits for the
+ * transfer end (`E_DONE`, its errno as argument) then replies
+ * @param file [in] Regular file opened for reading, owned from now on
+ * @param off  [in] Offset the transfer starts at
+ * @param end  [in] Offset the transfer ends at
+ * @return          `C_XFER` once started, 0 when refused (replied)
+ */
+int ftp_retr(struct ftp_cli *cli, int file, uint64_t off, uint64_t end);
+
+/**
+ * Send the listing of a directory, or of a single entry, over the data
+ * connection as `ftp_retr` does: entries are listed by the transfer, off
+ * the control reactor when workers move it
+ * @param file  [in] Directory, or single entry, owned from now on
+ * @param names [in] Names only (NLST), `ls -l` like lines otherwise
+ * @param name  [in] Name a single entry is listed by, NULL for a directory
+ * @param verb  [in] Packed verb, LIST or NLST, for the log
+ * @return           `C_XFER` once started, 0 when refused (replied)
+ */
+int ftp_list(struct ftp_cli *cli, int file, bool names, char const *name,
+             uint32_t verb);
+
+/**
+ * Receive a file over the data connection, until the peer closes it,
+ * then reply as `ftp_retr` does
+ * @param file [in] Regular file opened for writing, owned from now on
+ * @param off  [in] Offset received bytes are written from
+ * @param end  [in] Offset the file is allocated up to, room left unused
+ *                  is released
+ * @param verb [in] Packed verb, STOR, APPE or STOU, for the log
+ * @param name [in] Name chosen for the file (STOU), told to the peer
+ *                  in the preliminary reply, NULL if none
+ * @return          `C_XFER` once started, 0 when refused (replied)
+ */
+int ftp_stor(struct ftp_cli *cli, int file, uint64_t off, uint64_t end,
+             uint32_t verb, char const *name);
+
+/**
+ * Progress of the running transfer, safe while a worker moves it
+ * @param total [out] Bytes a send moves in all
+ * @return            Bytes transferred so far
+ */
+uint64_t ftp_xfer_count(struct ftp_cli const *cli, uint64_t *total);
+
+/**
+ * Reply with a variable argument, between constant parts
+ */
+struct ftp_tmpl {
+	struct iovec head; /**< Code and text before the argument */
+	struct iovec tail; /**< Text after the argument, CRLF     */
+};
+
+#define FTP_TMPL(HEAD, TAIL) { \
+	{ (void *)(HEAD), sizeof(HEAD) - 1 }, \
+	{ (void *)(TAIL "\r\n"), sizeof(TAIL "\r\n") - 1 } }
+
+/**
+ * Queue a reply built from a template, without any formatting pass
+ * @param arg [in] Argument, copied
+ * @param len [in] Argument length, may be 0
+ */
+void ftp_reply_arg(struct ftp_cli *cli, struct ftp_tmpl const *tmpl,
+                   char const *arg, size_t len);
+
+/**
+ * Queue a formatted reply, code included, CRLF is appended
+ * Meant for uncommon replies, `ftp_reply_arg` is preferred
+ */
+void ftp_replyf(struct ftp_cli *cli, char const *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#endif /* !__CMD_H */
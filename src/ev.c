@@ -0,0 +1,142 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   ev.c                                               :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "ev.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+int ev_open(struct ev *ev, enum ev_backend backend)
+{
+	if (backend == EV_URING) {
+#if FT_P_IO_URING
+		return ev_uring_open(ev);
+#else
+		return (errno = ENOTSUP), -1;
+#endif
+	}
+
+	int const fd = epoll_create1(EPOLL_CLOEXEC);
+	if (fd < 0) return -1;
+
+	return (*ev = (struct ev){ .fd = fd }), 0;
+}
+
+void ev_close(struct ev *ev)
+{
+#if FT_P_IO_URING
+	if (ev->uring) ev_uring_close(ev);
+#endif
+	if (ev->fd >= 0) close(ev->fd);
+	ev->fd = -1;
+}
+
+static int ev_ctl(struct ev *ev, int op, int fd, uint32_t events,
+                  uint32_t tag)
+{
+	struct epoll_event event = {
+		.events = events,
+		.data.u64 = (uint64_t)(tag & EV_TAG_MASK) << 32 | (uint32_t)fd
+	};
+
+	return epoll_ctl(ev->fd, op, fd, &event);
+}
+
+int ev_add(struct ev *ev, int fd, uint32_t events, uint32_t tag)
+{
+#if FT_P_IO_URING
+	if (ev->uring) return ev_uring_poll(ev, fd, events, tag, 0);
+#endif
+	return ev_ctl(ev, EPOLL_CTL_ADD, fd, events, tag);
+}
+
+int ev_mod(struct ev *ev, int fd, uint32_t events, uint32_t tag)
+{
+#if FT_P_IO_URING
+	if (ev->uring) return ev_uring_poll(ev, fd, events, tag, 1);
+#endif
+	return ev_ctl(ev, EPOLL_CTL_MOD, fd, events, tag);
+}
+
+int ev_del(struct ev *ev, int fd)
+{
+#if FT_P_IO_URING
+	if (ev->uring) return ev_uring_cancel(ev, fd);
+#endif
+	return ev_ctl(ev, EPOLL_CTL_DEL, fd, 0, 0);
+}
+
+int ev_accept(struct ev *ev, int fd, uint32_t tag)
+{
+#if FT_P_IO_URING
+	if (ev->uring) return ev_uring_accept(ev, fd, tag);
+#endif
+	return ev_add(ev, fd, EV_READ, tag);
+}
+
+int ev_recv(struct ev *ev, int fd, uint32_t tag)
+{
+#if FT_P_IO_URING
+	if (ev->uring) return ev_uring_recv(ev, fd, tag);
+#endif
+	return ev_add(ev, fd, EV_READ, tag);
+}
+
+int ev_recv_set(struct ev *ev, int fd, uint32_t tag, uint32_t events)
+{
+#if FT_P_IO_URING
+	/* Sends complete on their own, only receptions are toggled */
+	if (ev->uring)
+		return (events & EV_READ) ? ev_uring_recv(ev, fd, tag)
+		                          : ev_uring_recv_cancel(ev, fd, tag);
+#endif
+	return ev_mod(ev, fd, events, tag);
+}
+
+ssize_t ev_sendmsg(struct ev *ev, int fd, uint32_t tag,
+                   struct msghdr const *msg)
+{
+#if FT_P_IO_URING
+	if (ev->uring) {
+		if (ev_uring_sendmsg(ev, fd, tag, msg)) return -1;
+		return (errno = EINPROGRESS), -1;
+	}
+#else
+	(void)ev;
+	(void)tag;
+#endif
+	return sendmsg(fd, msg, MSG_NOSIGNAL);
+}
+
+int ev_wait(struct ev *ev, ev_event_t *evs, int n, int timeout)
+{
+#if FT_P_IO_URING
+	if (ev->uring) return ev_uring_wait(ev, evs, n, timeout);
+#endif
+	struct epoll_event events[EV_MAX_EVENTS];
+	int ret;
+
+	if (n > EV_MAX_EVENTS) n = EV_MAX_EVENTS;
+
+	/* Signal interruption is not an error for the caller */
+	while ((ret = epoll_wait(ev->fd, events, n, timeout)) < 0 &&
+	       errno == EINTR)
+		timeout = 0;
+
+	for (int i = 0; i < ret; ++i)
+		evs[i] = (ev_event_t){
+			.fd = (int)(uint32_t)events[i].data.u64,
+			.tag = (uint32_t)(events[i].data.u64 >> 32),
+			.events = events[i].events,
+		};
+	return ret;
+}
@@ -0,0 +1,204 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   ev.h                                               :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file ev.h
+ * @brief
+ * Event reactor, with an epoll (readiness) backend and an optional
+ * io_uring (completion) backend.
+ *
+ * Both backends report descriptors readiness for `ev_add`ed descriptors.
+ * The io_uring backend also completes operations on its own: accepts of
+ * `ev_accept`ed listeners, receptions of `ev_recv`ed sockets (into a ring
+ * of provided buffers) and sends of `ev_sendmsg`, whose submission is
+ * batched with the next `ev_wait`. With the epoll backend those report
+ * plain readiness and sends complete synchronously.
+ */
+#ifndef __EV_H
+# define __EV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#ifndef FT_P_IO_URING
+# define FT_P_IO_URING 0
+#endif
+
+#define EV_READ   (EPOLLIN | EPOLLRDHUP) /**< Watch for incoming data    */
+#define EV_WRITE  (EPOLLOUT)             /**< Watch for output space     */
+#define EV_ERROR  (EPOLLERR | EPOLLHUP)  /**< Always reported by kernel  */
+
+#define EV_ACCEPT (1U << 28) /**< Accept completed, `res` is the socket  */
+#define EV_RECV   (1U << 29) /**< Receive completed, `res` bytes in `buf` */
+#define EV_SEND   (1U << 30) /**< Send completed, `res` bytes sent        */
+
+#define EV_MAX_EVENTS (256) /**< Maximum number of events per wakeup */
+#define EV_TAG_MASK (0xfffffff) /**< Significant bits of tags */
+
+#define EV_URING_ENTRIES (1024) /**< Submission queue size            */
+#define EV_URING_BUFS     (256) /**< Provided receive buffers          */
+#define EV_URING_BUF_SIZE (4096) /**< Size of a provided receive buffer */
+
+enum ev_backend {
+	EV_EPOLL = 0,
+	EV_URING,
+};
+
+/**
+ * Reported event
+ * `tag` is the value given when the operation was requested (masked by
+ * `EV_TAG_MASK`), it allows to discard events of a descriptor closed then
+ * reused by the kernel.
+ */
+typedef struct ev_event {
+	int fd;          /**< Related descriptor                      */
+	uint32_t tag;    /**< Caller tag of the operation             */
+	uint32_t events; /**< Readiness mask or completion kind       */
+	int res;         /**< Completion result, negated errno on error */
+	void *buf;       /**< Received data for `EV_RECV`             */
+} ev_event_t;
+
+struct ev_uring;
+
+/**
+ * Event reactor definition
+ */
+typedef struct ev {
+	int fd;                 /**< Reactor descriptor               */
+	struct ev_uring *uring; /**< io_uring state, NULL for epoll   */
+} ev_t;
+
+/**
+ * Open a new event reactor
+ * @param ev     [out] Reactor to initialize
+ * @param backend [in] Requested backend
+ * @return             0 on success, -1 otherwise (errno is set)
+ */
+int ev_open(struct ev *ev, enum ev_backend backend);
+
+/**
+ * Close an event reactor, registered descriptors are left untouched
+ * @param ev  [in,out] Reactor to close
+ */
+void ev_close(struct ev *ev);
+
+/**
+ * Register a descriptor once, it will stay registered until `ev_del`
+ * @param ev     [in] Targeted reactor
+ * @param fd     [in] Descriptor to watch
+ * @param events [in] Mask of `EV_READ` and/or `EV_WRITE`
+ * @param tag    [in] Reported along with events
+ * @return            0 on success, -1 otherwise (errno is set)
+ */
+int ev_add(struct ev *ev, int fd, uint32_t events, uint32_t tag);
+
+/**
+ * Change the watched events of an already registered descriptor
+ * @param ev     [in] Targeted reactor
+ * @param fd     [in] Registered descriptor
+ * @param events [in] New mask of `EV_READ` and/or `EV_WRITE`
+ * @param tag    [in] Tag given at registration
+ * @return            0 on success, -1 otherwise (errno is set)
+ */
+int ev_mod(struct ev *ev, int fd, uint32_t events, uint32_t tag);
+
+/**
+ * Forget a descriptor, pending operations on it are cancelled
+ * @param ev  [in] Targeted reactor
+ * @param fd  [in] Descriptor
+ * @return         0 on success, -1 otherwise (errno is set)
+ */
+int ev_del(struct ev *ev, int fd);
+
+/**
+ * Watch a listener for incoming connections, reported as `EV_ACCEPT`
+ * completions or as `EV_READ` readiness (the caller accepts)
+ * A failed `EV_ACCEPT` completion stops the watch, call again to resume
+ * @param ev  [in] Targeted reactor
+ * @param fd  [in] Listening socket
+ * @param tag [in] Reported along with events
+ * @return         0 on success, -1 otherwise (errno is set)
+ */
+int ev_accept(struct ev *ev, int fd, uint32_t tag);
+
+/**
+ * Watch a socket for incoming data, reported as `EV_RECV` completions
+ * or as `EV_READ` readiness (the caller receives)
+ * Completed buffers are valid until the next `ev_wait`.
+ * @param ev  [in] Targeted reactor
+ * @param fd  [in] Connected socket
+ * @param tag [in] Reported along with events
+ * @return         0 on success, -1 otherwise (errno is set)
+ */
+int ev_recv(struct ev *ev, int fd, uint32_t tag);
+
+/**
+ * Change what is watched on a socket armed by `ev_recv`
+ * @param ev     [in] Targeted reactor
+ * @param fd     [in] Connected socket
+ * @param tag    [in] Tag given to `ev_recv`
+ * @param events [in] `EV_READ` to keep receiving, `EV_WRITE` to be told
+ *                    about output space (readiness backend only)
+ * @return            0 on success, -1 otherwise (errno is set)
+ */
+int ev_recv_set(struct ev *ev, int fd, uint32_t tag, uint32_t events);
+
+/**
+ * @param ev  [in] Targeted reactor
+ * @return         Whether sends complete asynchronously, their data must
+ *                 then outlive the call to `ev_sendmsg`
+ */
+static inline int ev_async(struct ev const *ev)
+{
+	return ev->uring != NULL;
+}
+
+/**
+ * Send a message, `msg` and its data must stay valid until completion
+ * @param ev  [in] Targeted reactor
+ * @param fd  [in] Connected socket
+ * @param tag [in] Reported along with the completion
+ * @param msg [in] Message to send
+ * @return         Bytes sent, or -1 with errno set to EINPROGRESS when
+ *                 completion is reported later as `EV_SEND`
+ */
+ssize_t ev_sendmsg(struct ev *ev, int fd, uint32_t tag,
+                   struct msghdr const *msg);
+
+/**
+ * Submit pending operations and wait for events
+ * @param ev      [in] Targeted reactor
+ * @param evs    [out] Events, only ready or completed ones are reported
+ * @param n       [in] Capacity of `evs`
+ * @param timeout [in] Timeout in milliseconds, -1 to wait forever
+ * @return             Number of events, -1 otherwise (errno is set)
+ */
+int ev_wait(struct ev *ev, ev_event_t *evs, int n, int timeout);
+
+#if FT_P_IO_URING
+int ev_uring_open(struct ev *ev);
+void ev_uring_close(struct ev *ev);
+int ev_uring_poll(struct ev *ev, int fd, uint32_t events, uint32_t tag,
+                  int update);
+int ev_uring_cancel(struct ev *ev, int fd);
+int ev_uring_accept(struct ev *ev, int fd, uint32_t tag);
+int ev_uring_recv(struct ev *ev, int fd, uint32_t tag);
+int ev_uring_recv_cancel(struct ev *ev, int fd, uint32_t tag);
+int ev_uring_sendmsg(struct ev *ev, int fd, uint32_t tag,
+                     struct msghdr const *msg);
+int ev_uring_wait(struct ev *ev, ev_event_t *evs, int n, int timeout);
+#endif
+
+#endif /* !__EV_H */
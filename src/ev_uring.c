@@ -0,0 +1,427 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   ev_uring.c                                         :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "ev.h"
+
+#if FT_P_IO_URING
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define BGID (0) /**< Buffer group of provided receive buffers */
+
+/* user_data layout: operation (4 bits), tag (28 bits), descriptor */
+enum {
+	OP_POLL = 1,
+	OP_ACCEPT,
+	OP_RECV,
+	OP_SEND,
+	OP_CANCEL,
+};
+
+#define UDATA(OP, TAG, FD) \
+	((uint64_t)(OP) << 60 | ((uint64_t)(TAG) & EV_TAG_MASK) << 32 | \
+	 (uint32_t)(FD))
+#define UDATA_OP(U)  ((unsigned)((U) >> 60))
+#define UDATA_TAG(U) ((uint32_t)((U) >> 32) & EV_TAG_MASK)
+#define UDATA_FD(U)  ((int)(uint32_t)(U))
+
+struct ev_uring {
+	unsigned *sq_head, *sq_tail, sq_mask;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	unsigned sq_pending;           /**< Prepared, not yet submitted */
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring;
+	size_t ring_sz, sqes_sz;
+
+	struct io_uring_buf_ring *br;  /**< Provided receive buffers     */
+	char *bufs;
+	uint16_t br_tail;
+	uint16_t used[EV_URING_BUFS];  /**< Buffers handed to the caller */
+	unsigned nused;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait,
+                       unsigned flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+	                    arg, argsz);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned n)
+{
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static __always_inline void buf_give(struct ev_uring *u, uint16_t bid)
+{
+	struct io_uring_buf *const buf =
+		u->br->bufs + (u->br_tail & (EV_URING_BUFS - 1));
+
+	buf->addr = (uintptr_t)(u->bufs + (size_t)bid * EV_URING_BUF_SIZE);
+	buf->len = EV_URING_BUF_SIZE;
+	buf->bid = bid;
+	++u->br_tail;
+}
+
+static __always_inline void buf_publish(struct ev_uring *u)
+{
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int submit(struct ev *ev, unsigned wait, struct timespec *ts)
+{
+	struct ev_uring *const u = ev->uring;
+	struct io_uring_getevents_arg arg = {
+		.ts = (uintptr_t)ts,
+	};
+	unsigned const flags = IORING_ENTER_EXT_ARG |
+		(wait ? IORING_ENTER_GETEVENTS : 0);
+
+	int ret;
+
+	do ret = uring_enter(ev->fd, u->sq_pending, wait, flags,
+	                     &arg, sizeof arg);
+	while (ret < 0 && errno == EINTR && !wait);
+
+	if (ret >= 0) u->sq_pending -= (unsigned)ret;
+	return ret < 0 && (errno == ETIME || errno == EINTR) ? 0 : ret;
+}
+
+static struct io_uring_sqe *sqe_get(struct ev *ev)
+{
+	struct ev_uring *const u = ev->uring;
+	unsigned const tail = *u->sq_tail;
+
+	/* Queue is full, flush it to the kernel first */
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > u->sq_mask) {
+		if (submit(ev, 0, NULL) < 0) return NULL;
+		if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > u->sq_mask)
+			return (errno = EBUSY), NULL;
+	}
+
+	struct io_uring_sqe *const sqe = u->sqes + (tail & u->sq_mask);
+
+	memset(sqe, 0, sizeof *sqe);
+	return sqe;
+}
+
+static void sqe_push(struct ev *ev)
+{
+	struct ev_uring *const u = ev->uring;
+
+	__atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+	++u->sq_pending;
+}
+
+int ev_uring_open(struct ev *ev)
+{
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+		         IORING_SETUP_COOP_TASKRUN,
+		.cq_entries = EV_URING_ENTRIES * 4,
+	};
+	struct ev_uring *const u = calloc(1, sizeof *u);
+	if (u == NULL) return -1;
+
+	*ev = (struct ev){ .fd = -1, .uring = u };
+
+	ev->fd = uring_setup(EV_URING_ENTRIES, &p);
+	if (ev->fd < 0) goto abort;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOTSUP;
+		goto abort;
+	}
+
+	/* Submission and completion rings share a single mapping */
+	size_t const sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t const cq_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+
+	u->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+	u->ring = mmap(NULL, u->ring_sz, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, ev->fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED) goto abort_ring;
+
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, ev->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) goto abort_sqes;
+
+	char *const ring = u->ring;
+
+	u->sq_head = (unsigned *)(ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+	u->cq_head = (unsigned *)(ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	/* Identity mapping, SQEs are consumed in order */
+	unsigned *const array = (unsigned *)(ring + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; ++i) array[i] = i;
+
+	/* Ring of provided buffers for multishot receptions */
+	if (posix_memalign((void **)&u->br, (size_t)sysconf(_SC_PAGESIZE),
+	                   EV_URING_BUFS * sizeof(struct io_uring_buf))) {
+		u->br = NULL;
+		goto abort_bufs;
+	}
+	u->bufs = malloc((size_t)EV_URING_BUFS * EV_URING_BUF_SIZE);
+	if (u->bufs == NULL) goto abort_bufs;
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t)u->br,
+		.ring_entries = EV_URING_BUFS,
+		.bgid = BGID,
+	};
+
+	memset(u->br, 0, EV_URING_BUFS * sizeof(struct io_uring_buf));
+	if (uring_register(ev->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		goto abort_bufs;
+
+	for (uint16_t bid = 0; bid < EV_URING_BUFS; ++bid)
+		buf_give(u, bid);
+	buf_publish(u);
+	return 0;
+
+abort_bufs:
+	free(u->bufs);
+	free(u->br);
+	munmap(u->sqes, u->sqes_sz);
+abort_sqes:
+	munmap(u->ring, u->ring_sz);
+abort_ring:
+	close(ev->fd);
+abort:
+	free(u);
+	return -1;
+}
+
+void ev_uring_close(struct ev *ev)
+{
+	struct ev_uring *const u = ev->uring;
+
+	/* Kernel writes into the rings and the provided buffers until the
+	 * ring is gone: released only once it is closed */
+	close(ev->fd);
+	ev->fd = -1;
+	munmap(u->sqes, u->sqes_sz);
+	munmap(u->ring, u->ring_sz);
+	free(u->bufs);
+	free(u->br);
+	free(u);
+	ev->uring = NULL;
+}
+
+int ev_uring_poll(struct ev *ev, int fd, uint32_t events, uint32_t tag,
+                  int update)
+{
+	struct io_uring_sqe *const sqe = sqe_get(ev);
+	if (sqe == NULL) return -1;
+
+	sqe->opcode = update ? IORING_OP_POLL_REMOVE : IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = UDATA(OP_POLL, tag, fd);
+
+	/* Update is told apart from the poll it targets, which keeps its
+	 * own user data: its completion is not a poll event to re-arm */
+	if (update) {
+		sqe->addr = sqe->user_data;
+		sqe->user_data = UDATA(OP_CANCEL, 0, fd);
+		sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+		sqe->fd = -1;
+	} else
+		sqe->len = IORING_POLL_ADD_MULTI;
+	return sqe_push(ev), 0;
+}
+
+int ev_uring_cancel(struct ev *ev, int fd)
+{
+	struct io_uring_sqe *const sqe = sqe_get(ev);
+	if (sqe == NULL) return -1;
+
+	/* Completions of cancelled operations are still reported, with
+	 * the tag they were requested with */
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = UDATA(OP_CANCEL, 0, fd);
+	sqe_push(ev);
+
+	/* Descriptor is about to be closed, cancel before that happens */
+	return submit(ev, 0, NULL) < 0 ? -1 : 0;
+}
+
+int ev_uring_accept(struct ev *ev, int fd, uint32_t tag)
+{
+	struct io_uring_sqe *const sqe = sqe_get(ev);
+	if (sqe == NULL) return -1;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = UDATA(OP_ACCEPT, tag, fd);
+	return sqe_push(ev), 0;
+}
+
+int ev_uring_recv(struct ev *ev, int fd, uint32_t tag)
+{
+	struct io_uring_sqe *const sqe = sqe_get(ev);
+	if (sqe == NULL) return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BGID;
+	sqe->user_data = UDATA(OP_RECV, tag, fd);
+	return sqe_push(ev), 0;
+}
+
+int ev_uring_recv_cancel(struct ev *ev, int fd, uint32_t tag)
+{
+	struct io_uring_sqe *const sqe = sqe_get(ev);
+	if (sqe == NULL) return -1;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = UDATA(OP_RECV, tag, fd);
+	sqe->user_data = UDATA(OP_CANCEL, 0, fd);
+	return sqe_push(ev), 0;
+}
+
+int ev_uring_sendmsg(struct ev *ev, int fd, uint32_t tag,
+                     struct msghdr const *msg)
+{
+	struct io_uring_sqe *const sqe = sqe_get(ev);
+	if (sqe == NULL) return -1;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = UDATA(OP_SEND, tag, fd);
+	return sqe_push(ev), 0;
+}
+
+int ev_uring_wait(struct ev *ev, ev_event_t *evs, int n, int timeout)
+{
+	struct ev_uring *const u = ev->uring;
+
+	/* Buffers of the previous batch were consumed by the caller */
+	if (u->nused) {
+		while (u->nused) buf_give(u, u->used[--u->nused]);
+		buf_publish(u);
+	}
+
+	unsigned head = *u->cq_head;
+
+	/* Every prepared operation is submitted along with the wait */
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) || u->sq_pending) {
+		struct timespec ts = {
+			.tv_sec = timeout / 1000,
+			.tv_nsec = (long)(timeout % 1000) * 1000000,
+		};
+		bool const wait = timeout != 0 &&
+			head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (submit(ev, wait, timeout < 0 ? NULL : &ts) < 0)
+			return -1;
+	}
+
+	unsigned const tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	int ret = 0;
+
+	for (; head != tail && ret < n; ++head) {
+		struct io_uring_cqe const *const cqe = u->cqes + (head & u->cq_mask);
+		uint64_t const udata = cqe->user_data;
+		int const fd = UDATA_FD(udata);
+		uint32_t const tag = UDATA_TAG(udata);
+		ev_event_t *const e = evs + ret;
+
+		*e = (ev_event_t){ .fd = fd, .tag = tag, .res = cqe->res };
+
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			uint16_t const bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+			u->used[u->nused++] = bid;
+			e->buf = u->bufs + (size_t)bid * EV_URING_BUF_SIZE;
+		}
+
+		switch (UDATA_OP(udata)) {
+		case OP_POLL:
+			/* Removed or updated poll requests report nothing */
+			if (cqe->res < 0) {
+				if (cqe->res == -ECANCELED || cqe->res == -ENOENT ||
+				    cqe->res == -EALREADY)
+					continue;
+				e->events = EV_ERROR;
+			} else
+				e->events = (uint32_t)cqe->res;
+			/* Watchers are single direction, re-arm what fired */
+			if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res >= 0)
+				ev_uring_poll(ev, fd, ((uint32_t)cqe->res & EV_WRITE)
+				              ? EV_WRITE : EV_READ, tag, 0);
+			break;
+		case OP_ACCEPT:
+			if (cqe->res == -ECANCELED) continue;
+			/* Failures end the accept, the owner re-arms once able to
+			 * take connections again */
+			e->events = EV_ACCEPT;
+			if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res >= 0)
+				ev_uring_accept(ev, fd, tag);
+			break;
+		case OP_RECV:
+			if (cqe->res == -ECANCELED) continue;
+			/* Ran out of buffers, those handed out return on next wait */
+			if (cqe->res == -ENOBUFS) {
+				ev_uring_recv(ev, fd, tag);
+				continue;
+			}
+			e->events = EV_RECV;
+			if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res > 0)
+				ev_uring_recv(ev, fd, tag);
+			break;
+		case OP_SEND:
+			e->events = EV_SEND;
+			break;
+		default:
+			continue;
+		}
+		++ret;
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return ret;
+}
+
+#endif
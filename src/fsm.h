@@ -18,6 +18,15 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#ifndef FT_P_FSM_STATS
+# define FT_P_FSM_STATS 0
+#endif
+
+#if FT_P_FSM_STATS
+# include <stdlib.h>
+# include <time.h>
+#endif
+
 #ifndef offsetof
 # define offsetof(type, field) \
 	((size_t)((uintptr_t)&(((type *)(0))->field) - (uintptr_t)(0)))
@@ -29,15 +38,28 @@
 #endif
 
 /**
- * This code is used as delimiter of the end of
- * transition table, also as a collector of unhandled events at the current
- * state.
+ * This code tags the transition a state takes for every event it does not
+ * handle explicitly.
  */
 #define FSM_E_DEFAULT  (-1)
 
 typedef struct fsm fsm_t;
 typedef int fsm_act_t(fsm_t const *, int ecode, void *arg);
 
+/**
+ * Dense transition table row of `NEVENTS` events: every event takes the
+ * default transition, unless overridden by a following `FSM_ON`
+ * @note GNU range initializer, overrides are expected (-Woverride-init)
+ */
+#define FSM_ROW(NEVENTS, ACT, NEXT) \
+	[0 ... (NEVENTS) - 1] = { FSM_E_DEFAULT, (ACT), (NEXT) }
+
+/**
+ * Transition of an event handled by a dense transition table row
+ */
+#define FSM_ON(ECODE, ACT, NEXT) \
+	[ECODE] = { (ECODE), (ACT), (NEXT) }
+
 /**
  * Finite state machine transition definition
  */
@@ -47,31 +69,142 @@ struct fsm_trans {
 	int next_state; /**< Next state to reach                      */
 };
 
+#if FT_P_FSM_STATS
+
+# if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define FSM_CLOCK_UNIT "cycles"
+
+static __always_inline uint64_t fsm_clock(void)
+{
+	return __rdtsc();
+}
+# else
+#  define FSM_CLOCK_UNIT "ns"
+
+static __always_inline uint64_t fsm_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+# endif
+
+/**
+ * Statistics of FSMs sharing a transition table, written by a single
+ * thread and readable from any other one
+ */
+struct fsm_stats {
+	int nstates;
+	int nevents;
+	uint64_t *count;  /**< Transitions taken, per state and event    */
+	uint64_t *ticks;  /**< Actions time, per state and event         */
+	uint64_t *active; /**< FSMs currently in each state              */
+};
+
+/**
+ * Single writer increment, seen whole by readers
+ */
+static __always_inline void fsm_stats_inc(uint64_t *value, uint64_t n)
+{
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n,
+	                 __ATOMIC_RELAXED);
+}
+
+/**
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static inline int fsm_stats_init(struct fsm_stats *stats, int nstates,
+                                 int nevents)
+{
+	size_t const n = (size_t)nstates * (size_t)nevents;
+
+	*stats = (struct fsm_stats){ .nstates = nstates, .nevents = nevents };
+	if ((stats->count = calloc(2 * n + (size_t)nstates,
+	                           sizeof(uint64_t))) == NULL)
+		return -1;
+	stats->ticks = stats->count + n;
+	stats->active = stats->ticks + n;
+	return 0;
+}
+
+static inline void fsm_stats_fini(struct fsm_stats *stats)
+{
+	free(stats->count);
+	*stats = (struct fsm_stats){ };
+}
+
+/**
+ * Add statistics to `sum`, both of the same dimensions
+ */
+static inline void fsm_stats_sum(struct fsm_stats *sum,
+                                 struct fsm_stats const *stats)
+{
+	size_t const n = (size_t)stats->nstates * (size_t)stats->nevents;
+
+	for (size_t i = 0; i < 2 * n + (size_t)stats->nstates; ++i)
+		sum->count[i] += __atomic_load_n(stats->count + i, __ATOMIC_RELAXED);
+}
+
+#endif
+
 /**
  * Finite state machine definition
  * @note
- * All event's code are defined positive, except the `FSM_E_DEFAULT` code
- * above. This code is used as delimiter of the end of transition table,
- * also as a collector of unhandled events at the current state.
- * Indeed this transition is executed for all unhandled events.
+ * All event's code are defined positive and below the number of events,
+ * each state owns a dense row of transitions indexed by event code (see
+ * `FSM_ROW`): triggering an event is a single indexed load.
  */
 struct fsm {
 	struct fsm_trans const *const *stt; /**< Transition table for each state */
+	int nevents;                        /**< Events per transition table     */
 	int state;                          /**< Current state                   */
+#if FT_P_FSM_STATS
+	struct fsm_stats *stats;            /**< Optional statistics             */
+#endif
 };
 
 /**
  * Initialize a finite state machine instance
  * @param fsm  [in,out] FSM to initialize
  * @param initial  [in] FSM initial state
- * @param stt      [in] FSM state transition table
+ * @param stt      [in] FSM state transition table, dense rows
+ * @param nevents  [in] Number of events of each row
  */
 static __always_inline void fsm_init(struct fsm *fsm, int initial,
-                                     struct fsm_trans const *const *stt)
+                                     struct fsm_trans const *const *stt,
+                                     int nevents)
 {
-	*fsm = (struct fsm){ .stt = stt, .state = initial };
+	*fsm = (struct fsm){ .stt = stt, .nevents = nevents, .state = initial };
 }
 
+/**
+ * Release a finite state machine instance
+ */
+static __always_inline void fsm_fini(struct fsm *fsm)
+{
+#if FT_P_FSM_STATS
+	if (fsm->stats)
+		fsm_stats_inc(fsm->stats->active + fsm->state, (uint64_t)-1);
+#else
+	(void)fsm;
+#endif
+}
+
+#if FT_P_FSM_STATS
+/**
+ * Account a finite state machine instance transitions in `stats`, from
+ * its current state on
+ */
+static __always_inline void fsm_stats_attach(struct fsm *fsm,
+                                             struct fsm_stats *stats)
+{
+	fsm->stats = stats;
+	fsm_stats_inc(stats->active + fsm->state, 1);
+}
+#endif
+
 /**
  * Trigger an event in the finite state machine
  * @param fsm  [in,out] FSM targeted
@@ -87,17 +220,37 @@ static __always_inline int fsm_trigger(struct fsm *fsm, int ecode, void *arg)
 	/* Select the transition table of the current state.
 	 * Then process to the transition...
 	 * Which can post a condition to the transition... */
-	const struct fsm_trans *trans = fsm->stt[fsm->state];
+	struct fsm_trans const *const row = fsm->stt[fsm->state];
+	struct fsm_trans const *trans;
 
 	do {
-		for (; trans->ecode != ecode &&
-		       trans->ecode != FSM_E_DEFAULT; ++trans);
-		ecode = trans->act ? trans->act(fsm, ecode, arg) : 0;
-
 		/* Sanity check */
-		assert(fsm->stt);
+		assert(ecode < fsm->nevents);
+
+		trans = row + ecode;
+#if FT_P_FSM_STATS
+		struct fsm_stats *const stats = fsm->stats;
+		uint64_t const start = stats ? fsm_clock() : 0;
+		int const next = trans->act ? trans->act(fsm, ecode, arg) : 0;
+
+		if (stats) {
+			int const at = fsm->state * stats->nevents + ecode;
+
+			fsm_stats_inc(stats->count + at, 1);
+			fsm_stats_inc(stats->ticks + at, fsm_clock() - start);
+		}
+		ecode = next;
+#else
+		ecode = trans->act ? trans->act(fsm, ecode, arg) : 0;
+#endif
 	} while (ecode > 0);
 
+#if FT_P_FSM_STATS
+	if (fsm->stats && fsm->state != trans->next_state) {
+		fsm_stats_inc(fsm->stats->active + fsm->state, (uint64_t)-1);
+		fsm_stats_inc(fsm->stats->active + trans->next_state, 1);
+	}
+#endif
 	return (fsm->state = trans->next_state), ecode;
 }
 
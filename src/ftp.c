@@ -11,181 +11,899 @@
 /* ************************************************************************** */
 
 #include "ftp.h"
-#include "netbuf.h"
+#include "clock.h"
+#include "cmd.h"
 #include "fsm.h"
+#include "log.h"
+#include "scan.h"
+#include "zmode.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-#include <sys/time.h>
+#include <time.h>
 #include <ctype.h>
+#include <poll.h>
 
-#define BUF_SIZE (4096)
-#define SNS(s) (s),sizeof(s)-1
-
-static char const *getcmd(unsigned const code, size_t *sz)
-{
-#define STR_(x) #x
-#define STR(x) STR_(x)
-#define CMD(C, MSG) case (C): \
-	return (sz ? (*sz = sizeof(STR(C)" "MSG"\r\n")-1) : (void)0), STR(C)" "MSG"\r\n"
-
-	switch (code) {
-	CMD(200, "Command okay.");
-	CMD(202, "Command not implemented, superfluous at this site.");
-	CMD(211, "System status, or system help reply.");
-	CMD(212, "Directory status.");
-	CMD(213, "File status.");
-	CMD(214, "Help message."
-	         "On how to use the server or the meaning of a particular\n"
-	         "non-standard command.  This reply is useful only to the\n"
-	         "human user.");
-	CMD(215, "NAME system type.\n"
-	         "Where NAME is an official system name from the list in the\n"
-	         "Assigned Numbers document.");
-	CMD(220, "Service ready for new user.");
-	CMD(221, "Service closing control connection.\n"
-	         "Logged out if appropriate.");
-	CMD(225, "Data connection open; no transfer in progress.\n");
-	CMD(226, "Closing data connection.\n"
-	         "Requested file action successful (for example, file\n"
-	         "transfer or file abort).");
-	CMD(227, "Entering Passive Mode (h1,h2,h3,h4,p1,p2).");
-	CMD(230, "User logged in, proceed.");
-	CMD(250, "Requested file action okay, completed.");
-	CMD(257, "\"PATHNAME\" created.");
-	CMD(331, "User name okay, need password.");
-	CMD(332, "Need account for login.");
-	CMD(350, "Requested file action pending further information.");
-	CMD(421, "Service not available, closing control connection.\n"
-	         "This may be a reply to any command if the service knows it\n"
-	         "must shut down.");
-	CMD(425, "Can't open data connection.");
-	CMD(426, "Connection closed; transfer aborted.");
-	CMD(450, "Requested file action not taken.\n"
-	         "File unavailable (e.g., file busy).");
-	CMD(451, "Requested action aborted: local error in processing.");
-	CMD(452, "Requested action not taken."
-	         "Insufficient storage space in system.");
-	CMD(500, "Syntax error, command unrecognized."
-	         "This may include errors such as command line too long.");
-	CMD(501, "Syntax error in parameters or arguments.");
-	CMD(502, "Command not implemented.");
-	CMD(503, "Bad sequence of commands.");
-	CMD(504, "Command not implemented for that parameter.");
-	CMD(530, "Not logged in.");
-	CMD(532, "Need account for storing files.");
-	CMD(550, "Requested action not taken."
-	         "File unavailable (e.g., file not found, no access).");
-	CMD(551, "Requested action aborted: page type unknown.");
-	CMD(552, "Requested file action aborted."
-	         "Exceeded storage allocation (for current directory or"
-	         "dataset).");
-	CMD(553, "Requested action not taken."
-	         "File name not allowed.");
-	default: return NULL;
-	}
-}
-
-struct netbuf
-{
-	char const *buf;
-	uint16_t pos, size;
+
+#define REPLY(C, MSG) \
+	[C] = { (void *)(#C " " MSG "\r\n"), sizeof(#C " " MSG "\r\n") - 1 }
+
+/**
+ * Constant replies indexed by code, ready to be sent as they are
+ */
+static struct iovec const g_replies[FTP_REPLY_CODES] = {
+	REPLY(150, "File status okay; about to open data connection."),
+	REPLY(200, "Command okay."),
+	REPLY(202, "Command not implemented, superfluous at this site."),
+	REPLY(211, "System status, or system help reply."),
+	REPLY(212, "Directory status."),
+	REPLY(213, "File status."),
+	REPLY(214, "Help message."),
+	REPLY(215, "UNIX Type: L8"),
+	REPLY(220, "Service ready for new user."),
+	REPLY(221, "Service closing control connection."),
+	REPLY(225, "Data connection open; no transfer in progress."),
+	REPLY(226, "Closing data connection."),
+	REPLY(230, "User logged in, proceed."),
+	REPLY(250, "Requested file action okay, completed."),
+	REPLY(331, "User name okay, need password."),
+	REPLY(332, "Need account for login."),
+	REPLY(350, "Requested file action pending further information."),
+	REPLY(421, "Service not available, closing control connection."),
+	REPLY(425, "Can't open data connection."),
+	REPLY(426, "Connection closed; transfer aborted."),
+	REPLY(450, "Requested file action not taken."),
+	REPLY(451, "Requested action aborted: local error in processing."),
+	REPLY(452, "Requested action not taken. "
+	           "Insufficient storage space in system."),
+	REPLY(500, "Syntax error, command unrecognized."),
+	REPLY(501, "Syntax error in parameters or arguments."),
+	REPLY(502, "Command not implemented."),
+	REPLY(503, "Bad sequence of commands."),
+	REPLY(504, "Command not implemented for that parameter."),
+	REPLY(522, "Network protocol not supported, use (1)."),
+	REPLY(530, "Not logged in."),
+	REPLY(532, "Need account for storing files."),
+	REPLY(550, "Requested action not taken. File unavailable."),
+	REPLY(551, "Requested action aborted: page type unknown."),
+	REPLY(552, "Requested file action aborted. "
+	           "Exceeded storage allocation."),
+	REPLY(553, "Requested action not taken. File name not allowed."),
 };
 
-static __always_inline char const *netbuf_read(struct netbuf *buf, size_t n)
+static int outq_push(struct ftp_outq *q, void const *data, size_t len)
+{
+	while (len) {
+		struct ftp_chunk *chunk = q->tail;
+
+		/* Chunks are appended, never moved: in flight bytes stay valid */
+		if (chunk == NULL || chunk->len == FTP_CHUNK_SIZE) {
+			if ((chunk = malloc(sizeof *chunk)) == NULL) return -1;
+			chunk->next = NULL;
+			chunk->len = 0;
+			if (q->tail) q->tail->next = chunk;
+			else q->head = chunk;
+			q->tail = chunk;
+		}
+
+		size_t const n = FTP_CHUNK_SIZE - chunk->len < len
+			? FTP_CHUNK_SIZE - chunk->len : len;
+
+		memcpy(chunk->data + chunk->len, data, n);
+		chunk->len += n;
+		q->len += n;
+		data = (char const *)data + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void outq_consume(struct ftp_outq *q, size_t n)
+{
+	q->len -= n;
+	while (n) {
+		struct ftp_chunk *const chunk = q->head;
+		size_t const avail = chunk->len - q->off;
+
+		if (n < avail) {
+			q->off += n;
+			return;
+		}
+		n -= avail;
+		q->off = 0;
+		if ((q->head = chunk->next) == NULL) q->tail = NULL;
+		free(chunk);
+	}
+}
+
+static unsigned outq_iov(struct ftp_outq const *q, struct iovec *iov,
+                        unsigned n)
+{
+	unsigned i = 0;
+	size_t off = q->off;
+
+	for (struct ftp_chunk *chunk = q->head; chunk && i < n;
+	     chunk = chunk->next, off = 0)
+		iov[i++] = (struct iovec){ chunk->data + off, chunk->len - off };
+	return i;
+}
+
+static void outq_clear(struct ftp_outq *q)
+{
+	for (struct ftp_chunk *chunk = q->head, *next; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	*q = (struct ftp_outq){ };
+}
+
+/**
+ * Grow the client table so that it holds a descriptor
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int srv_slot(ftp_srv_t *srv, int fd)
+{
+	if ((unsigned)fd < srv->size) return 0;
+
+	/* Descriptors are small integers reused by the kernel, the table
+	 * only grows up to the highest descriptor ever seen */
+	unsigned size = srv->size ? srv->size : FTP_CLI_TABLE;
+	while (size <= (unsigned)fd) size *= 2;
+
+	struct ftp_cli **const clients =
+		realloc(srv->clients, size * sizeof *clients);
+	if (clients == NULL) return -1;
+
+	memset(clients + srv->size, 0, (size - srv->size) * sizeof *clients);
+	srv->clients = clients;
+	srv->size = size;
+	return 0;
+}
+
+/**
+ * Queue a transfer which may go on without waiting for its socket, it
+ * gets another quantum once the ready descriptors are handled
+ */
+static void cli_ready(struct ftp_cli *cli)
 {
-	if (buf->pos + n >= buf->size) return NULL;
-	char const *const ret = buf->buf + buf->pos;
-	buf->pos += n;
-	return ret;
+	struct ftp_srv *const srv = cli->srv;
+
+	if (cli->rprev) return;
+	if ((cli->rnext = srv->ready)) srv->ready->rprev = &cli->rnext;
+	cli->rprev = &srv->ready;
+	srv->ready = cli;
+}
+
+static void cli_unready(struct ftp_cli *cli)
+{
+	if (cli->rprev == NULL) return;
+	if ((*cli->rprev = cli->rnext)) cli->rnext->rprev = cli->rprev;
+	cli->rprev = NULL;
+}
+
+/**
+ * Append the completions queued back by the workers to those not handled
+ * yet
+ */
+static void srv_xfer_take(struct ftp_srv *srv)
+{
+	struct xjob **tail = &srv->xdone;
+
+	while (*tail) tail = &(*tail)->next;
+	*tail = xqueue_take(&srv->xq);
+}
+
+/**
+ * Ask the worker to end the transfer, unless over already: it is handed
+ * back through the completion queue, the session waits for it there
+ * @param err [in] Transfer errno once handed back, an ABOR one prevails
+ * @return         Whether a worker has the transfer
+ */
+static bool cli_xfer_cancel(struct ftp_cli *cli, int err)
+{
+	if (!cli->job.busy) return false;
+	if (cli->cancel == 0)
+		xpool_cancel(&cli->job);
+	if (cli->cancel == 0 || err == ECANCELED)
+		cli->cancel = err;
+	return true;
+}
+
+/**
+ * Stop watching the data connection, unless a worker does
+ */
+static void cli_xfer_unwatch(struct ftp_cli *cli)
+{
+	struct ftp_srv *const srv = cli->srv;
+	int const sock = cli->xfer.socket;
+
+	if (sock >= 0 && !cli->moved) {
+		ev_del(&srv->ev, sock);
+		srv->clients[sock] = NULL;
+	}
+	cli->moved = false;
+}
+
+/**
+ * Close the data connection and the transferred file
+ */
+static void cli_xfer_close(struct ftp_cli *cli)
+{
+	cli_unready(cli);
+	timer_cancel(&cli->srv->timers, &cli->pace);
+	cli_xfer_unwatch(cli);
+	xfer_close(&cli->xfer);
 }
 
-static __always_inline char const *netbuf_peek(struct netbuf *buf)
+/**
+ * Give the passive mode port back, it is no longer watched
+ * @param stale [in] Whether connections may still be pending on it
+ */
+static void cli_pasv_put(struct ftp_cli *cli, bool stale)
 {
-	if (buf->pos >= buf->size) return NULL;
-	return buf->buf + buf->pos;
+	struct ftp_srv *const srv = cli->srv;
+	int const sock = pasv_socket(srv->conf->pasv, cli->pasv);
+
+	ev_del(&srv->ev, sock);
+	srv->clients[sock] = NULL;
+	pasv_put(srv->conf->pasv, cli->pasv, stale);
+	cli->pasv = -1;
 }
 
+/**
+ * Drop the passive mode data address, and the connection accepted on it
+ * if no transfer took it
+ */
+static void cli_pasv_close(struct ftp_cli *cli)
+{
+	if (cli->pasv >= 0)
+		cli_pasv_put(cli, true);
+	if (cli->data >= 0) {
+		close(cli->data);
+		cli->data = -1;
+	}
+}
+
+/**
+ * Free a closed session, along with its transfer
+ */
+static void cli_free(struct ftp_srv *srv, struct ftp_cli *cli)
+{
+	cli_xfer_close(cli);
+	--srv->nclients;
+	free(cli);
+}
+
+/**
+ * Close the session, it is freed once its transfer is handed back if a
+ * worker has it: the session is then unreachable, but counted
+ */
 static __always_inline void cli_close(struct ftp_srv *srv, struct ftp_cli *cli)
 {
-	if (errno)
-		fprintf(stderr, "connection error %s: %s\n",
-		        inet_ntoa(cli->addr.sin_addr), strerror(errno));
+	LOG(LOG_CLOSE, cli->tag, (uint64_t)errno);
+	cli_pasv_close(cli);
 
-	FD_CLR(cli->socket, srv->rfds);
+	for (unsigned kind = 0; kind < FTP_TIMER_MAX; ++kind)
+		timer_cancel(&srv->timers, cli->timers + kind);
+
+	ev_del(&srv->ev, cli->socket);
 	close(cli->socket);
-	cli->socket = 0;
+	fsm_fini(&cli->fsm);
+	outq_clear(&cli->outq);
+	outq_clear(&cli->spill);
+	free(cli->rnfr);
+	srv->clients[cli->socket] = NULL;
+	cli->socket = -1;
+	if (!cli_xfer_cancel(cli, ECONNABORTED))
+		cli_free(srv, cli);
 }
 
 static __always_inline struct ftp_cli *cli_find(ftp_srv_t *srv, int fd)
 {
-	unsigned i;
-	for (i = 0; i < FTP_MAX_CLIENT && srv->clients[i].socket != fd; ++i);
-	return (i == FTP_MAX_CLIENT) ? NULL : srv->clients + i;
+	return ((unsigned)fd < srv->size) ? srv->clients[fd] : NULL;
 }
 
-enum {
-	E_OPEN,
-	E_RECV,
-	E_TIMEOUT,
-
-	C_ERROR,
-	C_WAIT,
-	C_LOGIN,
-
-	C_USER,
-	C_PASS,
-	C_QUIT,
-	C_PORT,
-	C_TYPE,
-	C_MODE,
-	C_STRU,
-	C_RETR,
-	C_STOR,
-	C_NOOP,
-	C_CMD_MAX,
-};
+static struct ftp_cli *cli_alloc(ftp_srv_t *srv, int fd)
+{
+	if (srv->nclients >= srv->max_clients)
+		return (errno = EMFILE), NULL;
+	if (srv_slot(srv, fd))
+		return NULL;
+
+	struct ftp_cli *const cli = calloc(1, sizeof *cli);
+	if (cli == NULL) return NULL;
+
+	++srv->nclients;
+	return (srv->clients[fd] = cli);
+}
+
+static __always_inline bool msg_advance(struct msghdr *msg, size_t n)
+{
+	while (msg->msg_iovlen && n >= msg->msg_iov->iov_len) {
+		n -= msg->msg_iov->iov_len;
+		++msg->msg_iov;
+		--msg->msg_iovlen;
+	}
+	if (msg->msg_iovlen) {
+		msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + n;
+		msg->msg_iov->iov_len -= n;
+	}
+	return msg->msg_iovlen == 0;
+}
+
+/**
+ * Watch input unless too much output is buffered, and output space
+ * while some is pending (readiness backend only)
+ */
+static int cli_watch(struct ftp_cli *cli)
+{
+	struct ftp_srv *const srv = cli->srv;
+
+	if (cli->outq.len > srv->conf->max_output)
+		cli->paused = true;
+	else if (cli->outq.len == 0)
+		cli->paused = false;
+
+	/* Lines held by a transfer may fill the input up */
+	bool const full = netbuf_room(&cli->in) == 0;
+	uint32_t const watch = (cli->paused || full ? 0 : EV_READ) |
+		(cli->outq.len && !ev_async(&srv->ev) ? EV_WRITE : 0);
+
+	if (watch == cli->watch) return 0;
+	cli->watch = watch;
+	return ev_recv_set(&srv->ev, cli->socket, cli->tag, watch);
+}
+
+/**
+ * Send queued output until the socket is full
+ */
+static int cli_drain(struct ftp_cli *cli)
+{
+	while (!cli->sending && cli->outq.len) {
+		cli->msg = (struct msghdr){
+			.msg_iov = cli->iov,
+			.msg_iovlen = outq_iov(&cli->outq, cli->iov, FTP_IOV_MAX) };
+
+		ssize_t const wr = ev_sendmsg(&cli->srv->ev, cli->socket, cli->tag,
+		                              &cli->msg);
+		if (wr < 0) {
+			if (errno == EINPROGRESS) cli->sending = true;
+			else if (errno != EAGAIN) return -1;
+			break;
+		}
+		outq_consume(&cli->outq, (size_t)wr);
+	}
+	return cli_watch(cli);
+}
+
+/**
+ * Send every reply pending since the last flush at once, straight from
+ * the constant replies when nothing is queued, what does not fit in the
+ * socket is queued
+ */
+static int cli_flush(struct ftp_cli *cli)
+{
+	struct ftp_srv *const srv = cli->srv;
+
+	if (srv->nout == 0) return 0;
+
+	struct msghdr msg = { .msg_iov = srv->out, .msg_iovlen = srv->nout };
+
+	/* Pending replies are sent or copied to the queue below */
+	srv->nout = 0;
+	srv->ntxt = 0;
+	if (cli->outq.len == 0 && !cli->sending && !ev_async(&srv->ev)) {
+		ssize_t const wr = sendmsg(cli->socket, &msg, MSG_NOSIGNAL);
+
+		if (wr < 0 && errno != EAGAIN) return -1;
+		if (wr > 0 && msg_advance(&msg, (size_t)wr)) return 0;
+	}
+
+	for (size_t i = 0; i < msg.msg_iovlen; ++i)
+		if (outq_push(&cli->outq, msg.msg_iov[i].iov_base,
+		              msg.msg_iov[i].iov_len))
+			return -1;
+	return cli_drain(cli);
+}
+
+/**
+ * Make room for `niov` replies parts and `ntxt` bytes of variable text,
+ * flushing early what is pending
+ * @return  Whether the text fits
+ */
+static bool cli_reserve(struct ftp_cli *cli, unsigned niov, size_t ntxt)
+{
+	struct ftp_srv *const srv = cli->srv;
+
+	if (srv->nout + niov > FTP_OUT_MAX || srv->ntxt + ntxt > FTP_REPLY_MAX)
+		if (cli_flush(cli)) cli->error = errno;
+	return ntxt <= FTP_REPLY_MAX;
+}
+
+void ftp_reply(struct ftp_cli *cli, unsigned code)
+{
+	struct ftp_srv *const srv = cli->srv;
+
+	assert(code < FTP_REPLY_CODES && g_replies[code].iov_len);
+	cli_reserve(cli, 1, 0);
+	srv->out[srv->nout++] = g_replies[code];
+}
+
+void ftp_reply_arg(struct ftp_cli *cli, struct ftp_tmpl const *tmpl,
+                   char const *arg, size_t len)
+{
+	struct ftp_srv *const srv = cli->srv;
+
+	/* Argument is copied, it usually lives on the handler stack */
+	if (!cli_reserve(cli, 3, len))
+		len = FTP_REPLY_MAX;
+
+	srv->out[srv->nout++] = tmpl->head;
+	if (len) {
+		char *const txt = memcpy(srv->txt + srv->ntxt, arg, len);
+
+		srv->ntxt += len;
+		srv->out[srv->nout++] = (struct iovec){ txt, len };
+	}
+	srv->out[srv->nout++] = tmpl->tail;
+}
+
+void ftp_replyf(struct ftp_cli *cli, char const *fmt, ...)
+{
+	struct ftp_srv *const srv = cli->srv;
+
+	for (int retry = 1; ; --retry) {
+		va_list ap;
+
+		/* Reserved first: a flush starts the text over */
+		cli_reserve(cli, 1, 0);
+
+		size_t const room = FTP_REPLY_MAX - srv->ntxt;
+		char *const txt = srv->txt + srv->ntxt;
+
+		va_start(ap, fmt);
+		int const len = vsnprintf(txt, room, fmt, ap);
+		va_end(ap);
+		if (len < 0) return;
+
+		/* Out of room: flush early and retry once, truncate otherwise */
+		if ((size_t)len + 2 >= room && retry && srv->ntxt) {
+			if (cli_flush(cli)) cli->error = errno;
+			continue;
+		}
+
+		size_t const n = (size_t)len + 2 < room ? (size_t)len : room - 3;
+
+		memcpy(txt + n, "\r\n", 2);
+		srv->ntxt += n + 2;
+		srv->out[srv->nout++] = (struct iovec){ txt, n + 2 };
+		return;
+	}
+}
 
 enum {
 	S_IDLE,
 	S_WAIT_USER,
 	S_WAIT_PASS,
-	S_OPEN
+	S_OPEN,
+	S_XFER,
+	S_CLOSE,
+	S_MAX
 };
 
-#define IS_CMD(CMD) ((CMD) >= C_USER && (CMD) < C_CMD_MAX)
+static __always_inline void cli_arm(struct ftp_cli *cli, enum ftp_timer kind)
+{
+	struct ftp_srv *const srv = cli->srv;
+	unsigned const timeout = srv->conf->timeouts[kind];
+
+	if (timeout)
+		timer_arm(&srv->timers, cli->timers + kind, srv->now + timeout);
+}
+
+static __always_inline void cli_login(struct ftp_cli *cli)
+{
+	cli->login = true;
+	LOG(LOG_LOGIN, cli->tag, (uintptr_t)cli->user->user);
+	timer_cancel(&cli->srv->timers, cli->timers + FTP_TIMER_LOGIN);
+	cli_arm(cli, FTP_TIMER_IDLE);
+}
+
+int ftp_pasv(struct ftp_cli *cli, struct sockaddr_in *addr)
+{
+	struct ftp_srv *const srv = cli->srv;
+	struct pasv_pool *const pool = srv->conf->pasv;
+
+	if (pool == NULL)
+		return (errno = ENOTSUP), -1;
+
+	/* Each data address serves a single transfer, the last one wins */
+	cli_pasv_close(cli);
+	cli->port = (struct sockaddr_in){ };
+
+	*addr = (struct sockaddr_in){
+		.sin_family = AF_INET, .sin_addr = srv->conf->pasv_addr };
+	if (addr->sin_addr.s_addr == INADDR_ANY &&
+	    getsockname(cli->socket, (struct sockaddr *)addr,
+	                &(socklen_t){ sizeof *addr }))
+		return -1;
+
+	int const idx = pasv_get(pool);
+	if (idx < 0) return -1;
+
+	/* Listener shares the session slot of the client table while the
+	 * session holds it */
+	int const sock = pasv_socket(pool, idx);
+
+	cli->xtag = srv->seq++ & EV_TAG_MASK;
+	if (srv_slot(srv, sock) || ev_add(&srv->ev, sock, EV_READ, cli->xtag)) {
+		pasv_put(pool, idx, false);
+		return -1;
+	}
+	srv->clients[sock] = cli;
+	cli->pasv = idx;
+	addr->sin_port = htons(pasv_port(pool, idx));
+	return 0;
+}
+
+/**
+ * Watch the data connection of the transfer, or move the transfer on a
+ * worker when there are any: the reactor then only handles commands
+ * @param events [in] Events the transfer waits for first
+ * @return            0 on success, -1 otherwise (errno is set)
+ */
+static int cli_xfer_watch(struct ftp_cli *cli, uint32_t events)
+{
+	struct ftp_srv *const srv = cli->srv;
+	struct xfer *const xfer = &cli->xfer;
+	int const sock = xfer->socket;
+
+	if (xpool_active()) {
+		cli->job = (struct xjob){
+			.xfer = xfer, .done = &srv->xq, .busy = true };
+		cli->moved = true;
+		cli->xseen = xfer->count;
+		cli->xtotal = xfer->count + (xfer->end - xfer->off);
+		return xpool_submit(&cli->job), 0;
+	}
+
+	/* Data connection shares the session slot of the client table */
+	if (srv_slot(srv, sock) || ev_add(&srv->ev, sock, events, cli->xtag))
+		return -1;
+	srv->clients[sock] = cli;
+	return 0;
+}
+
+/**
+ * Transfer over the passive mode connection accepted
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int cli_xfer_attach(struct ftp_cli *cli)
+{
+	struct xfer *const xfer = &cli->xfer;
+	int const sock = cli->data;
+
+	cli->data = -1;
+	if (xfer_attach(xfer, sock))
+		return -1;
+	return cli_xfer_watch(cli,
+	                      xfer->dir == XFER_RECV ? EV_READ : EV_WRITE);
+}
+
+/**
+ * Open the data connection of the transfer set up in `cli->xfer`
+ * @param verb  [in] Packed verb of the transfer, for the log
+ * @param ascii [in] Whether line endings are translated (TYPE A)
+ * @param name  [in] File name told in the preliminary reply, NULL if none
+ * @return           `C_XFER` once started, 0 when refused (replied)
+ */
+static int cli_xfer_open(struct ftp_cli *cli, uint32_t verb, bool ascii,
+                         char const *name)
+{
+	struct ftp_srv *const srv = cli->srv;
+	struct xfer *const xfer = &cli->xfer;
+	struct shape *const levels[SHAPE_LEVELS] = {
+		cli->shape + xfer->dir,
+		cli->user->shape + xfer->dir,
+		srv->conf->shape ? srv->conf->shape + xfer->dir : NULL,
+	};
 
-static int parsecmd(char const *cmd)
+	/* Session, user then server rate limits, unlimited ones left out */
+	for (unsigned i = 0, n = 0; i < SHAPE_LEVELS; ++i)
+		if (levels[i] && levels[i]->rate)
+			xfer->shape[n++] = levels[i];
+
+	if (cli->mode == FTP_MODE_DEFLATE && xfer_deflate(xfer, cli->zlevel))
+		goto abort;
+	if (cli->mode == FTP_MODE_BLOCK && xfer_block(xfer))
+		goto abort;
+	if (ascii && xfer_ascii(xfer))
+		goto abort;
+
+	if (cli->port.sin_family == AF_INET) {
+		/* Active mode: the peer listens on the address given by PORT,
+		 * which is used once */
+		cli_pasv_close(cli);
+		if (xfer_connect(xfer, &cli->port))
+			goto abort;
+		cli->port = (struct sockaddr_in){ };
+
+		/* Connected once writable */
+		cli->xtag = srv->seq++ & EV_TAG_MASK;
+		if (cli_xfer_watch(cli, EV_WRITE))
+			goto abort;
+	} else if (cli->data >= 0) {
+		/* Passive mode, the peer connected already, or the block mode
+		 * connection of the previous transfer */
+		if (cli_xfer_attach(cli))
+			goto abort;
+	} else if (cli->pasv < 0) {
+		goto abort;
+	}
+	/* Otherwise, the transfer waits for the peer to connect */
+	cli->xverb = verb;
+
+	/* Session is busy, only the transfer may stall */
+	timer_cancel(&srv->timers, cli->timers + FTP_TIMER_IDLE);
+	cli_arm(cli, FTP_TIMER_DATA);
+	if (name)
+		ftp_replyf(cli, "150 FILE: %s", name);
+	else
+		ftp_reply(cli, 150);
+	return C_XFER;
+
+abort:
+	xfer_close(xfer);
+	return ftp_reply(cli, 425), 0;
+}
+
+int ftp_retr(struct ftp_cli *cli, int file, uint64_t off, uint64_t end)
+{
+	struct xfer *const xfer = &cli->xfer;
+
+	xfer->dir = XFER_SEND;
+	xfer->file = file;
+	xfer->off = off;
+	xfer->end = end;
+	return cli_xfer_open(cli, FTP_VERB('R', 'E', 'T', 'R'),
+	                     cli->type == FTP_TYPE_ASCII, NULL);
+}
+
+int ftp_list(struct ftp_cli *cli, int file, bool names, char const *name,
+             uint32_t verb)
 {
-	char c[6] = { };
+	struct xfer *const xfer = &cli->xfer;
+
+	xfer->dir = XFER_SEND;
+	xfer->file = file;
+	xfer->off = 0;
+	xfer->end = UINT64_MAX;
+	if (xfer_listing(xfer, names, name)) {
+		xfer_close(xfer);
+		return ftp_reply(cli, 451), 0;
+	}
+	return cli_xfer_open(cli, verb, cli->type == FTP_TYPE_ASCII, NULL);
+}
 
-	for (unsigned i = 0; i < 5; ++i)
-		c[i] = (char)toupper(cmd[i]);
+int ftp_stor(struct ftp_cli *cli, int file, uint64_t off, uint64_t end,
+             uint32_t verb, char const *name)
+{
+	struct xfer *const xfer = &cli->xfer;
 
-	if (strncmp(c, SNS("USER ")) == 0) return C_USER;
-	if (strncmp(c, SNS("PASS ")) == 0) return C_PASS;
-	if (strncmp(c, SNS("QUIT ")) == 0) return C_QUIT;
-	if (strncmp(c, SNS("PORT ")) == 0) return C_PORT;
-	if (strncmp(c, SNS("TYPE ")) == 0) return C_TYPE;
-	if (strncmp(c, SNS("MODE ")) == 0) return C_MODE;
-	if (strncmp(c, SNS("STRU ")) == 0) return C_STRU;
-	if (strncmp(c, SNS("RETR ")) == 0) return C_RETR;
-	if (strncmp(c, SNS("STOR ")) == 0) return C_STOR;
-	if (strncmp(c, SNS("NOOP ")) == 0) return C_NOOP;
-	return C_CMD_MAX;
+	xfer->dir = XFER_RECV;
+	xfer->sync = cli->srv->conf->sync;
+	xfer->file = file;
+	xfer->off = off;
+	xfer->end = end;
+	return cli_xfer_open(cli, verb, cli->type == FTP_TYPE_ASCII, name);
 }
 
+uint64_t ftp_xfer_count(struct ftp_cli const *cli, uint64_t *total)
+{
+	struct xfer const *const xfer = &cli->xfer;
+
+	if (cli->job.busy)
+		return (*total = cli->xtotal), xjob_count(&cli->job);
+	*total = xfer->count + (xfer->end - xfer->off);
+	return xfer->count;
+}
+
+/**
+ * Log the transfer end and close it, the session is idle again
+ * @param err [in] Transfer errno, 0 on success
+ */
+static void cli_xfer_end(struct ftp_cli *cli, int err)
+{
+	struct ftp_srv *const srv = cli->srv;
+	struct xfer *const xfer = &cli->xfer;
+	int data = -1;
+
+	cli->cancel = 0;
+	LOG(LOG_XFER, cli->tag, cli->xverb, xfer->count, (uint64_t)err);
+
+	/* Block mode tells the file end in band: the data connection is kept
+	 * for the next transfer, unwatched meanwhile. Late events of this
+	 * one are told apart by a new tag. */
+	if (err == 0 && xfer->block) {
+		data = xfer->socket;
+		cli_xfer_unwatch(cli);
+		xfer->socket = -1;
+		cli->xtag = srv->seq++ & EV_TAG_MASK;
+	}
+	cli_xfer_close(cli);
+	cli_pasv_close(cli);
+	cli->data = data;
+	timer_cancel(&srv->timers, cli->timers + FTP_TIMER_DATA);
+	cli_arm(cli, FTP_TIMER_IDLE);
+}
+
+/**
+ * Close once closing replies are sent, unless the peer does not read
+ * them before the idle timeout
+ */
+static void cli_closing(struct ftp_cli *cli)
+{
+	if (cli->outq.len == 0 && !cli->sending) {
+		errno = 0;
+		return cli_close(cli->srv, cli);
+	}
+	cli_arm(cli, FTP_TIMER_IDLE);
+}
+
+#define STAT_ADD(ptr, n) __atomic_store_n((ptr), \
+	__atomic_load_n((ptr), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+/**
+ * Account the latency of the commands whose replies were just flushed,
+ * slow ones are logged along with their session
+ */
+static void cli_traced(struct ftp_cli *cli)
+{
+	struct ftp_srv *const srv = cli->srv;
+	uint64_t const end = clk_ticks();
+	uint64_t const slow = (uint64_t)srv->conf->slow * 1000000;
+
+	for (unsigned i = 0; i < srv->ntraces; ++i) {
+		struct ftp_trace const *const trace = srv->traces + i;
+		struct ftp_lat *const lat = srv->lat + trace->slot;
+		uint64_t const ns = clk_ns(end - trace->start);
+
+		__atomic_store_n(&lat->verb, trace->verb, __ATOMIC_RELAXED);
+		STAT_ADD(&lat->count, 1);
+		STAT_ADD(&lat->total, ns);
+		if (ns > lat->max)
+			__atomic_store_n(&lat->max, ns, __ATOMIC_RELAXED);
+		if (slow && ns >= slow)
+			LOG(LOG_SLOW, cli->tag, trace->verb, ns / 1000);
+	}
+	srv->ntraces = 0;
+}
+
+/**
+ * Trace a dispatched command, until its replies are flushed
+ * @param cmd   [in] Command, NULL for an unknown one
+ * @param start [in] Tick its line was complete at
+ */
+static void cli_trace(struct ftp_cli *cli, struct ftp_cmd const *cmd,
+                      uint64_t start)
+{
+	struct ftp_srv *const srv = cli->srv;
+
+	if (srv->ntraces == FTP_OUT_MAX)
+		cli_traced(cli);
+	srv->traces[srv->ntraces++] = (struct ftp_trace){
+		.start = start,
+		.verb = cmd ? cmd->verb : 0,
+		.slot = cmd ? FTP_CMD_HASH(cmd->verb) : FTP_LAT_SLOTS - 1 };
+}
+
+/**
+ * Send the replies of the events just handled, the session may be gone
+ * once it returns
+ */
+static void cli_settle(struct ftp_cli *cli)
+{
+	bool const failed = cli_flush(cli) || cli_watch(cli) ||
+		(cli->error && (errno = cli->error));
+
+	if (cli->srv->ntraces)
+		cli_traced(cli);
+	if (failed)
+		cli_close(cli->srv, cli);
+	else if (cli->fsm.state == S_CLOSE)
+		cli_closing(cli);
+}
+
+static int cli_trigger(struct ftp_cli *cli, int ecode, void *arg)
+{
+	int const err = fsm_trigger(&cli->fsm, ecode, arg);
+
+	cli_settle(cli);
+	return err;
+}
+
+static void cli_done(struct ftp_cli *cli, int err);
+
+static void cli_expire(struct ftp_cli *cli, enum ftp_timer kind)
+{
+	if (cli->fsm.state == S_CLOSE) {
+		errno = ETIMEDOUT;
+		return cli_close(cli->srv, cli);
+	}
+
+	/* Stalled transfer fails, the session goes on. Workers only publish
+	 * their progress, which is checked once the timeout is over. */
+	if (kind == FTP_TIMER_DATA && cli->job.busy &&
+	    xjob_count(&cli->job) != cli->xseen) {
+		cli->xseen = xjob_count(&cli->job);
+		return cli_arm(cli, FTP_TIMER_DATA);
+	}
+	if (kind == FTP_TIMER_DATA)
+		return cli_done(cli, ETIMEDOUT);
+	cli_trigger(cli, E_TIMEOUT, &kind);
+}
+
+static void on_idle_expire(struct timer *timer)
+{
+	cli_expire(container_of(timer, struct ftp_cli, timers[FTP_TIMER_IDLE]),
+	           FTP_TIMER_IDLE);
+}
+
+static void on_login_expire(struct timer *timer)
+{
+	cli_expire(container_of(timer, struct ftp_cli, timers[FTP_TIMER_LOGIN]),
+	           FTP_TIMER_LOGIN);
+}
+
+static void on_data_expire(struct timer *timer)
+{
+	cli_expire(container_of(timer, struct ftp_cli, timers[FTP_TIMER_DATA]),
+	           FTP_TIMER_DATA);
+}
+
+/**
+ * Leave the rate limited transfer unwatched until its buckets grant
+ * enough again
+ */
+static void cli_xfer_pace(struct ftp_cli *cli)
+{
+	struct ftp_srv *const srv = cli->srv;
+	struct xfer const *const xfer = &cli->xfer;
+
+	ev_del(&srv->ev, xfer->socket);
+	timer_arm(&srv->timers, &cli->pace,
+	          srv->now + (xfer->wait + 999999) / 1000000);
+}
+
+static void on_pace_expire(struct timer *timer)
+{
+	struct ftp_cli *const cli = container_of(timer, struct ftp_cli, pace);
+	struct xfer const *const xfer = &cli->xfer;
+
+	if (ev_add(&cli->srv->ev, xfer->socket,
+	           xfer->dir == XFER_RECV ? EV_READ : EV_WRITE, cli->xtag))
+		cli_done(cli, errno);
+}
+
+static timer_fn_t *const cli_timer_fn[FTP_TIMER_MAX] = {
+	[FTP_TIMER_IDLE]  = on_idle_expire,
+	[FTP_TIMER_LOGIN] = on_login_expire,
+	[FTP_TIMER_DATA]  = on_data_expire,
+};
+
 int on_open(fsm_t const *fsm, int ecode, void *arg)
 {
 	(void)ecode;
 	(void)arg;
 
 	struct ftp_cli *const cli = container_of(fsm, struct ftp_cli, fsm);
-	return dprintf(cli->socket, "%s", getcmd(200, NULL)), 0;
+	return ftp_reply(cli, 220), 0;
 }
 
 int on_default(fsm_t const *fsm, int ecode, void *arg)
@@ -195,101 +913,290 @@ int on_default(fsm_t const *fsm, int ecode, void *arg)
 
 	struct ftp_cli *const cli = container_of(fsm, struct ftp_cli, fsm);
 	int const cmd = IS_CMD(ecode) ? 503 : 500;
-	return dprintf(cli->socket, "%s", getcmd(cmd, NULL)), 0;
+	return ftp_reply(cli, cmd), 0;
 }
 
 int on_recv(fsm_t const *fsm, int ecode, void *arg)
 {
 	(void)ecode;
 	(void)fsm;
-	struct netbuf *const buf = arg;
+	struct ftp_req *const req = arg;
+
+	struct ftp_cmd const *const cmd = ftp_cmd_parse(req);
+	return cmd ? cmd->event : C_ERROR;
+}
 
-	char const *cmd = netbuf_read(buf, 5);
-	if (cmd == NULL) return C_ERROR;
-	return parsecmd(cmd);
+int on_cmd(fsm_t const *fsm, int ecode, void *arg)
+{
+	(void)ecode;
+	struct ftp_cli *const cli = container_of(fsm, struct ftp_cli, fsm);
+
+	return ftp_cmd_run(cli, arg);
 }
 
 int on_user(fsm_t const *fsm, int ecode, void *arg)
 {
 	(void)ecode;
 	struct ftp_cli *const cli = container_of(fsm, struct ftp_cli, fsm);
-	struct netbuf *const buf = arg;
+	struct ftp_req const *const req = arg;
 
-	char const *username = netbuf_peek(buf);
-	if (username == NULL) return C_ERROR;
+	char const *const username = req->arg;
+	if (username == NULL) return ftp_reply(cli, 501), C_WAIT;
 
 	struct ftp_usr *usr;
 
-	for (usr = cli->srv->users; usr->user; ++usr)
+	for (usr = cli->srv->conf->users; usr->user; ++usr)
 		if (strcmp(usr->user, username) == 0)
 			break;
 	if (usr->user == NULL)
-		return dprintf(cli->socket, "%s", getcmd(332, NULL)), C_WAIT;
+		return ftp_reply(cli, 332), C_WAIT;
 	cli->user = usr;
 	if (usr->pswd != NULL)
-		return dprintf(cli->socket, "%s", getcmd(331, NULL)), 0;
-	cli->login = true;
-	return dprintf(cli->socket, "%s", getcmd(230, NULL)), C_LOGIN;
+		return ftp_reply(cli, 331), 0;
+	cli_login(cli);
+	return ftp_reply(cli, 230), C_LOGIN;
 }
 
 int on_pass(fsm_t const *fsm, int ecode, void *arg)
 {
 	(void)ecode;
 	struct ftp_cli *const cli = container_of(fsm, struct ftp_cli, fsm);
-	struct netbuf *const buf = arg;
+	struct ftp_req const *const req = arg;
 
-	char const *password = netbuf_peek(buf);
-	if (password == NULL) return C_ERROR;
+	char const *const password = req->arg ? req->arg : "";
 
 	if (strcmp(cli->user->pswd, password) != 0)
-		return dprintf(cli->socket, "%s", getcmd(530, NULL)), C_WAIT;
-	cli->login = true;
-	return dprintf(cli->socket, "%s", getcmd(230, NULL)), 0;
+		return ftp_reply(cli, 530), C_WAIT;
+	cli_login(cli);
+	return ftp_reply(cli, 230), 0;
 }
 
+int on_rein(fsm_t const *fsm, int ecode, void *arg)
+{
+	(void)ecode;
+	(void)arg;
+	struct ftp_cli *const cli = container_of(fsm, struct ftp_cli, fsm);
+	struct ftp_srv *const srv = cli->srv;
+
+	/* Back to a freshly opened session, the connection is kept */
+	cli->login = false;
+	cli->user = NULL;
+	cli->type = FTP_TYPE_ASCII;
+	cli->mode = FTP_MODE_STREAM;
+	cli->zlevel = ZMODE_LEVEL;
+	cli->stru = FTP_STRUCTURE_FILE;
+	cli->rest = 0;
+	cli->restart = false;
+	cli->allo = 0;
+	cli->port = (struct sockaddr_in){ };
+	cli->epsv_all = false;
+	cli_pasv_close(cli);
+	strcpy(cli->cwd, "/");
+	timer_cancel(&srv->timers, cli->timers + FTP_TIMER_IDLE);
+	cli_arm(cli, FTP_TIMER_LOGIN);
+	return ftp_reply(cli, 220), 0;
+}
+
+int on_timeout(fsm_t const *fsm, int ecode, void *arg)
+{
+	(void)ecode;
+	(void)arg;
+	struct ftp_cli *const cli = container_of(fsm, struct ftp_cli, fsm);
+
+	return ftp_reply(cli, 421), C_CLOSE;
+}
+
+int on_done(fsm_t const *fsm, int ecode, void *arg)
+{
+	(void)ecode;
+	struct ftp_cli *const cli = container_of(fsm, struct ftp_cli, fsm);
+	int const err = *(int const *)arg;
+
+	struct xfer const *const xfer = &cli->xfer;
+	bool const abort = cli->cancel == ECANCELED;
+	bool const keep = err == 0 && xfer->block;
+
+	/* Block mode data connection kept open, or closed: never opened, or
+	 * transfer failed on either side */
+	unsigned const code = keep ? 250 : err == 0 ? 226 : abort ? 426
+		: !xfer->connected ? 425
+		: !xfer->local ? 426
+		: err == ENOSPC || err == EDQUOT ? 452 : 451;
+
+	cli_xfer_end(cli, err);
+	ftp_reply(cli, code);
+
+	/* ABOR waited for the worker, it is replied after the transfer */
+	if (abort)
+		ftp_reply(cli, keep ? 225 : 226);
+	return 0;
+}
+
+int on_abort(fsm_t const *fsm, int ecode, void *arg)
+{
+	(void)ecode;
+	(void)arg;
+	struct ftp_cli *const cli = container_of(fsm, struct ftp_cli, fsm);
+
+	/* Worker hands the transfer back first, replied by `on_done` */
+	if (cli_xfer_cancel(cli, ECANCELED))
+		return C_WAIT;
+
+	/* Transfer reply first, then the ABOR one (RFC 959) */
+	cli_xfer_end(cli, ECANCELED);
+	ftp_reply(cli, 426);
+	return ftp_reply(cli, 226), 0;
+}
+
+/* Rows are dense: defaults are overridden by handled events */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+
 static struct fsm_trans const *const stt[] = {
-	[S_IDLE]      = (struct fsm_trans const[]){
-		{ E_OPEN,        on_open, S_WAIT_USER },
-		{ FSM_E_DEFAULT, NULL,    S_IDLE      },
+	[S_IDLE]      = (struct fsm_trans const[C_CMD_MAX]){
+		FSM_ROW(C_CMD_MAX, NULL,    S_IDLE      ),
+		FSM_ON(E_OPEN,     on_open, S_WAIT_USER ),
+	},
+
+	[S_WAIT_USER] = (struct fsm_trans const[C_CMD_MAX]){
+		FSM_ROW(C_CMD_MAX, on_default, S_WAIT_USER ),
+		FSM_ON(E_RECV,     on_recv,    S_WAIT_USER ),
+		FSM_ON(C_USER,     on_user,    S_WAIT_PASS ),
+		FSM_ON(C_CMD,      on_cmd,     S_WAIT_USER ),
+		FSM_ON(C_REIN,     on_rein,    S_WAIT_USER ),
+		FSM_ON(C_WAIT,     NULL,       S_WAIT_USER ),
+		FSM_ON(C_ERROR,    on_default, S_WAIT_USER ),
+		FSM_ON(C_LOGIN,    NULL,       S_OPEN      ),
+		FSM_ON(E_TIMEOUT,  on_timeout, S_WAIT_USER ),
+		FSM_ON(C_CLOSE,    NULL,       S_CLOSE     ),
 	},
 
-	[S_WAIT_USER] = (struct fsm_trans const[]){
-		{ E_RECV,        on_recv,    S_WAIT_USER },
-		{ C_USER,        on_user,    S_WAIT_PASS },
-		{ C_WAIT,        NULL,       S_WAIT_USER },
-		{ C_ERROR,       on_default, S_WAIT_USER },
-		{ C_LOGIN,       NULL,       S_OPEN },
-		{ FSM_E_DEFAULT, on_default, S_WAIT_USER },
+	[S_WAIT_PASS] = (struct fsm_trans const[C_CMD_MAX]){
+		FSM_ROW(C_CMD_MAX, on_default, S_WAIT_PASS ),
+		FSM_ON(E_RECV,     on_recv,    S_WAIT_PASS ),
+		FSM_ON(C_PASS,     on_pass,    S_OPEN      ),
+		FSM_ON(C_CMD,      on_cmd,     S_WAIT_PASS ),
+		FSM_ON(C_REIN,     on_rein,    S_WAIT_USER ),
+		FSM_ON(C_WAIT,     NULL,       S_WAIT_PASS ),
+		FSM_ON(C_ERROR,    on_default, S_WAIT_PASS ),
+		FSM_ON(E_TIMEOUT,  on_timeout, S_WAIT_PASS ),
+		FSM_ON(C_CLOSE,    NULL,       S_CLOSE     ),
 	},
 
-	[S_WAIT_PASS] = (struct fsm_trans const[]){
-		{ E_RECV,        on_recv,    S_WAIT_PASS },
-		{ C_PASS,        on_pass,    S_OPEN      },
-		{ C_WAIT,        NULL,       S_WAIT_PASS },
-		{ C_ERROR,       on_default, S_WAIT_PASS },
-		{ FSM_E_DEFAULT, on_default, S_WAIT_PASS },
+	[S_OPEN]      = (struct fsm_trans const[C_CMD_MAX]){
+		FSM_ROW(C_CMD_MAX, on_default, S_OPEN      ),
+		FSM_ON(E_RECV,     on_recv,    S_OPEN      ),
+		FSM_ON(C_CMD,      on_cmd,     S_OPEN      ),
+		FSM_ON(C_REIN,     on_rein,    S_WAIT_USER ),
+		FSM_ON(C_XFER,     NULL,       S_XFER      ),
+		FSM_ON(E_TIMEOUT,  on_timeout, S_OPEN      ),
+		FSM_ON(C_CLOSE,    NULL,       S_CLOSE     ),
 	},
 
-	[S_OPEN]      = (struct fsm_trans const[]){
-		{ E_RECV,        on_recv,    S_OPEN },
-		{ FSM_E_DEFAULT, on_default, S_OPEN },
+	/* Only commands flagged `FTP_CMD_XFER` are received */
+	[S_XFER]      = (struct fsm_trans const[C_CMD_MAX]){
+		FSM_ROW(C_CMD_MAX, on_default, S_XFER      ),
+		FSM_ON(E_RECV,     on_recv,    S_XFER      ),
+		FSM_ON(C_CMD,      on_cmd,     S_XFER      ),
+		FSM_ON(E_DONE,     on_done,    S_OPEN      ),
+		FSM_ON(C_ABOR,     on_abort,   S_OPEN      ),
+		FSM_ON(C_WAIT,     NULL,       S_XFER      ),
+	},
+
+	[S_CLOSE]     = (struct fsm_trans const[C_CMD_MAX]){
+		FSM_ROW(C_CMD_MAX, NULL,       S_CLOSE     ),
 	},
 };
 
-int ftp_srv_open(int port, char const *root,
-                 fd_set *rfds, struct ftp_usr *users, ftp_srv_t *srv)
+#pragma GCC diagnostic pop
+
+#define STAT_INC(srv, name) \
+	__atomic_fetch_add(&(srv)->stats.name, 1, __ATOMIC_RELAXED)
+#define STAT_GET(srv, name) \
+	__atomic_load_n(&(srv)->stats.name, __ATOMIC_RELAXED)
+
+/**
+ * Refuse a pending connection while out of descriptors, otherwise it
+ * stays queued and the listener keeps waking the reactor up
+ * @return  Whether a connection was refused
+ */
+static bool srv_shed(ftp_srv_t *srv)
+{
+	if (srv->spare < 0) return false;
+
+	close(srv->spare);
+	int const sock = accept(srv->socket, NULL, NULL);
+	if (sock >= 0) close(sock);
+	srv->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	return sock >= 0 && (STAT_INC(srv, overflowed), true);
+}
+
+static void srv_resume(struct timer *timer)
+{
+	ftp_srv_t *const srv = container_of(timer, struct ftp_srv, backoff);
+
+	if (ev_accept(&srv->ev, srv->socket, 0))
+		timer_arm(&srv->timers, timer, srv->now + FTP_ACCEPT_BACKOFF);
+}
+
+/**
+ * Handle an accept failure, out of resources the pending connections are
+ * refused and the listener is paused for a while: a kernel refusing a new
+ * descriptor would otherwise wake the reactor up in a loop
+ * @param err  [in] Accept failure
+ * @return          Whether accepting may go on
+ */
+static bool srv_accept_error(ftp_srv_t *srv, int err)
 {
-	if (port <= 1024 || port > 9999)
+	switch (err) {
+	case EMFILE: case ENFILE:
+		while (srv_shed(srv));
+		break;
+	case ENOBUFS: case ENOMEM:
+		STAT_INC(srv, overflowed);
+		break;
+	default:
+		/* Connection aborted by the peer, or network error already
+		 * pending on the new socket */
+		if (err == EAGAIN || err == EWOULDBLOCK)
+			return false;
+		LOG(LOG_ACCEPT, 0, (uint64_t)err);
+		return true;
+	}
+
+	LOG(LOG_ACCEPT, 0, (uint64_t)err);
+
+	/* Completion backend disarmed the listener on failure already */
+	if (!ev_async(&srv->ev))
+		ev_del(&srv->ev, srv->socket);
+	timer_arm(&srv->timers, &srv->backoff, srv->now + FTP_ACCEPT_BACKOFF);
+	return false;
+}
+
+int ftp_srv_open(struct ftp_conf const *conf, ftp_srv_t *srv)
+{
+	int const port = conf->port;
+
+	if (port <= 1024 || port > 9999 || conf->max_clients == 0 ||
+	    conf->threads == 0)
 		return (errno = EINVAL), -1;
 
-	/* Open a network stream socket */
-	int const sock = socket(AF_INET, SOCK_STREAM, 0);
+	int spare = -1, root = -1;
+
+	/* Open a network stream socket, accepts are drained until EAGAIN */
+	int const sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+	                        SOCK_CLOEXEC, 0);
 	if (sock < 0) goto abort;
 
 	/* Faster server reload */
 	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)))
 		goto abort;
 
+	/* Every reactor thread listens on the same port */
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)))
+		goto abort;
+
 	struct sockaddr_in const addr = {
 		.sin_family = AF_INET,
 		.sin_port = htons((uint16_t)port),
@@ -300,96 +1207,711 @@ int ftp_srv_open(int port, char const *root,
 	if (bind(sock, (struct sockaddr const *)&addr, sizeof addr))
 		goto abort;
 
-	/* Listen for up to `FTP_MAX_CLIENT` connections */
-	if (listen(sock, FTP_MAX_CLIENT))
+	/* Kernel caps the queue to net.core.somaxconn */
+	if (listen(sock, conf->backlog > 0 ? conf->backlog : FT_P_LISTEN_QUEUE))
 		goto abort;
 
-	/* Everything goes well, set rfds and save data to server structure */
-	FD_SET(sock, rfds);
-	return (*srv = (struct ftp_srv){
-		.root = root,
-		.rfds = rfds, .users = users,
-		.socket = sock, .addr = addr,}), 0;
+	/* Sessions paths are resolved beneath it, the process working
+	 * directory is shared by every reactor */
+	if ((root = open(conf->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		goto abort;
+
+	/* Kept aside to refuse connections once out of descriptors */
+	if ((spare = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+		goto abort;
+
+	struct ev ev;
+
+	/* Listener is registered once for the whole server life */
+	if (ev_open(&ev, conf->backend))
+		goto abort;
+	if (ev_accept(&ev, sock, 0)) {
+		ev_close(&ev);
+		goto abort;
+	}
+
+	/* Workers hand transfers back through it */
+	struct xqueue xq = { .fd = -1 };
+
+	if (xpool_active() && (xqueue_open(&xq) ||
+	                       ev_add(&ev, xq.fd, EV_READ, 0))) {
+		if (xq.fd >= 0) xqueue_close(&xq);
+		ev_close(&ev);
+		goto abort;
+	}
+
+#if FT_P_FSM_STATS
+	struct fsm_stats fsm;
+
+	if (fsm_stats_init(&fsm, S_MAX, C_CMD_MAX)) {
+		if (xq.fd >= 0) xqueue_close(&xq);
+		ev_close(&ev);
+		goto abort;
+	}
+#endif
+
+	/* Everything goes well, save data to server structure */
+	*srv = (struct ftp_srv){
+		.conf = conf, .ev = ev, .xq = xq,
+		.socket = sock, .root = root, .spare = spare, .addr = addr,
+		.max_clients = (conf->max_clients + conf->threads - 1) / conf->threads,
+		.now = clk_ms() };
+#if FT_P_FSM_STATS
+	srv->fsm = fsm;
+#endif
+	timer_setup(&srv->backoff, srv_resume);
+	return timer_init(&srv->timers, srv->now), 0;
 
 abort:
+	if (root >= 0) close(root);
+	if (spare >= 0) close(spare);
 	if (sock >= 0) close(sock);
 	return -1;
 }
 
-int ftp_srv_start(ftp_srv_t *srv, const fd_set *rfds, struct timeval *timeout)
+static void srv_xfer_done(ftp_srv_t *srv);
+
+void ftp_srv_close(ftp_srv_t *srv)
 {
-	int err = 0;
+	int const err = errno;
+
+	errno = 0;
+	for (unsigned fd = 0; srv->nclients && fd < srv->size; ++fd)
+		if (srv->clients[fd]) cli_close(srv, srv->clients[fd]);
+
+	/* Sessions closed with a transfer on a worker: a quantum at most */
+	while (srv->nclients) {
+		poll(&(struct pollfd){ .fd = srv->xq.fd, .events = POLLIN },
+		     1, -1);
+		srv_xfer_done(srv);
+	}
+
+	free(srv->clients);
+	if (srv->xq.fd >= 0) xqueue_close(&srv->xq);
+	ev_close(&srv->ev);
+	close(srv->socket);
+	close(srv->root);
+	if (srv->spare >= 0) close(srv->spare);
+#if FT_P_FSM_STATS
+	fsm_stats_fini(&srv->fsm);
+#endif
+	errno = err;
+}
+
+void ftp_srv_stats(ftp_srv_t const *srv, struct ftp_stats *stats)
+{
+	stats->accepted += STAT_GET(srv, accepted);
+	stats->rejected += STAT_GET(srv, rejected);
+	stats->overflowed += STAT_GET(srv, overflowed);
+}
+
+void ftp_srv_latency(ftp_srv_t const *srv, struct ftp_lat lat[FTP_LAT_SLOTS])
+{
+	for (unsigned slot = 0; slot < FTP_LAT_SLOTS; ++slot) {
+		struct ftp_lat const *const l = srv->lat + slot;
+		uint64_t const max = __atomic_load_n(&l->max, __ATOMIC_RELAXED);
+
+		lat[slot].verb |= __atomic_load_n(&l->verb, __ATOMIC_RELAXED);
+		lat[slot].count += __atomic_load_n(&l->count, __ATOMIC_RELAXED);
+		lat[slot].total += __atomic_load_n(&l->total, __ATOMIC_RELAXED);
+		if (max > lat[slot].max) lat[slot].max = max;
+	}
+}
+
+#if FT_P_FSM_STATS
+
+static char const *const g_states[S_MAX] = {
+	[S_IDLE]      = "IDLE",
+	[S_WAIT_USER] = "WAIT_USER",
+	[S_WAIT_PASS] = "WAIT_PASS",
+	[S_OPEN]      = "OPEN",
+	[S_XFER]      = "XFER",
+	[S_CLOSE]     = "CLOSE",
+};
+
+static char const *const g_events[C_CMD_MAX] = {
+	[E_OPEN]    = "OPEN",
+	[E_RECV]    = "RECV",
+	[E_TIMEOUT] = "TIMEOUT",
+	[E_DONE]    = "DONE",
+	[C_ERROR]   = "ERROR",
+	[C_WAIT]    = "WAIT",
+	[C_LOGIN]   = "LOGIN",
+	[C_CLOSE]   = "CLOSE",
+	[C_REIN]    = "REIN",
+	[C_XFER]    = "XFER",
+	[C_ABOR]    = "ABOR",
+	[C_USER]    = "USER",
+	[C_PASS]    = "PASS",
+	[C_CMD]     = "CMD",
+};
+
+int ftp_fsm_stats_init(struct fsm_stats *stats)
+{
+	return fsm_stats_init(stats, S_MAX, C_CMD_MAX);
+}
+
+void ftp_srv_fsm_stats(ftp_srv_t const *srv, struct fsm_stats *stats)
+{
+	fsm_stats_sum(stats, &srv->fsm);
+}
+
+void ftp_fsm_stats_print(struct fsm_stats const *stats, ftp_print_fn *print,
+                         void *ctx)
+{
+	char line[128];
+
+	for (int state = 0; state < S_MAX; ++state) {
+		snprintf(line, sizeof line, "%-9s sessions %lu", g_states[state],
+		         stats->active[state]);
+		print(ctx, line);
+	}
+
+	for (int at = 0; at < S_MAX * C_CMD_MAX; ++at) {
+		uint64_t const count = stats->count[at];
+		if (count == 0) continue;
+
+		snprintf(line, sizeof line, "%-9s %-7s %12lu %8lu " FSM_CLOCK_UNIT,
+		         g_states[at / C_CMD_MAX], g_events[at % C_CMD_MAX],
+		         count, stats->ticks[at] / count);
+		print(ctx, line);
+	}
+}
+
+#endif
+
+int ftp_bench(struct ftp_conf const *conf, char const *line, unsigned count,
+              uint64_t *ns)
+{
+	char buf[FTP_LINE_MAX];
+	size_t const len = strlen(line) + 1;
+
+	if (len > sizeof buf || count == 0)
+		return (errno = EINVAL), -1;
+
+	struct ftp_srv *const srv = calloc(1, sizeof *srv);
+	struct ftp_cli *const cli = calloc(1, sizeof *cli);
+	if (srv == NULL || cli == NULL) {
+		free(srv);
+		return free(cli), -1;
+	}
+
+	/* Server only holds the replies and timers of its session */
+	srv->conf = conf;
+	srv->socket = srv->root = srv->spare = srv->ev.fd = -1;
+	srv->now = clk_ms();
+	timer_init(&srv->timers, srv->now);
+
+	/* Logged in session without connection, never flushed */
+	cli->srv = srv;
+	cli->socket = -1;
+	cli->login = true;
+	cli->pasv = -1;
+	cli->data = -1;
+	xfer_init(&cli->xfer);
+	strcpy(cli->cwd, "/");
+	fsm_init(&cli->fsm, S_OPEN, stt, C_CMD_MAX);
 
-	memset(timeout, 0, sizeof *timeout);
+	uint64_t const start = clk_ticks();
+	for (unsigned i = 0; i < count; ++i) {
+		memcpy(buf, line, len);
+		fsm_trigger(&cli->fsm, E_RECV, &(struct ftp_req){ .line = buf });
 
-	if (gettimeofday(&srv->now, NULL)) return -1;
+		/* Replies are dropped and the session logged in again */
+		srv->nout = srv->ntxt = 0;
+		cli->fsm.state = S_OPEN;
+	}
+	*ns = clk_ns(clk_ticks() - start) / count;
+
+	free(cli->rnfr);
+	free(cli);
+	free(srv);
+	return 0;
+}
+
+static int cli_open(ftp_srv_t *srv, int sock, struct sockaddr_in const *addr)
+{
+	struct ftp_cli *const cli = cli_alloc(srv, sock);
+	if (cli == NULL) {
+		STAT_INC(srv, rejected);
+		send(sock, g_replies[421].iov_base, g_replies[421].iov_len,
+		     MSG_NOSIGNAL | MSG_DONTWAIT);
+		return close(sock), 0;
+	}
+	STAT_INC(srv, accepted);
+
+	cli->socket = sock;
+	cli->srv = srv;
+	cli->tag = srv->seq++ & EV_TAG_MASK;
+	if (addr)
+		cli->addr = *addr;
+	else
+		getpeername(sock, (struct sockaddr *)&cli->addr,
+		            &(socklen_t){ sizeof cli->addr });
+	LOG(LOG_OPEN, cli->tag, cli->addr.sin_addr.s_addr, cli->addr.sin_port);
+	cli->watch = EV_READ;
+	cli->pasv = -1;
+	cli->data = -1;
+	cli->zlevel = ZMODE_LEVEL;
+	xfer_init(&cli->xfer);
+	netbuf_init(&cli->in, cli->inbuf, sizeof cli->inbuf);
+	strcpy(cli->cwd, "/");
+	for (unsigned kind = 0; kind < FTP_TIMER_MAX; ++kind)
+		timer_setup(cli->timers + kind, cli_timer_fn[kind]);
+	timer_setup(&cli->pace, on_pace_expire);
+	for (unsigned dir = 0; dir < XFER_DIR_MAX; ++dir)
+		shape_init(cli->shape + dir, srv->conf->rates[dir]);
+
+	/* Accepted non-blocking: a slow peer never blocks the reactor */
+	if (ev_recv(&srv->ev, sock, cli->tag))
+		return cli_close(srv, cli), 0;
 
-	if (FD_ISSET(srv->socket, rfds)) {
+	cli_arm(cli, FTP_TIMER_LOGIN);
+	fsm_init(&cli->fsm, S_IDLE, stt, C_CMD_MAX);
+#if FT_P_FSM_STATS
+	fsm_stats_attach(&cli->fsm, &srv->fsm);
+#endif
+	return cli_trigger(cli, E_OPEN, NULL);
+}
+
+/**
+ * Drain the whole listen queue, a connection storm must not wait for as
+ * many wakeups as there are pending peers
+ */
+static int srv_accept(ftp_srv_t *srv)
+{
+	while (true) {
 		socklen_t sz = sizeof(struct sockaddr_in);
 		struct sockaddr_in addr;
 
-		int const sock = accept(srv->socket, (struct sockaddr *)&addr, &sz);
-		if (sock < 0) return -1;
+		int const sock = accept4(srv->socket, (struct sockaddr *)&addr,
+		                         &sz, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (srv_accept_error(srv, errno)) continue;
+			return 0;
+		}
+
+		if (cli_open(srv, sock, &addr)) return -1;
+	}
+}
+
+/**
+ * Dispatch complete lines in order, replies are batched and sent by the
+ * caller. While a transfer runs, a line which may not run meanwhile is
+ * held along with every following one, until the transfer is over.
+ * Those flagged `FTP_CMD_XFER` found past held lines are still
+ * dispatched, and cut out: an ABOR is never stuck behind a PWD.
+ * @param off   [in] Offset line feeds are relative to
+ * @param lf    [in] Line feeds offsets, behind the held lines if any
+ * @param ready [in] Tick the lines were complete at
+ */
+static void cli_dispatch(struct ftp_cli *cli, uint32_t off,
+                         uint32_t const *lf, unsigned nlf, uint64_t ready)
+{
+	struct netbuf *const in = &cli->in;
+
+	for (unsigned i = 0; i < nlf && cli->fsm.state != S_CLOSE; ++i) {
+		uint32_t const sol = cli->held ? cli->hend : in->head;
+		uint32_t const eol = off + lf[i];
+		uint32_t len = eol - sol;
+
+		/* Copied aside only when wrapping around the storage end */
+		char *const line = netbuf_peek(in, sol, len + 1, cli->srv->line);
+		if (len && line[len - 1] == '\r') --len;
 
-		struct ftp_cli *const cli = cli_find(srv, 0);
-		if (cli == NULL) {
-			err = dprintf(sock, "%s", getcmd(421, NULL));
-			if (err < 0) return err;
+		char const end = line[len];
+		struct ftp_req req = { .line = line };
+
+		line[len] = '\0';
+		if (cli->discard) {
+			cli->discard = false;
+		} else if (cli->fsm.state == S_XFER ? !ftp_cmd_parse(&req) ||
+		           !(req.cmd->flags & FTP_CMD_XFER) : cli->held) {
+			/* Restored, the line is found again once resumed. Once
+			 * the transfer is aborted, every line waits for those. */
+			line[len] = end;
+			cli->held = true;
+			cli->hend = eol + 1;
+			continue;
 		} else {
-			cli->socket = sock;
-			cli->addr = addr;
-			cli->srv = srv;
-			FD_SET(cli->socket, srv->rfds);
-			fsm_init(&cli->fsm, S_IDLE, stt);
-			err = fsm_trigger(&cli->fsm, E_OPEN, NULL);
-			if (err) return err;
+			fsm_trigger(&cli->fsm, E_RECV, &req);
+			cli_trace(cli, req.cmd, ready);
+		}
+		/* Held lines are moved up against the following one */
+		netbuf_cut(in, sol, eol + 1 - sol);
+		cli->hend = eol + 1;
+	}
+
+	/* Nothing is dispatched to a closing session anymore */
+	if (cli->fsm.state == S_CLOSE)
+		netbuf_reset(in);
+
+	/* Line does not fit, it is refused once and skipped up to its end.
+	 * Held lines fill the input up instead, reception waits. */
+	if (netbuf_room(in) == 0 && !cli->held) {
+		if (!cli->discard)
+			ftp_reply(cli, 500);
+		cli->discard = true;
+		netbuf_reset(in);
+	}
+}
+
+/**
+ * Dispatch every complete command line buffered. Output limit only pauses
+ * reception: what is already received is bounded by the buffer and is
+ * always dispatched, unless held by a transfer.
+ * @param n [in] Bytes just written behind the input, only those are
+ *               scanned
+ */
+static void cli_process(struct ftp_cli *cli, uint32_t n)
+{
+	struct netbuf *const in = &cli->in;
+	uint32_t lf[FTP_LINE_MAX];
+	unsigned nlf;
+
+	/* Lines are dispatched in place, Telnet commands stripped */
+	uint64_t const ready = clk_ticks();
+	uint32_t const off = in->tail;
+	netbuf_produce(in, (uint32_t)scan_lines(netbuf_at(in, off), n,
+	                                        &cli->telnet, lf, &nlf));
+	cli_dispatch(cli, off, lf, nlf, ready);
+}
+
+/**
+ * Append received bytes to the input and dispatch the lines completed
+ * @param data [in] Received bytes, may already be in the input room
+ * @return          Bytes appended, fewer once the input is full of held
+ *                  lines
+ */
+static size_t cli_feed(struct ftp_cli *cli, char const *data, size_t len)
+{
+	size_t done = 0;
+
+	/* A partial line at most is left behind, there is always room
+	 * unless lines are held.
+	 * Stripped Telnet commands leave a gap behind the input: bytes
+	 * are then moved down, towards the tail. */
+	while (done < len) {
+		uint32_t const room = netbuf_wlen(&cli->in);
+		uint32_t const n = len - done < room ? (uint32_t)(len - done) : room;
+		char *const tail = netbuf_at(&cli->in, cli->in.tail);
+
+		if (room == 0) break;
+		if (data + done != tail)
+			memmove(tail, data + done, n);
+		done += n;
+		cli_process(cli, n);
+	}
+	return done;
+}
+
+/**
+ * Dispatch the lines held during a transfer, once it is over
+ */
+static void cli_resume(struct ftp_cli *cli)
+{
+	struct netbuf *const in = &cli->in;
+
+	/* Transfer started by a held line may be aborted by a following
+	 * one in turn, what it held is resumed again */
+	while (cli->held && cli->fsm.state != S_XFER) {
+		uint32_t lf[FTP_LINE_MAX];
+		unsigned nlf = 0;
+		struct iovec iov[2];
+		int const cnt = netbuf_rslices(in, iov);
+
+		/* Scanned on reception already: line feeds are all that is
+		 * left */
+		for (int i = 0, at = 0; i < cnt; at += (int)iov[i++].iov_len) {
+			char const *const base = iov[i].iov_base;
+			char const *const end = base + iov[i].iov_len;
+
+			for (char const *p = base;
+			     (p = memchr(p, '\n', (size_t)(end - p))); ++p)
+				lf[nlf++] = (uint32_t)(at + (p - base));
+		}
+		cli->held = false;
+		cli_dispatch(cli, in->head, lf, nlf, clk_ticks());
+
+		/* Then what was received past the full input, unless held
+		 * again */
+		while (cli->spill.len && !cli->held) {
+			struct ftp_chunk const *const chunk = cli->spill.head;
+			size_t const n = chunk->len - cli->spill.off;
+
+			outq_consume(&cli->spill,
+			             cli_feed(cli, chunk->data + cli->spill.off, n));
 		}
 	}
+}
+
+/**
+ * @param iov [in] Received bytes, may already be in the session input
+ *                 room
+ * @param res [in] Received bytes, negated errno on failure
+ */
+static int cli_input(struct ftp_cli *cli, struct iovec const *iov, int res)
+{
+	if (res <= 0) {
+		errno = -res;
+		return cli_close(cli->srv, cli), 0;
+	}
 
-	struct timeval *to = NULL;
+	if (cli->login && cli->fsm.state != S_XFER)
+		cli_arm(cli, FTP_TIMER_IDLE);
 
-	for (struct ftp_cli *cli = srv->clients;
-	     cli != srv->clients + FTP_MAX_CLIENT; ++cli) {
+	/* Input is full of held lines: reception is paused, but completions
+	 * of receptions in flight still come. They are kept aside, in
+	 * order, until the held lines are dispatched. */
+	for (size_t len = (size_t)res; len; ++iov) {
+		char const *const data = iov->iov_base;
+		size_t const n = iov->iov_len < len ? iov->iov_len : len;
+		size_t const fed = cli->spill.len ? 0 : cli_feed(cli, data, n);
+
+		len -= n;
+		if (fed < n && outq_push(&cli->spill, data + fed, n - fed))
+			return cli_close(cli->srv, cli), 0;
+	}
+	if (cli->spill.len > FTP_SPILL_MAX) {
+		errno = ENOBUFS;
+		return cli_close(cli->srv, cli), 0;
+	}
+	cli_resume(cli);
+	return cli_settle(cli), 0;
+}
 
-		if (!cli->socket)
+/**
+ * Tell the session its transfer is over, then dispatch what it held
+ * @param err [in] Transfer errno, 0 on success
+ */
+static void cli_done(struct ftp_cli *cli, int err)
+{
+	if (cli_xfer_cancel(cli, err))
+		return;
+	fsm_trigger(&cli->fsm, E_DONE, &err);
+	cli_resume(cli);
+	cli_settle(cli);
+}
+
+/**
+ * Move the running transfer on, by a quantum at most
+ */
+static void cli_pump(struct ftp_cli *cli)
+{
+	struct xfer *const xfer = &cli->xfer;
+	uint64_t const count = xfer->count;
+
+	if (!xfer->connected) {
+		if (xfer_established(xfer))
+			return cli_done(cli, errno);
+
+		/* Connected once writable, receptions wait for input then */
+		if (xfer->dir == XFER_RECV &&
+		    ev_mod(&cli->srv->ev, xfer->socket, EV_READ, cli->xtag))
+			return cli_done(cli, errno);
+	}
+
+	int const res = xfer_run(xfer, FTP_XFER_QUANTUM);
+	if (res < 0)
+		return cli_done(cli, errno);
+	if (res == XFER_DONE)
+		return cli_done(cli, 0);
+
+	if (xfer->count != count)
+		cli_arm(cli, FTP_TIMER_DATA);
+	if (res == XFER_MORE)
+		cli_ready(cli);
+	else if (res == XFER_LIMIT)
+		cli_xfer_pace(cli);
+}
+
+/**
+ * Tell the sessions whose transfer a worker handed back
+ */
+static void srv_xfer_done(ftp_srv_t *srv)
+{
+	srv_xfer_take(srv);
+	while (srv->xdone) {
+		struct xjob *const job = srv->xdone;
+
+		struct ftp_cli *const cli = container_of(job, struct ftp_cli, job);
+
+		/* Cancelled for the reason the session had */
+		int const err = job->err == ECANCELED && cli->cancel ? cli->cancel
+			: job->err;
+
+		srv->xdone = job->next;
+		job->busy = false;
+		if (cli->socket < 0)
+			cli_free(srv, cli);
+		else
+			cli_done(cli, err);
+	}
+}
+
+/**
+ * Accept the passive mode connection, of the session peer only: ports
+ * are easily guessed. A transfer waiting for it starts.
+ */
+static void cli_pasv_accept(struct ftp_cli *cli)
+{
+	int const lsock = pasv_socket(cli->srv->conf->pasv, cli->pasv);
+	struct sockaddr_in addr;
+	int sock;
+
+	while (true) {
+		sock = accept4(lsock, (struct sockaddr *)&addr,
+		               &(socklen_t){ sizeof addr },
+		               SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0 && errno == ECONNABORTED)
 			continue;
+		if (sock < 0 || addr.sin_addr.s_addr == cli->addr.sin_addr.s_addr)
+			break;
+		close(sock);
+	}
+	if (sock < 0 && errno == EAGAIN)
+		return;
+
+	/* Port is not needed anymore, even when accepting failed: the
+	 * transfer then fails for lack of data connection */
+	int const err = errno;
+
+	cli_pasv_put(cli, sock < 0);
+	if (sock < 0) {
+		if (xfer_active(&cli->xfer))
+			cli_done(cli, err);
+		return;
+	}
+	cli->data = sock;
+	if (xfer_active(&cli->xfer) && cli_xfer_attach(cli))
+		cli_done(cli, errno);
+}
+
+/**
+ * Give every ready transfer a quantum, those still ready afterwards wait
+ * for the next round: one huge transfer never starves the other sessions
+ */
+static void srv_pump(ftp_srv_t *srv)
+{
+	struct ftp_cli *round = srv->ready;
+
+	if (round) round->rprev = &round;
+	srv->ready = NULL;
+	while (round) {
+		struct ftp_cli *const cli = round;
+
+		cli_unready(cli);
+		cli_pump(cli);
+	}
+}
+
+/**
+ * @param res  [in] Sent bytes, negated errno on failure
+ */
+static void cli_sent(struct ftp_cli *cli, int res)
+{
+	cli->sending = false;
+
+	if (res < 0) {
+		errno = -res;
+		return cli_close(cli->srv, cli);
+	}
+
+	outq_consume(&cli->outq, (size_t)res);
+	if (cli_drain(cli))
+		return cli_close(cli->srv, cli);
 
-		if (cli->timeout.tv_sec || cli->timeout.tv_usec) {
-			if (timercmp(&cli->timeout, &srv->now, >=) == 0) {
-				memset(&cli->timeout, 0, sizeof cli->timeout);
-				err = fsm_trigger(&cli->fsm, E_TIMEOUT, NULL);
-				if (err) break;
-			} else if (to == NULL || timercmp(&cli->timeout, to, <) == 0)
-				to = &cli->timeout;
+	if (cli->fsm.state == S_CLOSE)
+		cli_closing(cli);
+}
+
+int ftp_srv_start(ftp_srv_t *srv, ev_event_t const *evs, int n, int *timeout)
+{
+	int err = 0;
+
+	/* Cached for the whole iteration, timeouts need no better */
+	srv->now = clk_ms();
+
+	/* Only ready descriptors, or completed operations, are visited */
+	for (ev_event_t const *ev = evs; ev != evs + n && !err; ++ev) {
+		/* Completion based backend accepts on its own, one session
+		 * per completion */
+		if (ev->events & EV_ACCEPT) {
+			if (ev->res >= 0)
+				err = cli_open(srv, ev->res, NULL);
+			else
+				srv_accept_error(srv, -ev->res);
+			continue;
 		}
 
-		if (!FD_ISSET(cli->socket, rfds))
+		if (ev->fd == srv->socket) {
+			err = srv_accept(srv);
 			continue;
+		}
 
-		char data[BUF_SIZE + 1];
-		ssize_t const rd = recv(cli->socket, data, sizeof data, 0);
-		if (rd < 0) {
-			cli_close(srv, cli);
+		if (ev->fd == srv->xq.fd) {
+			srv_xfer_done(srv);
 			continue;
 		}
 
-		struct netbuf buf = {
-			.buf = data,
-			.size = (uint16_t)rd };
-
-		data[rd] = '\0';
-		char *cr = strchr(data, '\r');
-		if (cr) *cr = 0;
-		char *lf = strchr(data, '\n');
-		if (lf) *lf = 0;
-		err = fsm_trigger(&cli->fsm, E_RECV, &buf);
-		if (err) {
-			err = dprintf(cli->socket, "%s", getcmd(421, NULL));
-			if (err < 0) return err;
-			break;
+		/* Descriptors not owned by the server (ex: console), or
+		 * late events of a closed session */
+		struct ftp_cli *const cli = cli_find(srv, ev->fd);
+		if (cli == NULL)
+			continue;
+
+		/* Data connection, its events are ignored while the transfer
+		 * is queued for the next round anyway, or rate limited */
+		if (ev->fd != cli->socket) {
+			if (ev->tag != cli->xtag)
+				continue;
+			if (cli->pasv >= 0 &&
+			    ev->fd == pasv_socket(srv->conf->pasv, cli->pasv))
+				cli_pasv_accept(cli);
+			else if (cli->rprev == NULL &&
+			         !timer_pending(&cli->pace))
+				cli_pump(cli);
+			continue;
 		}
+		if (cli->tag != ev->tag)
+			continue;
+
+		if (ev->events & EV_SEND) {
+			cli_sent(cli, ev->res);
+			continue;
+		}
+
+		if (ev->events & EV_RECV) {
+			err = cli_input(cli, &(struct iovec){
+				ev->buf, ev->res > 0 ? (size_t)ev->res : 0 }, ev->res);
+			continue;
+		}
+
+		/* Hang up while paused is only noticed by the output side */
+		if (((ev->events & EV_WRITE) ||
+		     (cli->paused && (ev->events & EV_ERROR))) && cli_drain(cli)) {
+			cli_close(srv, cli);
+			continue;
+		}
+
+		if (!(ev->events & (EV_READ | EV_ERROR)) || cli->paused ||
+		    netbuf_room(&cli->in) == 0)
+			continue;
+
+		/* Received straight behind the pending partial line */
+		struct iovec iov[2];
+		int const cnt = netbuf_wslices(&cli->in, iov);
+		ssize_t const rd = readv(cli->socket, iov, cnt);
+		if (rd < 0 && errno == EAGAIN)
+			continue;
+		err = cli_input(cli, iov, rd < 0 ? -errno : (int)rd);
 	}
 
-	if (to) timersub(to, &srv->now, timeout);
+	srv_pump(srv);
+
+	/* Expire sessions timeouts and sleep until the next one, unless a
+	 * transfer may go on at once */
+	timer_advance(&srv->timers, srv->now);
+	*timeout = srv->ready ? 0 : timer_next(&srv->timers);
 	return err;
 }
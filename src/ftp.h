@@ -13,8 +13,15 @@
 #ifndef __FTP_H
 # define __FTP_H
 
+#include <ev.h>
 #include <fsm.h>
+#include <netbuf.h>
+#include <pasv.h>
+#include <timer.h>
+#include <xfer.h>
+#include <xpool.h>
 
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -22,66 +29,285 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
-#define FTP_MAX_CLIENT (6)
+#ifndef FT_P_LISTEN_QUEUE
+# define FT_P_LISTEN_QUEUE 128
+#endif
+
+#define FTP_MAX_CLIENT     (4096) /**< Default limit of concurrent sessions */
+#define FTP_CLI_TABLE        (64) /**< Initial size of the client table     */
+#define FTP_MAX_THREADS     (256) /**< Upper bound of reactor threads       */
+#define FTP_LINE_MAX       (4096) /**< Longest line with CRLF, power of two */
+#define FTP_REPLY_CODES     (600) /**< Replies codes upper bound            */
+#define FTP_REPLY_MAX (2 * PATH_MAX) /**< Variable replies text per flush  */
+#define FTP_OUT_MAX        (1024) /**< Replies parts per flush (IOV_MAX)    */
+#define FTP_IOV_MAX          (16) /**< Queued chunks per send               */
+#define FTP_CHUNK_SIZE     (4096) /**< Output queue allocation unit         */
+#define FTP_MAX_OUTPUT (64 * 1024) /**< Default output limit per session    */
+#define FTP_ACCEPT_BACKOFF  (100) /**< Listener pause when overloaded, ms   */
+#define FTP_SLOW_COMMAND    (100) /**< Commands logged beyond, ms           */
+#define FTP_LAT_SLOTS       (129) /**< Commands registry slots, and unknown */
+#define FTP_XFER_QUANTUM (256 * 1024) /**< Bytes a transfer sends per round */
+#define FTP_SPILL_MAX (16 * FTP_LINE_MAX) /**< Input kept past held lines */
 
 enum ftp_type {
-	FT_TYPE_ASCII = 0,
-	FT_TYPE_NONPRINT,
+	FTP_TYPE_ASCII = 0, /**< Default, lines end with CRLF on the wire */
+	FTP_TYPE_IMAGE,
 };
 
 enum ftp_mode {
-	FTP_MODE_STREAM = 0
+	FTP_MODE_STREAM = 0,
+	FTP_MODE_BLOCK,      /**< MODE B, the connection is kept */
+	FTP_MODE_DEFLATE,    /**< MODE Z, a zlib stream          */
 };
 
 enum ftp_struct {
 	FTP_STRUCTURE_FILE = 0,
-	FTP_STRUCTURE_RECORD,
 };
 
-#define FTP_STR_TO_CMD(s) ((s)[0]+((s)[1]<<8)+((s)[1]<<16)+((s)[1]<<24))
-
-enum ftp_cmd {
-	FTP_CMD_USER = 1,
-	FTP_CMD_PASS,
-	FTP_CMD_QUIT,
-	FTP_CMD_PORT,
-	FTP_CMD_TYPE,
-	FTP_CMD_MODE,
-	FTP_CMD_STRU,
-	FTP_CMD_RETR,
-	FTP_CMD_STOR,
-	FTP_CMD_NOOP,
+/**
+ * Per session timeouts, each one is armed and expires independently
+ */
+enum ftp_timer {
+	FTP_TIMER_IDLE = 0, /**< No command received once logged in */
+	FTP_TIMER_LOGIN,    /**< Not logged in yet                  */
+	FTP_TIMER_DATA,     /**< No data connection activity        */
+	FTP_TIMER_MAX,
 };
 
+#define FTP_IDLE_TIMEOUT  (300) /**< Default idle timeout in seconds  */
+#define FTP_LOGIN_TIMEOUT  (60) /**< Default login timeout in seconds */
+#define FTP_DATA_TIMEOUT  (120) /**< Default data timeout in seconds  */
+
 struct ftp_usr {
 	char const *user;
 	char const *pswd;
+	struct shape shape[XFER_DIR_MAX]; /**< Rate limits by direction,
+	                                       shared by its sessions */
+};
+
+struct ftp_chunk {
+	struct ftp_chunk *next;
+	size_t len;                /**< Bytes written in `data` */
+	char data[FTP_CHUNK_SIZE];
+};
+
+/**
+ * Session output queue, chunks are never moved so that in flight sends
+ * stay valid while more output is queued. Also keeps input received once
+ * the input buffer is full.
+ */
+struct ftp_outq {
+	struct ftp_chunk *head, *tail;
+	size_t off;                /**< Bytes of `head` already sent */
+	size_t len;                /**< Queued bytes                 */
 };
 
 typedef struct ftp_cli {
 	struct ftp_srv *srv;
 	int socket;
+	uint32_t tag;              /**< Tells reused descriptors apart  */
 	struct sockaddr_in addr;
-	struct timeval timeout;
+	struct timer timers[FTP_TIMER_MAX];
 	fsm_t fsm;
 	struct ftp_usr *user;
 	bool login;
+	bool sending;                  /**< A send is in flight          */
+	bool paused;                   /**< Input paused until drained   */
+	int error;                     /**< Deferred output error        */
+	uint32_t watch;                /**< Watched events               */
+	bool discard;                  /**< Skipping an overlong line    */
+	uint8_t telnet;                /**< Telnet commands parser state */
+	struct netbuf in;              /**< Input not dispatched yet     */
+	char inbuf[FTP_LINE_MAX];
+	struct ftp_outq spill;         /**< Input past held lines         */
+	struct ftp_outq outq;          /**< Output not accepted by socket */
+	struct iovec iov[FTP_IOV_MAX]; /**< Output in flight             */
+	struct msghdr msg;
+	enum ftp_type type;
+	enum ftp_mode mode;
+	int zlevel;                    /**< MODE Z compression level     */
+	enum ftp_struct stru;
+	uint64_t rest;                 /**< Next transfer start offset   */
+	bool restart;                  /**< REST given, even at 0        */
+	uint64_t allo;                 /**< Next upload announced size   */
+	struct sockaddr_in port;       /**< Active mode data address     */
+	int pasv;                      /**< Passive mode port, -1 if none */
+	int data;                      /**< Passive mode connection not
+	                                    transferring yet, -1 if none */
+	bool epsv_all;                 /**< Only EPSV sets data ports up */
+	struct xfer xfer;              /**< Running transfer             */
+	uint32_t xtag;                 /**< Tag of the data connection   */
+	uint32_t xverb;                /**< Packed verb of the transfer  */
+	bool held;                     /**< Lines held until transferred */
+	uint32_t hend;                 /**< Offset past the held lines   */
+	struct xjob job;               /**< Transfer moved on a worker   */
+	int cancel;                    /**< Errno the worker was asked to
+	                                    end the transfer with, 0 if
+	                                    none                         */
+	bool moved;                    /**< Data connection on a worker  */
+	uint64_t xseen;                /**< Bytes at last data timeout   */
+	uint64_t xtotal;               /**< Bytes a moved send moves     */
+	struct shape shape[XFER_DIR_MAX]; /**< Rate limits by direction  */
+	struct timer pace;             /**< Resumes a rate limited
+	                                    transfer                     */
+	struct ftp_cli *rnext;         /**< Next transfer ready to go on */
+	struct ftp_cli **rprev;        /**< Link to us, NULL if waiting  */
+	char *rnfr;                    /**< Pending rename source        */
+	char cwd[PATH_MAX];            /**< Working directory, from root */
 } ftp_cli_t;
 
+/**
+ * Server configuration, read-only once the server is open
+ */
+struct ftp_conf {
+	int port;                /**< Listening port                      */
+	char const *root;        /**< Served directory                    */
+	struct ftp_usr *users;   /**< NULL terminated list of known users */
+	unsigned max_clients;    /**< Limit of concurrent sessions        */
+	unsigned threads;        /**< Number of reactors sharing the load */
+	enum ev_backend backend; /**< Reactors event backend              */
+	size_t max_output;       /**< Output bytes buffered per session
+	                              before its input is paused          */
+	int backlog;             /**< Pending connections per listener    */
+	unsigned timeouts[FTP_TIMER_MAX]; /**< In milliseconds, 0 to disable */
+	unsigned slow;           /**< Slow commands logged, ms, 0 to disable */
+	enum xfer_sync sync;     /**< Received files durability           */
+	struct pasv_pool *pasv;  /**< Passive mode ports, NULL if disabled */
+	struct in_addr pasv_addr; /**< Passive mode address given to peers,
+	                               any for the one they connected to */
+	struct shape *shape;     /**< Server rate limits by direction,
+	                              shared by every reactor, NULL if none */
+	uint64_t rates[XFER_DIR_MAX]; /**< Sessions rate limits, in bytes per
+	                                   second, 0 for unlimited */
+};
+
+/**
+ * Commands latency, from line complete to replies flushed, written by the
+ * owning reactor only: always access them atomically
+ */
+struct ftp_lat {
+	uint64_t verb;  /**< Packed verb, 0 for unknown commands */
+	uint64_t count;
+	uint64_t total; /**< In nanoseconds                      */
+	uint64_t max;   /**< In nanoseconds                      */
+};
+
+/**
+ * Dispatched command waiting for its replies to be flushed
+ */
+struct ftp_trace {
+	uint64_t start;
+	uint32_t verb;
+	uint32_t slot;
+};
+
+/**
+ * Connection counters, written by the owning reactor only but read by the
+ * console from another thread: always access them atomically
+ */
+struct ftp_stats {
+	uint64_t accepted;   /**< Sessions opened                          */
+	uint64_t rejected;   /**< Refused with a 421, sessions limit hit   */
+	uint64_t overflowed; /**< Dropped, out of descriptors or memory    */
+};
+
+/**
+ * Server instance, one per reactor thread
+ * Every instance owns a listener bound to the same port (SO_REUSEPORT),
+ * the kernel spreads incoming connections among them.
+ */
 typedef struct ftp_srv {
-	char const *root;
-	fd_set *rfds;
-	struct ftp_usr *users;
+	struct ftp_conf const *conf;
+	struct ev ev;
 	int socket;
+	int root;                  /**< Served directory                    */
+	int spare;                 /**< Reserved descriptor, see `srv_shed` */
+	struct timer backoff;      /**< Resumes a paused listener           */
 	struct sockaddr_in addr;
-	struct timeval now;
-	struct ftp_cli clients[FTP_MAX_CLIENT];
+	struct ftp_stats stats;
+	struct ftp_lat lat[FTP_LAT_SLOTS];
+	unsigned ntraces;
+	struct ftp_trace traces[FTP_OUT_MAX]; /**< Commands not flushed yet */
+#if FT_P_FSM_STATS
+	struct fsm_stats fsm;      /**< Sessions state machine         */
+#endif
+	uint64_t now;              /**< Monotonic time in milliseconds */
+	struct timer_wheel timers; /**< Sessions timeouts              */
+	struct ftp_cli **clients; /**< Sessions indexed by descriptor,
+	                               data connections included */
+	struct ftp_cli *ready;    /**< Transfers going on next round  */
+	struct xqueue xq;         /**< Transfers queued back by workers */
+	struct xjob *xdone;       /**< Taken completions, not handled  */
+	unsigned nclients;        /**< Number of live sessions        */
+	unsigned max_clients;     /**< Share of `conf->max_clients`   */
+	uint32_t seq;             /**< Next session tag               */
+	unsigned size;            /**< Size of the client table       */
+
+	/* Replies of the session being handled, flushed before the reactor
+	 * handles another one: at most one write per session and wakeup */
+	unsigned nout;
+	unsigned ntxt;
+	struct iovec out[FTP_OUT_MAX]; /**< Replies parts pending           */
+	char txt[FTP_REPLY_MAX];       /**< Variable parts, copied as is    */
+	char line[FTP_LINE_MAX];       /**< Line wrapping around its input  */
 } ftp_srv_t;
 
-int ftp_srv_open(int port, char const *root,
-                 fd_set *rfds, struct ftp_usr *users, ftp_srv_t *srv);
+int ftp_srv_open(struct ftp_conf const *conf, ftp_srv_t *srv);
+
+void ftp_srv_close(ftp_srv_t *srv);
+
+/**
+ * Add a server counters to `stats`, safe to call from any thread
+ */
+void ftp_srv_stats(ftp_srv_t const *srv, struct ftp_stats *stats);
+
+/**
+ * Add a server commands latency to `lat`, safe to call from any thread
+ */
+void ftp_srv_latency(ftp_srv_t const *srv, struct ftp_lat lat[FTP_LAT_SLOTS]);
+
+#if FT_P_FSM_STATS
+
+/**
+ * Line printer, lines are given without line ending
+ */
+typedef void ftp_print_fn(void *ctx, char const *line);
+
+/**
+ * Size sessions FSM statistics
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int ftp_fsm_stats_init(struct fsm_stats *stats);
+
+/**
+ * Add a server sessions FSM statistics to `stats`, safe to call from any
+ * thread
+ */
+void ftp_srv_fsm_stats(ftp_srv_t const *srv, struct fsm_stats *stats);
+
+/**
+ * Print sessions per state, then every transition taken with its count
+ * and mean action time
+ */
+void ftp_fsm_stats_print(struct fsm_stats const *stats, ftp_print_fn *print,
+                         void *ctx);
+
+#endif
+
+/**
+ * Measure the dispatch of a command line by a logged in session: parsing,
+ * state machine and handler, replies are built then dropped
+ * @note Runs on a private server, with neither listener nor reactor
+ * @param line  [in] Command line, without CRLF
+ * @param count [in] Number of dispatches
+ * @param ns   [out] Mean dispatch time, in nanoseconds
+ * @return           0 on success, -1 otherwise (errno is set)
+ */
+int ftp_bench(struct ftp_conf const *conf, char const *line, unsigned count,
+              uint64_t *ns);
 
-int ftp_srv_start(ftp_srv_t *srv, const fd_set *rfds, struct timeval *timeout);
+int ftp_srv_start(ftp_srv_t *srv, ev_event_t const *evs, int n, int *timeout);
 
 #endif /* !__FTP_ */
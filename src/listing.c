@@ -0,0 +1,146 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   listing.c                                          :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "listing.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+int listing_init(struct listing *l, bool names, char const *name)
+{
+	*l = (struct listing){ .names = names, .now = time(NULL) };
+
+	if (name)
+		return (l->name = strdup(name)) ? 0 : -1;
+	return (l->dents = malloc(LISTING_DENTS)) ? 0 : -1;
+}
+
+void listing_fini(struct listing *l)
+{
+	free(l->name);
+	free(l->dents);
+}
+
+/**
+ * Write the `ls -l` like line of an entry, owners are numeric: looking
+ * their names up may block
+ * @param out [out] Line, `LISTING_LINE` bytes of room
+ * @param dir  [in] Directory the entry is in
+ * @param name [in] Entry name, relative to `dir`
+ * @return          Line length, -1 on failure (errno is set)
+ */
+static int listing_long(struct listing const *l, char *out, int dir,
+                        char const *name, struct stat const *st)
+{
+	static char const types[(S_IFMT >> 12) + 1] = {
+		[S_IFREG >> 12] = '-', [S_IFDIR >> 12] = 'd',
+		[S_IFLNK >> 12] = 'l', [S_IFIFO >> 12] = 'p',
+		[S_IFSOCK >> 12] = 's', [S_IFCHR >> 12] = 'c',
+		[S_IFBLK >> 12] = 'b',
+	};
+	char mode[11], date[16], link[PATH_MAX];
+	struct tm tm;
+	ssize_t len = -1;
+
+	mode[0] = types[(st->st_mode & S_IFMT) >> 12];
+	if (mode[0] == '\0') mode[0] = '?';
+	for (unsigned i = 0; i < 9; ++i)
+		mode[i + 1] = st->st_mode & (0400 >> i) ? "rwx"[i % 3] : '-';
+	mode[10] = '\0';
+
+	/* Time of day for the last six months, the year before */
+	bool const recent = st->st_mtime <= l->now &&
+		l->now - st->st_mtime < 6 * 30 * 24 * 3600;
+
+	if (gmtime_r(&st->st_mtime, &tm) == NULL)
+		return -1;
+	strftime(date, sizeof date, recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+
+	if (S_ISLNK(st->st_mode) &&
+	    (len = readlinkat(dir, name, link, sizeof link - 1)) >= 0)
+		link[len] = '\0';
+
+	return snprintf(out, LISTING_LINE, "%s %3lu %-8u %-8u %12lu %s %s%s%s\n",
+	                mode, (unsigned long)st->st_nlink, st->st_uid,
+	                st->st_gid, (unsigned long)st->st_size, date, name,
+	                len >= 0 ? " -> " : "", len >= 0 ? link : "");
+}
+
+/**
+ * List an entry given alone, by the name it was given
+ */
+static ssize_t listing_single(struct listing *l, int file, char *out)
+{
+	struct stat st;
+	int len;
+
+	if (l->done) return 0;
+	if (l->names)
+		len = snprintf(out, LISTING_LINE, "%s\n", l->name);
+	else if (fstat(file, &st))
+		return -1;
+	else
+		len = listing_long(l, out, file, l->name, &st);
+
+	if (len >= LISTING_LINE)
+		return (errno = ENAMETOOLONG), -1;
+	l->done = true;
+	return len;
+}
+
+ssize_t listing_read(struct listing *l, int file, char *out, size_t room)
+{
+	size_t len = 0;
+
+	if (l->name)
+		return listing_single(l, file, out);
+
+	while (room - len >= LISTING_LINE) {
+		if (l->head == l->tail) {
+			ssize_t const rd = getdents64(file, l->dents, LISTING_DENTS);
+			if (rd < 0) return -1;
+			if (rd == 0) break;
+			l->head = 0;
+			l->tail = (size_t)rd;
+		}
+
+		struct dirent64 const *const ent =
+			(struct dirent64 const *)(l->dents + l->head);
+		char const *const name = ent->d_name;
+		struct stat st;
+		int n;
+
+		l->head += ent->d_reclen;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		if (l->names) {
+			n = snprintf(out + len, LISTING_LINE, "%s\n", name);
+		} else {
+			/* Entries removed meanwhile are left out */
+			if (fstatat(file, name, &st, AT_SYMLINK_NOFOLLOW))
+				continue;
+			if ((n = listing_long(l, out + len, file, name, &st)) < 0)
+				return -1;
+		}
+		len += (size_t)n;
+	}
+	return (ssize_t)len;
+}
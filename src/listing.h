@@ -0,0 +1,68 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   listing.h                                          :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file listing.h
+ * @brief
+ * LIST and NLST contents, produced as they are sent: entries are read
+ * from the directory by the thread moving the transfer, a chunk at a
+ * time, never all at once by the control reactor
+ */
+#ifndef __LISTING_H
+# define __LISTING_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#define LISTING_LINE (PATH_MAX + NAME_MAX + 128) /**< Longest line, with
+                                                      a link target   */
+#define LISTING_DENTS            (32 * 1024) /**< Entries read at once */
+
+/**
+ * Listing state of a transfer
+ */
+struct listing {
+	bool names;               /**< Names only (NLST), `ls -l` like
+	                               lines otherwise                   */
+	bool done;                /**< Single entry listed               */
+	char *name;               /**< Entry listed alone, NULL for the
+	                               entries of a directory            */
+	time_t now;               /**< Entries are dated from it         */
+	size_t head;              /**< Next directory entry read         */
+	size_t tail;              /**< End of the directory entries read */
+	char *dents;              /**< Directory entries read            */
+};
+
+/**
+ * @param names [in] Names only (NLST), `ls -l` like lines otherwise
+ * @param name  [in] Name a single entry is listed by, NULL to list the
+ *                   entries of a directory
+ * @return           0 on success, -1 otherwise (errno is set)
+ */
+int listing_init(struct listing *l, bool names, char const *name);
+
+void listing_fini(struct listing *l);
+
+/**
+ * List the next entries, as many whole lines as fit
+ * @param file [in] Listed directory, or single entry
+ * @param out [out] Lines, each ending with a line feed
+ * @param room [in] Room of `out`, `LISTING_LINE` bytes at least
+ * @return          Bytes listed, 0 once every entry is, -1 on failure
+ *                  (errno is set)
+ */
+ssize_t listing_read(struct listing *l, int file, char *out, size_t room);
+
+#endif /* !__LISTING_H */
@@ -0,0 +1,252 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   log.c                                              :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "log.h"
+
+#include <ft/stdio.h>
+#include <ft/stdlib.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#define LOG_BUF_SIZE (64 * 1024) /**< Formatted output per write */
+#define LOG_LINE_MAX (256)       /**< Longest formatted record   */
+
+struct log_rec {
+	uint64_t time;    /**< Wall clock, in milliseconds */
+	uint32_t session;
+	uint16_t event;
+	uint64_t fields[LOG_FIELDS];
+};
+
+/**
+ * Single producer (its thread), single consumer (the writer) ring, both
+ * offsets are free running
+ */
+struct log_ring {
+	_Alignas(64) uint32_t head; /**< Next record to write, writer side */
+	_Alignas(64) uint32_t tail; /**< Next record to fill, thread side  */
+	uint64_t dropped;           /**< Records lost on a full ring       */
+	struct log_rec recs[LOG_RING_SIZE];
+};
+
+static struct log_ring *g_rings[LOG_MAX_RINGS];
+static unsigned g_nrings;
+static pthread_t g_writer;
+static int g_fd = -1;
+static bool g_stop;
+
+static __thread struct log_ring *t_ring;
+
+int log_attach(void)
+{
+	unsigned const id = __atomic_fetch_add(&g_nrings, 1, __ATOMIC_RELAXED);
+
+	if (id >= LOG_MAX_RINGS)
+		return (errno = ENOSPC), -1;
+
+	struct log_ring *const ring = aligned_alloc(64, sizeof *ring);
+	if (ring == NULL) return -1;
+
+	*ring = (struct log_ring){ };
+	__atomic_store_n(g_rings + id, ring, __ATOMIC_RELEASE);
+	return (t_ring = ring), 0;
+}
+
+void log_push(enum log_event event, uint32_t session,
+              uint64_t const fields[LOG_FIELDS])
+{
+	struct log_ring *const ring = t_ring;
+	if (ring == NULL) return;
+
+	uint32_t const tail = ring->tail;
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct log_rec *const rec = ring->recs + (tail & (LOG_RING_SIZE - 1));
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	rec->time = (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+	rec->session = session;
+	rec->event = (uint16_t)event;
+	for (unsigned i = 0; i < LOG_FIELDS; ++i)
+		rec->fields[i] = fields[i];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Format a record as a line
+ * @return Line length, truncated to the buffer
+ */
+static size_t log_format(char *buf, unsigned id, struct log_rec const *rec)
+{
+	time_t const sec = (time_t)(rec->time / 1000);
+	uint64_t const *const f = rec->fields;
+	char addr[INET_ADDRSTRLEN];
+	struct tm tm;
+	int n;
+
+	gmtime_r(&sec, &tm);
+	n = ft_snprintf(buf, LOG_LINE_MAX,
+	                "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ %u:%u ",
+	                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+	                tm.tm_min, tm.tm_sec, (unsigned)(rec->time % 1000), id,
+	                rec->session);
+	if (n < 0) return 0;
+
+	char *const s = buf + n;
+	size_t const size = LOG_LINE_MAX - (size_t)n;
+
+	switch (rec->event) {
+	case LOG_OPEN:
+		inet_ntop(AF_INET, &(struct in_addr){ (in_addr_t)f[0] }, addr,
+		          sizeof addr);
+		n += ft_snprintf(s, size, "open %s:%u\n", addr,
+		                 (unsigned)ntohs((uint16_t)f[1]));
+		break;
+	case LOG_LOGIN:
+		n += ft_snprintf(s, size, "login %s\n",
+		                 (char const *)(uintptr_t)f[0]);
+		break;
+	case LOG_CLOSE:
+		n += f[0] ? ft_snprintf(s, size, "close: %s\n", ft_strerror((int)f[0]))
+		          : ft_snprintf(s, size, "close\n");
+		break;
+	case LOG_ACCEPT:
+		n += ft_snprintf(s, size, "accept: %s\n", ft_strerror((int)f[0]));
+		break;
+	case LOG_SLOW:
+		n += ft_snprintf(s, size, "slow %.4s %lu us\n",
+		                 (char const *)&(uint32_t){ (uint32_t)f[0] }, f[1]);
+		break;
+	case LOG_XFER:
+		n += f[2] ? ft_snprintf(s, size, "%.4s %lu bytes: %s\n",
+		                        (char const *)&(uint32_t){ (uint32_t)f[0] },
+		                        f[1], ft_strerror((int)f[2]))
+		          : ft_snprintf(s, size, "%.4s %lu bytes\n",
+		                        (char const *)&(uint32_t){ (uint32_t)f[0] },
+		                        f[1]);
+		break;
+	default:
+		n += ft_snprintf(s, size, "event %u\n", (unsigned)rec->event);
+		break;
+	}
+	return (size_t)n < LOG_LINE_MAX ? (size_t)n : LOG_LINE_MAX - 1;
+}
+
+static void log_flush(char const *buf, size_t len)
+{
+	while (len) {
+		ssize_t const wr = write(g_fd, buf, len);
+		if (wr < 0 && errno == EINTR) continue;
+		if (wr <= 0) return;
+		buf += wr;
+		len -= (size_t)wr;
+	}
+}
+
+/**
+ * Drain every ring once
+ * @param dropped [in,out] Dropped records already reported, per ring
+ * @return                 Whether a record was written
+ */
+static bool log_drain(uint64_t *dropped)
+{
+	static char buf[LOG_BUF_SIZE];
+	unsigned const nrings = __atomic_load_n(&g_nrings, __ATOMIC_RELAXED);
+	size_t len = 0;
+	bool busy = false;
+
+	for (unsigned id = 0; id < nrings && id < LOG_MAX_RINGS; ++id) {
+		struct log_ring *const ring =
+			__atomic_load_n(g_rings + id, __ATOMIC_ACQUIRE);
+		if (ring == NULL) continue;
+
+		uint32_t head = ring->head;
+		uint32_t const tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; ++head) {
+			if (len + LOG_LINE_MAX > sizeof buf) {
+				log_flush(buf, len);
+				len = 0;
+			}
+			len += log_format(buf + len, id,
+			                  ring->recs + (head & (LOG_RING_SIZE - 1)));
+			busy = true;
+		}
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+		uint64_t const lost = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (lost != dropped[id]) {
+			if (len + LOG_LINE_MAX > sizeof buf) {
+				log_flush(buf, len);
+				len = 0;
+			}
+			len += (size_t)ft_snprintf(buf + len, LOG_LINE_MAX,
+			                           "log: %u: %lu records dropped\n",
+			                           id, lost - dropped[id]);
+			dropped[id] = lost;
+		}
+	}
+
+	log_flush(buf, len);
+	return busy;
+}
+
+static void *log_run(void *arg)
+{
+	(void)arg;
+	uint64_t dropped[LOG_MAX_RINGS] = { 0 };
+	struct timespec const period = { 0, LOG_PERIOD * 1000000 };
+
+	while (!__atomic_load_n(&g_stop, __ATOMIC_ACQUIRE))
+		if (!log_drain(dropped))
+			nanosleep(&period, NULL);
+
+	/* Records pushed before the stop request */
+	log_drain(dropped);
+	return NULL;
+}
+
+int log_start(int fd)
+{
+	int err;
+
+	g_fd = fd;
+	g_stop = false;
+	if ((err = pthread_create(&g_writer, NULL, log_run, NULL)))
+		return (errno = err), -1;
+	return 0;
+}
+
+void log_stop(void)
+{
+	__atomic_store_n(&g_stop, true, __ATOMIC_RELEASE);
+	pthread_join(g_writer, NULL);
+
+	unsigned const nrings = g_nrings < LOG_MAX_RINGS ? g_nrings : LOG_MAX_RINGS;
+	for (unsigned id = 0; id < nrings; ++id) {
+		free(g_rings[id]);
+		g_rings[id] = NULL;
+	}
+	g_nrings = 0;
+	t_ring = NULL;
+}
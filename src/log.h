@@ -0,0 +1,74 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   log.h                                              :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file log.h
+ * @brief
+ * Asynchronous logging: threads push binary records into their own
+ * lock-free ring, a background writer formats and writes them. Logging
+ * never blocks, records are dropped (and counted) when a ring is full.
+ */
+#ifndef __LOG_H
+# define __LOG_H
+
+#include <stdint.h>
+
+#define LOG_RING_SIZE (1024) /**< Records per thread, a power of two */
+#define LOG_MAX_RINGS  (257) /**< Threads which may log at once       */
+#define LOG_FIELDS       (3) /**< Fields per record                   */
+#define LOG_PERIOD      (10) /**< Writer polling period, ms           */
+
+/**
+ * Logged events, fields meaning depends on it
+ */
+enum log_event {
+	LOG_OPEN,   /**< Session opened: address, port (network order) */
+	LOG_LOGIN,  /**< Session logged in: user name (static storage) */
+	LOG_CLOSE,  /**< Session closed: errno, 0 for a clean close    */
+	LOG_ACCEPT, /**< Listener failure: errno                       */
+	LOG_SLOW,   /**< Slow command: packed verb, latency in us      */
+	LOG_XFER,   /**< Transfer over: packed verb, bytes, errno      */
+};
+
+/**
+ * Start the background writer
+ * @param fd [in] Output descriptor, owned by the caller
+ * @return        0 on success, -1 otherwise (errno is set)
+ */
+int log_start(int fd);
+
+/**
+ * Write pending records and stop the background writer, logging threads
+ * are expected to be gone
+ */
+void log_stop(void);
+
+/**
+ * Give the calling thread its own ring, records of threads without one
+ * are dropped
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int log_attach(void);
+
+/**
+ * Push a record, never blocks
+ * @param event   [in] Event
+ * @param session [in] Session identifier in its thread
+ * @param fields  [in] Event fields, `LOG_FIELDS` of them
+ */
+void log_push(enum log_event event, uint32_t session,
+              uint64_t const fields[LOG_FIELDS]);
+
+#define LOG(EVENT, SESSION, ...) \
+	log_push((EVENT), (SESSION), (uint64_t const[LOG_FIELDS]){ __VA_ARGS__ })
+
+#endif /* !__LOG_H */
@@ -1,14 +1,32 @@
-SERVER_OBJ += src/ftp.o src/ush.o src/server.o \
+FTP_OBJ    += src/ev.o src/ev_uring.o src/timer.o src/clock.o src/netbuf.o \
+              src/scan.o src/ascii.o src/log.o src/zmode.o src/listing.o \
+              src/xfer.o src/xpool.o src/pasv.o src/cmd.o src/ftp.o \
+              src/ush.o src/shape.o
+
+SERVER_OBJ += $(FTP_OBJ) src/server.o \
               src/server/ls.o \
               src/server/cd.o \
               src/server/pwd.o
 
 $(call set_config,src/server.o,FT_P_LISTEN_QUEUE)
+$(call set_define,src/ftp.o src/cmd.o src/xfer.o src/pasv.o \
+                  src/listing.o,_GNU_SOURCE)
+$(call set_config,src/ev.o src/ev_uring.o,FT_P_IO_URING)
+$(call set_config,src/ftp.o src/cmd.o src/server.o,FT_P_FSM_STATS)
 
 $(eval $(call target_bin,server,SERVER_OBJ,SERVER_BIN))
 $(SERVER_BIN): $(LIBFT_LIB)
 $(SERVER_BIN): CFLAGS  +=  $(LIBFT_CFLAGS)
 $(SERVER_BIN): INCLUDE +=  src
+$(SERVER_BIN): LDLIBS  +=  pthread z
+
+BENCH_OBJ  += $(FTP_OBJ) src/bench.o
+
+$(eval $(call target_bin,bench,BENCH_OBJ,BENCH_BIN))
+$(BENCH_BIN): $(LIBFT_LIB)
+$(BENCH_BIN): CFLAGS  +=  $(LIBFT_CFLAGS)
+$(BENCH_BIN): INCLUDE +=  src
+$(BENCH_BIN): LDLIBS  +=  pthread z
 
 CLIENT_OBJ += src/ush.o src/client.o
 
@@ -0,0 +1,84 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   netbuf.c                                           :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "netbuf.h"
+
+#include <string.h>
+
+static int netbuf_slices(char *data, uint32_t size, uint32_t off,
+                         uint32_t n, struct iovec iov[2])
+{
+	uint32_t const at = off & (size - 1);
+	uint32_t const end = size - at;
+
+	if (n == 0) return 0;
+	iov[0] = (struct iovec){ data + at, n < end ? n : end };
+	if (n <= end) return 1;
+	iov[1] = (struct iovec){ data, n - end };
+	return 2;
+}
+
+void netbuf_cut(struct netbuf *buf, uint32_t off, uint32_t n)
+{
+	/* Seldom more than a few lines, moved bytewise across the storage
+	 * end */
+	for (uint32_t at = off; at != buf->head; ) {
+		--at;
+		*netbuf_at(buf, at + n) = *netbuf_at(buf, at);
+	}
+	buf->head += n;
+}
+
+int netbuf_rslices(struct netbuf const *buf, struct iovec iov[2])
+{
+	return netbuf_slices(buf->data, buf->size, buf->head,
+	                     netbuf_len(buf), iov);
+}
+
+int netbuf_wslices(struct netbuf const *buf, struct iovec iov[2])
+{
+	return netbuf_slices(buf->data, buf->size, buf->tail,
+	                     netbuf_room(buf), iov);
+}
+
+char *netbuf_peek(struct netbuf const *buf, uint32_t off, uint32_t n,
+                  char *tmp)
+{
+	struct iovec iov[2];
+
+	if (netbuf_slices(buf->data, buf->size, off, n, iov) < 2)
+		return netbuf_at(buf, off);
+
+	memcpy(tmp, iov[0].iov_base, iov[0].iov_len);
+	memcpy(tmp + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+	return tmp;
+}
+
+ssize_t netbuf_readv(struct netbuf *buf, int fd)
+{
+	struct iovec iov[2];
+	int const cnt = netbuf_wslices(buf, iov);
+
+	ssize_t const rd = readv(fd, iov, cnt);
+	if (rd > 0) netbuf_produce(buf, (uint32_t)rd);
+	return rd;
+}
+
+ssize_t netbuf_writev(struct netbuf *buf, int fd)
+{
+	struct iovec iov[2];
+	int const cnt = netbuf_rslices(buf, iov);
+
+	ssize_t const wr = writev(fd, iov, cnt);
+	if (wr > 0) netbuf_consume(buf, (uint32_t)wr);
+	return wr;
+}
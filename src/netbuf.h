@@ -10,16 +10,142 @@
 /*                                                                            */
 /* ************************************************************************** */
 
+/**
+ * @file netbuf.h
+ * @brief
+ * Network ring buffer: free running 32 bits offsets over a power of two
+ * sized storage, so that offsets stay valid until consumed and length is
+ * always `tail - head`
+ */
 #ifndef __NETBUF_H
 # define __NETBUF_H
 
 #include <stddef.h>
 #include <stdint.h>
 
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
+/**
+ * Ring buffer over a caller provided storage
+ */
+struct netbuf {
+	char *data;
+	uint32_t size;  /**< Storage size, a power of two */
+	uint32_t head;  /**< Offset of the first byte     */
+	uint32_t tail;  /**< Offset past the last byte    */
+};
 
+/**
+ * @param data [in] Storage, kept by the buffer
+ * @param size [in] Storage size, a power of two below 2^31
+ */
+static inline void netbuf_init(struct netbuf *buf, void *data, uint32_t size)
+{
+	*buf = (struct netbuf){ .data = data, .size = size };
+}
+
+static inline uint32_t netbuf_len(struct netbuf const *buf)
+{
+	return buf->tail - buf->head;
+}
+
+static inline uint32_t netbuf_room(struct netbuf const *buf)
+{
+	return buf->size - netbuf_len(buf);
+}
+
+/**
+ * @return Storage address of an offset
+ */
+static inline char *netbuf_at(struct netbuf const *buf, uint32_t off)
+{
+	return buf->data + (off & (buf->size - 1));
+}
+
+/**
+ * @return Contiguous room behind the last byte
+ */
+static inline uint32_t netbuf_wlen(struct netbuf const *buf)
+{
+	uint32_t const end = buf->size - (buf->tail & (buf->size - 1));
+	uint32_t const room = netbuf_room(buf);
+
+	return room < end ? room : end;
+}
+
+/**
+ * @return Contiguous bytes from the first one
+ */
+static inline uint32_t netbuf_rlen(struct netbuf const *buf)
+{
+	uint32_t const end = buf->size - (buf->head & (buf->size - 1));
+	uint32_t const len = netbuf_len(buf);
+
+	return len < end ? len : end;
+}
+
+/**
+ * Append `n` bytes written straight into the room
+ */
+static inline void netbuf_produce(struct netbuf *buf, uint32_t n)
+{
+	buf->tail += n;
+}
+
+/**
+ * Drop the `n` first bytes
+ */
+static inline void netbuf_consume(struct netbuf *buf, uint32_t n)
+{
+	buf->head += n;
+}
+
+static inline void netbuf_reset(struct netbuf *buf)
+{
+	buf->head = buf->tail = 0;
+}
+
+/**
+ * Drop `n` bytes from within, those before are moved up: offsets past
+ * them stay valid
+ * @param off [in] Offset of the first dropped byte, from head on
+ */
+void netbuf_cut(struct netbuf *buf, uint32_t off, uint32_t n);
+
+/**
+ * @param iov [out] Bytes held, in order
+ * @return          Number of slices, 0 when empty
+ */
+int netbuf_rslices(struct netbuf const *buf, struct iovec iov[2]);
+
+/**
+ * @param iov [out] Room, in order
+ * @return          Number of slices, 0 when full
+ */
+int netbuf_wslices(struct netbuf const *buf, struct iovec iov[2]);
+
+/**
+ * Contiguous view of held bytes, copied only when they wrap around
+ * @param off [in] Offset of the first byte, between head and tail
+ * @param n   [in] Number of bytes
+ * @param tmp [in] Storage for a wrapping view, `n` bytes at least
+ * @return         Bytes, either in the buffer or in `tmp`
+ */
+char *netbuf_peek(struct netbuf const *buf, uint32_t off, uint32_t n,
+                  char *tmp);
+
+/**
+ * Fill the room from a descriptor, appended bytes are produced, room is
+ * expected: a full buffer reads nothing
+ * @return Read bytes, -1 on error with errno set
+ */
+ssize_t netbuf_readv(struct netbuf *buf, int fd);
+
+/**
+ * Flush held bytes to a descriptor, written bytes are consumed
+ * @return Written bytes, -1 on error with errno set
+ */
+ssize_t netbuf_writev(struct netbuf *buf, int fd);
 
 #endif /* !__NETBUF_H */
@@ -0,0 +1,111 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   pasv.c                                             :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "pasv.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#define PASV_BACKLOG (4) /**< A session connects once per transfer */
+
+int pasv_open(struct pasv_pool *pool, uint16_t first, unsigned count)
+{
+	if (first <= 1024 || count == 0 || count > 65536u - first)
+		return (errno = EINVAL), -1;
+
+	unsigned const words = (count + 63) / 64;
+	unsigned opened = 0;
+	int *const socks = malloc(count * sizeof *socks);
+	uint64_t *const avail = calloc(words, sizeof *avail);
+	if (socks == NULL || avail == NULL) goto abort;
+
+	for (; opened < count; ++opened) {
+		struct sockaddr_in const addr = {
+			.sin_family = AF_INET,
+			.sin_port = htons((uint16_t)(first + opened)),
+			.sin_addr.s_addr = INADDR_ANY
+		};
+		int const sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+		                        SOCK_CLOEXEC, 0);
+		if (sock < 0) goto abort;
+
+		socks[opened] = sock;
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1},
+		               sizeof(int)) ||
+		    bind(sock, (struct sockaddr const *)&addr, sizeof addr) ||
+		    listen(sock, PASV_BACKLOG)) {
+			++opened;
+			goto abort;
+		}
+		avail[opened / 64] |= UINT64_C(1) << (opened % 64);
+	}
+
+	*pool = (struct pasv_pool){
+		.first = first, .count = count, .socks = socks, .free = avail,
+		.words = words };
+	return 0;
+
+abort:
+	while (opened--) close(socks[opened]);
+	free(socks);
+	free(avail);
+	return -1;
+}
+
+void pasv_close(struct pasv_pool *pool)
+{
+	for (unsigned i = 0; i < pool->count; ++i)
+		close(pool->socks[i]);
+	free(pool->socks);
+	free(pool->free);
+}
+
+int pasv_get(struct pasv_pool *pool)
+{
+	unsigned const hint = __atomic_load_n(&pool->hint, __ATOMIC_RELAXED);
+
+	/* Words are visited from the last one a port was taken from, a free
+	 * port is then found right away unless the pool is nearly empty */
+	for (unsigned i = 0; i < pool->words; ++i) {
+		unsigned const word = (hint + i) % pool->words;
+		uint64_t *const bits = pool->free + word;
+		uint64_t cur = __atomic_load_n(bits, __ATOMIC_RELAXED);
+
+		while (cur) {
+			uint64_t const bit = cur & -cur;
+
+			if (__atomic_compare_exchange_n(bits, &cur, cur & ~bit, true,
+			                                __ATOMIC_ACQUIRE,
+			                                __ATOMIC_RELAXED)) {
+				__atomic_store_n(&pool->hint, word, __ATOMIC_RELAXED);
+				return (int)(word * 64 + (unsigned)__builtin_ctzll(bit));
+			}
+		}
+	}
+	return (errno = EADDRNOTAVAIL), -1;
+}
+
+void pasv_put(struct pasv_pool *pool, int idx, bool stale)
+{
+	if (stale) {
+		int sock;
+
+		while ((sock = accept4(pool->socks[idx], NULL, NULL,
+		                       SOCK_CLOEXEC)) >= 0 || errno == ECONNABORTED)
+			if (sock >= 0) close(sock);
+	}
+	__atomic_fetch_or(pool->free + idx / 64, UINT64_C(1) << (idx % 64),
+	                  __ATOMIC_RELEASE);
+}
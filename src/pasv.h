@@ -0,0 +1,73 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   pasv.h                                             :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file pasv.h
+ * @brief
+ * Passive mode data ports, bound and listening for the whole server life:
+ * a passive transfer costs one accept. Ports are shared by every reactor
+ * thread and handed out one session at a time.
+ */
+#ifndef __PASV_H
+# define __PASV_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+/**
+ * Pool of listeners over a range of consecutive ports
+ */
+struct pasv_pool {
+	uint16_t first;  /**< First port of the range                     */
+	unsigned count;  /**< Number of ports                             */
+	int *socks;      /**< Listeners, by port from the first one       */
+	uint64_t *free;  /**< Set bits for the ports not handed out       */
+	unsigned words;  /**< Bitmap words                                */
+	unsigned hint;   /**< Word the last port was taken from           */
+};
+
+/**
+ * Bind and listen on every port of the range
+ * @param first [in] First port, unprivileged
+ * @param count [in] Number of ports, the range ends at 65535 at most
+ * @return           0 on success, -1 otherwise (errno is set)
+ */
+int pasv_open(struct pasv_pool *pool, uint16_t first, unsigned count);
+
+void pasv_close(struct pasv_pool *pool);
+
+/**
+ * Hand a port out, safe to call from any thread
+ * @return Port index in the range, -1 when all are taken (errno is set)
+ */
+int pasv_get(struct pasv_pool *pool);
+
+/**
+ * Give a port back, safe to call from any thread
+ * @param stale [in] Whether connections may be pending on it, they are
+ *                   refused: the next session must only get its own
+ */
+void pasv_put(struct pasv_pool *pool, int idx, bool stale);
+
+static inline int pasv_socket(struct pasv_pool const *pool, int idx)
+{
+	return pool->socks[idx];
+}
+
+static inline uint16_t pasv_port(struct pasv_pool const *pool, int idx)
+{
+	return (uint16_t)(pool->first + idx);
+}
+
+#endif /* !__PASV_H */
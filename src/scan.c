@@ -0,0 +1,156 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   scan.c                                             :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define SCAN_X86 1
+#else
+# define SCAN_X86 0
+#endif
+
+#define TELNET_IAC  (0xff) /**< Interpret as command         */
+#define TELNET_WILL (0xfb) /**< First option negotiation one */
+#define TELNET_DONT (0xfe) /**< Last option negotiation one  */
+
+struct scan {
+	uint8_t *buf;
+	size_t rd;       /**< Next byte to scan                   */
+	size_t wr;       /**< Next byte to keep, `rd` at most     */
+	uint32_t *lf;
+	unsigned nlf;
+	uint8_t telnet;
+};
+
+/**
+ * Handle a single byte, Telnet commands included
+ */
+static inline void scan_byte(struct scan *sc)
+{
+	uint8_t const b = sc->buf[sc->rd++];
+
+	switch (sc->telnet) {
+	case SCAN_DATA:
+		if (b == TELNET_IAC) {
+			sc->telnet = SCAN_IAC;
+			return;
+		}
+		if (b == '\n') sc->lf[sc->nlf++] = (uint32_t)sc->wr;
+		sc->buf[sc->wr++] = b;
+		return;
+	case SCAN_IAC:
+		/* Escaped 0xff is data, any other command is dropped */
+		sc->telnet = SCAN_DATA;
+		if (b == TELNET_IAC)
+			sc->buf[sc->wr++] = b;
+		else if (b >= TELNET_WILL && b <= TELNET_DONT)
+			sc->telnet = SCAN_OPT;
+		return;
+	default:
+		sc->telnet = SCAN_DATA;
+		return;
+	}
+}
+
+/**
+ * Keep the `n` plain bytes of a block, `mask` flags its line feeds
+ */
+static inline void scan_keep(struct scan *sc, size_t n,
+                                      uint32_t mask)
+{
+	for (; mask; mask &= mask - 1)
+		sc->lf[sc->nlf++] = (uint32_t)sc->wr + (uint32_t)__builtin_ctz(mask);
+	if (sc->wr != sc->rd)
+		memmove(sc->buf + sc->wr, sc->buf + sc->rd, n);
+	sc->rd += n;
+	sc->wr += n;
+}
+
+#if SCAN_X86
+
+/**
+ * Scan 16 bytes blocks until one holds a Telnet command, or less than a
+ * block is left: those are left to the scalar scanner
+ */
+static void scan_sse2(struct scan *sc, size_t len)
+{
+	__m128i const lf = _mm_set1_epi8('\n');
+	__m128i const iac = _mm_set1_epi8((char)TELNET_IAC);
+
+	while (sc->rd + 16 <= len) {
+		__m128i const v = _mm_loadu_si128((__m128i const *)(sc->buf + sc->rd));
+		uint32_t const mlf = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+		uint32_t const miac = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, iac));
+
+		if (miac) {
+			unsigned const n = (unsigned)__builtin_ctz(miac);
+			scan_keep(sc, n, mlf & ((1U << n) - 1));
+			return;
+		}
+		scan_keep(sc, 16, mlf);
+	}
+}
+
+/**
+ * Same as `scan_sse2` with 32 bytes blocks
+ */
+__attribute__((target("avx2")))
+static void scan_avx2(struct scan *sc, size_t len)
+{
+	__m256i const lf = _mm256_set1_epi8('\n');
+	__m256i const iac = _mm256_set1_epi8((char)TELNET_IAC);
+
+	while (sc->rd + 32 <= len) {
+		__m256i const v =
+			_mm256_loadu_si256((__m256i const *)(sc->buf + sc->rd));
+		uint32_t const mlf =
+			(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+		uint32_t const miac =
+			(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, iac));
+
+		if (miac) {
+			unsigned const n = (unsigned)__builtin_ctz(miac);
+			scan_keep(sc, n, mlf & ((1U << n) - 1));
+			return;
+		}
+		scan_keep(sc, 32, mlf);
+	}
+}
+
+#endif
+
+size_t scan_lines(char *buf, size_t len, uint8_t *telnet,
+                  uint32_t *lf, unsigned *nlf)
+{
+	struct scan sc = {
+		.buf = (uint8_t *)buf, .lf = lf, .telnet = *telnet };
+
+	while (sc.rd < len) {
+#if SCAN_X86
+		/* Vectors stop right before a Telnet command */
+		if (sc.telnet == SCAN_DATA) {
+			if (__builtin_cpu_supports("avx2"))
+				scan_avx2(&sc, len);
+			scan_sse2(&sc, len);
+			if (sc.rd == len) break;
+		}
+#endif
+		scan_byte(&sc);
+	}
+
+	*telnet = sc.telnet;
+	*nlf = sc.nlf;
+	return sc.wr;
+}
@@ -0,0 +1,49 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   scan.h                                             :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file scan.h
+ * @brief
+ * Control connection scanner, finds line terminators and strips Telnet
+ * commands (RFC 854) in a single pass, vectorized when available
+ */
+#ifndef __SCAN_H
+# define __SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Telnet parser state, carried over from a read to the next one
+ */
+enum scan_telnet {
+	SCAN_DATA = 0, /**< Plain data                       */
+	SCAN_IAC,      /**< Interpret as command received    */
+	SCAN_OPT,      /**< Option negotiation byte expected */
+};
+
+/**
+ * Scan bytes received on a control connection, Telnet commands are
+ * removed by moving the following bytes in place: a buffer without any
+ * (the usual case) is left untouched
+ * @param buf    [in,out] Received bytes
+ * @param len        [in] Number of received bytes
+ * @param telnet [in,out] Telnet parser state
+ * @param lf        [out] Offsets of the line feeds found, `len` at most
+ * @param nlf       [out] Number of line feeds found
+ * @return                Number of bytes left once Telnet commands are
+ *                        stripped
+ */
+size_t scan_lines(char *buf, size_t len, uint8_t *telnet,
+                  uint32_t *lf, unsigned *nlf);
+
+#endif /* !__SCAN_H */
@@ -11,80 +11,532 @@
 /* ************************************************************************** */
 
 #include "ush.h"
+#include "clock.h"
 #include "ftp.h"
+#include "log.h"
+#include "xpool.h"
+#include "zmode.h"
 
 #include <ft/opts.h>
 #include <ft/stdio.h>
 #include <ft/stdlib.h>
+#include <ft/string.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <wait.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 
+static void raise_nofile(void)
+{
+	struct rlimit lim;
+
+	/* Each session holds a descriptor, allow as many as the system does */
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+}
+
+/**
+ * Reactor thread, owning its own server instance (listener, reactor,
+ * sessions) and sharing the read-only configuration with others
+ */
+struct worker {
+	ftp_srv_t srv;
+	pthread_t thread;
+	int stop;  /**< Shared stop event, readable once the server quits */
+	int err;   /**< errno of the failure which stopped the worker    */
+};
+
+/**
+ * Print connection counters summed over every reactor
+ * @param wrks [in] Workers array, as many as configured threads
+ */
+static void stats(struct worker const *wrks)
+{
+	struct ftp_stats st = { 0 };
+
+	for (unsigned i = 0; i < wrks->srv.conf->threads; ++i)
+		ftp_srv_stats(&wrks[i].srv, &st);
+
+	ft_printf("accepted: %lu\nrejected: %lu\noverflowed: %lu\n",
+	          st.accepted, st.rejected, st.overflowed);
+}
+
+#if FT_P_FSM_STATS
+static void fsm_line(void *ctx, char const *line)
+{
+	(void)ctx;
+	ft_printf("%s\n", line);
+}
+#endif
+
+/**
+ * Print sessions state machine statistics summed over every reactor
+ * @param wrks [in] Workers array, as many as configured threads
+ */
+static void fsm(struct worker const *wrks)
+{
+#if FT_P_FSM_STATS
+	struct fsm_stats st;
+
+	if (ftp_fsm_stats_init(&st)) {
+		ft_printf("fsm: %s\n", ft_strerror(errno));
+		return;
+	}
+	for (unsigned i = 0; i < wrks->srv.conf->threads; ++i)
+		ftp_srv_fsm_stats(&wrks[i].srv, &st);
+	ftp_fsm_stats_print(&st, fsm_line, NULL);
+	fsm_stats_fini(&st);
+#else
+	(void)wrks;
+	ft_printf("fsm: statistics disabled (FT_P_FSM_STATS)\n");
+#endif
+}
+
+/**
+ * Print commands latency summed over every reactor, from line complete
+ * to replies flushed
+ * @param wrks [in] Workers array, as many as configured threads
+ */
+static void latency(struct worker const *wrks)
+{
+	struct ftp_lat lat[FTP_LAT_SLOTS] = { 0 };
+
+	for (unsigned i = 0; i < wrks->srv.conf->threads; ++i)
+		ftp_srv_latency(&wrks[i].srv, lat);
+
+	for (unsigned slot = 0; slot < FTP_LAT_SLOTS; ++slot) {
+		uint32_t const verb = (uint32_t)lat[slot].verb;
+
+		if (lat[slot].count == 0) continue;
+		ft_printf("%-4.4s %10lu %10lu us %10lu us\n",
+		          verb ? (char const *)&verb : "?", lat[slot].count,
+		          lat[slot].total / lat[slot].count / 1000,
+		          lat[slot].max / 1000);
+	}
+}
+
+/**
+ * Handle a console line
+ * @return 1 to quit, 0 to continue, -1 on error
+ */
+static int console(char const *name, struct worker *wrk)
+{
+	char buf[16];
+	ssize_t const rd = read(STDIN_FILENO, buf, sizeof buf - 1);
+	if (rd < 0) return -1;
+
+	buf[rd] = '\0';
+
+	if (rd == 0)
+		return ev_del(&wrk->srv.ev, STDIN_FILENO), 0;
+
+	if (ft_strcmp("quit\n", buf) == 0)
+		return ft_printf("quit !\n"), 1;
+
+	if (ft_strcmp("stats\n", buf) == 0)
+		return stats(wrk), 0;
+
+	if (ft_strcmp("latency\n", buf) == 0)
+		return latency(wrk), 0;
+
+	if (ft_strcmp("fsm\n", buf) == 0)
+		return fsm(wrk), 0;
+
+	ft_printf("%s: unknown command: %s", name, buf);
+	return 0;
+}
+
+/**
+ * Run a reactor until the stop event, the console is only handled by the
+ * main thread
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int worker_loop(struct worker *wrk, char const *name)
+{
+	int to = -1;
+
+	while (true) {
+		ev_event_t evs[EV_MAX_EVENTS];
+
+		int const n = ev_wait(&wrk->srv.ev, evs, EV_MAX_EVENTS, to);
+		if (n < 0) return -1;
+
+		for (int i = 0; i < n; ++i) {
+			if (evs[i].fd == wrk->stop)
+				return 0;
+
+			if (name && evs[i].fd == STDIN_FILENO) {
+				int const ret = console(name, wrk);
+				if (ret) return ret < 0 ? -1 : 0;
+			}
+		}
+
+		if (ftp_srv_start(&wrk->srv, evs, n, &to))
+			return -1;
+	}
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *const wrk = arg;
+
+	/* Without a log ring, the reactor records are dropped */
+	log_attach();
+	if (worker_loop(wrk, NULL)) {
+		wrk->err = errno;
+		eventfd_write(wrk->stop, 1);
+	}
+	return NULL;
+}
+
+/**
+ * Open a server instance per reactor thread and run them until quit
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int serve(struct ftp_conf const *conf, char const *name)
+{
+	unsigned const n = conf->threads;
+	unsigned opened = 0, started = 1;
+	int err = 0;
+
+	struct worker *const wrks = calloc(n, sizeof *wrks);
+	if (wrks == NULL) return -1;
+
+	/* Sessions never write logs themselves */
+	if (log_start(STDERR_FILENO)) {
+		free(wrks);
+		return -1;
+	}
+	log_attach();
+
+	int const stop = eventfd(0, EFD_CLOEXEC);
+	if (stop < 0) {
+		err = errno;
+		goto close;
+	}
+
+	/* Open every listener first, so that a bind failure is reported
+	 * before any session is served */
+	for (opened = 0; opened < n; ++opened) {
+		struct worker *const wrk = wrks + opened;
+
+		wrk->stop = stop;
+		if (ftp_srv_open(conf, &wrk->srv)) {
+			err = errno;
+			goto close;
+		}
+		if (ev_add(&wrk->srv.ev, stop, EV_READ, 0)) {
+			err = errno;
+			ftp_srv_close(&wrk->srv);
+			goto close;
+		}
+	}
+
+	/* Console is registered once along with the first listener,
+	 * regular files (ex: /dev/null) cannot be watched: run without it */
+	if (ev_add(&wrks->srv.ev, STDIN_FILENO, EV_READ, 0) && errno != EPERM) {
+		err = errno;
+		goto close;
+	}
+
+	for (; started < n; ++started)
+		if ((err = pthread_create(&wrks[started].thread, NULL,
+		                          worker_run, wrks + started)))
+			break;
+
+	if (!err && worker_loop(wrks, name))
+		err = errno;
+
+	/* Stop event stays readable, so every reactor wakes up on it */
+	eventfd_write(stop, 1);
+
+	for (unsigned i = 1; i < started; ++i) {
+		pthread_join(wrks[i].thread, NULL);
+		if (!err) err = wrks[i].err;
+	}
+
+close:
+	while (opened--) ftp_srv_close(&wrks[opened].srv);
+	if (stop >= 0) close(stop);
+	log_stop();
+	free(wrks);
+	return err ? (errno = err), -1 : 0;
+}
+
+/**
+ * Parse a rate limit, `download[:upload]` in KiB per second: a single
+ * value limits both directions, 0 for unlimited
+ * @param rates [out] Bytes per second, by transfer direction
+ * @return            0 on success, -1 otherwise
+ */
+static int parse_rates(char const *arg, uint64_t rates[XFER_DIR_MAX])
+{
+	char *end;
+	unsigned long const down = strtoul(arg, &end, 10);
+	unsigned long const up = *end == ':' && end[1]
+		? strtoul(end + 1, &end, 10) : down;
+
+	if (end == arg || *end || down > UINT32_MAX || up > UINT32_MAX)
+		return -1;
+	rates[XFER_SEND] = (uint64_t)down * 1024;
+	rates[XFER_RECV] = (uint64_t)up * 1024;
+	return 0;
+}
+
 int main(int ac, char *av[])
 {
-	if (ac != 2) {
-		ft_fprintf(g_stderr, "Usage %s [port]\n Open a server\n",
-		           av[0]);
+	int help = 0;
+	int uring = 0;
+	int max_clients = FTP_MAX_CLIENT;
+	int threads = 1;
+	int max_output = FTP_MAX_OUTPUT;
+	int backlog = FT_P_LISTEN_QUEUE;
+	int slow = FTP_SLOW_COMMAND;
+	char *fsync = "none";
+	char *pasv_ports = NULL;
+	char *pasv_addr = NULL;
+	int zthreads = -1;
+	int xthreads = -1;
+	char *global_rate = NULL;
+	char *user_rate = NULL;
+	char *session_rate = NULL;
+	int timeouts[FTP_TIMER_MAX] = {
+		[FTP_TIMER_IDLE]  = FTP_IDLE_TIMEOUT,
+		[FTP_TIMER_LOGIN] = FTP_LOGIN_TIMEOUT,
+		[FTP_TIMER_DATA]  = FTP_DATA_TIMEOUT,
+	};
+
+	t_opt const opts[] = {
+		{ FT_OPT_BOOLEAN, 'h', "help", &help, "Display available options", 1 },
+		{ FT_OPT_INTEGER, 'b', "backlog", &backlog,
+		  "Pending connections queued per listener", 0 },
+		{ FT_OPT_INTEGER, 'c', "clients", &max_clients,
+		  "Limit of concurrent sessions", 0 },
+		{ FT_OPT_INTEGER, 0, "max-output", &max_output,
+		  "Output bytes buffered per session before pausing its input", 0 },
+		{ FT_OPT_INTEGER, 't', "threads", &threads,
+		  "Number of reactor threads", 0 },
+		{ FT_OPT_BOOLEAN, 'u', "io-uring", &uring,
+		  "Use the io_uring event backend", 1 },
+		{ FT_OPT_INTEGER, 0, "idle-timeout", timeouts + FTP_TIMER_IDLE,
+		  "Idle session timeout in seconds, 0 to disable", 0 },
+		{ FT_OPT_INTEGER, 0, "login-timeout", timeouts + FTP_TIMER_LOGIN,
+		  "Login timeout in seconds, 0 to disable", 0 },
+		{ FT_OPT_INTEGER, 0, "data-timeout", timeouts + FTP_TIMER_DATA,
+		  "Data connection timeout in seconds, 0 to disable", 0 },
+		{ FT_OPT_INTEGER, 0, "slow-command", &slow,
+		  "Log commands slower than this in milliseconds, 0 to disable", 0 },
+		{ FT_OPT_STRING, 0, "fsync", &fsync,
+		  "Uploads durability: none, writeback or data", 0 },
+		{ FT_OPT_STRING, 0, "pasv-ports", &pasv_ports,
+		  "Passive mode ports range, first-last, none by default", 0 },
+		{ FT_OPT_STRING, 0, "pasv-address", &pasv_addr,
+		  "Passive mode address given to peers (ex: behind NAT)", 0 },
+		{ FT_OPT_INTEGER, 0, "deflate-threads", &zthreads,
+		  "MODE Z compression helpers, one per extra CPU by default", 0 },
+		{ FT_OPT_INTEGER, 0, "data-threads", &xthreads,
+		  "Transfer workers, one per CPU by default, 0 for none", 0 },
+		{ FT_OPT_STRING, 0, "global-rate", &global_rate,
+		  "Server rate limit, download[:upload] in KiB/s", 0 },
+		{ FT_OPT_STRING, 0, "user-rate", &user_rate,
+		  "Rate limit of each user, download[:upload] in KiB/s", 0 },
+		{ FT_OPT_STRING, 0, "session-rate", &session_rate,
+		  "Rate limit of each session, download[:upload] in KiB/s", 0 },
+		{ FT_OPT_END, 0, 0, 0, 0, 0 }
+	};
+
+	int idx = 1;
+
+	if (ft_optparse(opts, &idx, ac, av) || help || idx != ac - 1) {
+		ft_optusage(opts, av[0], "[port]", "Open a server");
+		return help ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (max_clients <= 0) {
+		ft_fprintf(g_stderr, "%s: invalid sessions limit: %d\n",
+		           av[0], max_clients);
 		return EXIT_FAILURE;
 	}
 
-	int const port = ft_atoi(av[1]);
-	char root[PATH_MAX];
+	if (backlog <= 0) {
+		ft_fprintf(g_stderr, "%s: invalid backlog: %d\n", av[0], backlog);
+		return EXIT_FAILURE;
+	}
 
-	if (getcwd(root, PATH_MAX) == NULL)
-		goto abort;
+	if (max_output <= 0) {
+		ft_fprintf(g_stderr, "%s: invalid output limit: %d\n",
+		           av[0], max_output);
+		return EXIT_FAILURE;
+	}
 
-	fd_set rfds;
-	FD_ZERO(&rfds);
+	if (threads <= 0 || threads > FTP_MAX_THREADS) {
+		ft_fprintf(g_stderr, "%s: invalid number of threads: %d\n",
+		           av[0], threads);
+		return EXIT_FAILURE;
+	}
 
-	static struct ftp_usr users[] = {
-		{ "lol"  , "lol"   },
-		{ "admin", "admin" },
-		{ NULL   , NULL    },
-	};
+	for (unsigned kind = 0; kind < FTP_TIMER_MAX; ++kind) {
+		if (timeouts[kind] < 0 ||
+		    (unsigned)timeouts[kind] > TIMER_MAX_DELAY / 1000) {
+			ft_fprintf(g_stderr, "%s: invalid timeout: %d\n",
+			           av[0], timeouts[kind]);
+			return EXIT_FAILURE;
+		}
+	}
 
-	ftp_srv_t srv;
+	if (slow < 0) {
+		ft_fprintf(g_stderr, "%s: invalid slow command delay: %d\n",
+		           av[0], slow);
+		return EXIT_FAILURE;
+	}
 
-	if (ftp_srv_open(port, root, &rfds, users, &srv))
-		goto abort;
+	static char const *const syncs[] = {
+		[XFER_SYNC_NONE]      = "none",
+		[XFER_SYNC_WRITEBACK] = "writeback",
+		[XFER_SYNC_DATA]      = "data",
+	};
+	unsigned sync = 0;
 
-	FD_SET(STDIN_FILENO, &rfds);
+	while (sync < sizeof syncs / sizeof *syncs &&
+	       ft_strcmp(fsync, syncs[sync]))
+		++sync;
+	if (sync == sizeof syncs / sizeof *syncs) {
+		ft_fprintf(g_stderr, "%s: invalid fsync policy: %s\n", av[0], fsync);
+		return EXIT_FAILURE;
+	}
 
-	while (true) {
-		struct timeval to = { };
+	struct pasv_pool pool;
+	unsigned first = 0, last = 0;
+	struct in_addr addr = { INADDR_ANY };
 
-		fd_set _rfds = rfds;
+	if (pasv_ports && (sscanf(pasv_ports, "%u-%u", &first, &last) != 2 ||
+	                   first <= 1024 || last < first || last > UINT16_MAX)) {
+		ft_fprintf(g_stderr, "%s: invalid passive ports: %s\n",
+		           av[0], pasv_ports);
+		return EXIT_FAILURE;
+	}
 
-		int const err = select(FD_SETSIZE, &_rfds, NULL, NULL, NULL);
-		if (err < 0 && err != ETIMEDOUT) goto abort;
+	if (pasv_addr && inet_pton(AF_INET, pasv_addr, &addr) != 1) {
+		ft_fprintf(g_stderr, "%s: invalid passive address: %s\n",
+		           av[0], pasv_addr);
+		return EXIT_FAILURE;
+	}
 
-		if (FD_ISSET(STDIN_FILENO, &_rfds)) {
-			char buf[6];
-			ssize_t const rd = read(STDIN_FILENO, buf, sizeof buf);
-			if (rd < 0) goto abort;
+	/* Compressing sessions take part in their own blocks */
+	if (zthreads < 0)
+		zthreads = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (zthreads < 0 || zthreads > FTP_MAX_THREADS) {
+		ft_fprintf(g_stderr, "%s: invalid number of deflate threads: %d\n",
+		           av[0], zthreads);
+		return EXIT_FAILURE;
+	}
 
-			buf[rd] = '\0';
+	/* Without workers, transfers move on the reactors */
+	if (xthreads < 0)
+		xthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (xthreads < 0 || xthreads > FTP_MAX_THREADS) {
+		ft_fprintf(g_stderr, "%s: invalid number of data threads: %d\n",
+		           av[0], xthreads);
+		return EXIT_FAILURE;
+	}
 
-			if (ft_strcmp("quit\n", buf) == 0) {
-				ft_printf("quit !\n");
-				break;
-			}
+	char *const limits[] = { global_rate, user_rate, session_rate };
+	uint64_t rates[3][XFER_DIR_MAX] = { };
 
-			ft_printf("%s: unknown command: %s", av[0], buf);
+	for (unsigned i = 0; i < sizeof limits / sizeof *limits; ++i) {
+		if (limits[i] && parse_rates(limits[i], rates[i])) {
+			ft_fprintf(g_stderr, "%s: invalid rate limit: %s\n",
+			           av[0], limits[i]);
+			return EXIT_FAILURE;
 		}
+	}
+
+	char root[PATH_MAX];
+
+	if (getcwd(root, PATH_MAX) == NULL || clk_init())
+		goto abort;
+
+	static struct ftp_usr users[] = {
+		{ .user = "lol"  , .pswd = "lol"   },
+		{ .user = "admin", .pswd = "admin" },
+		{ .user = NULL   , .pswd = NULL    },
+	};
+	struct shape shape[XFER_DIR_MAX];
+
+	/* Buckets are shared by the sessions of every reactor */
+	for (unsigned dir = 0; dir < XFER_DIR_MAX; ++dir) {
+		shape_init(shape + dir, rates[0][dir]);
+		for (struct ftp_usr *usr = users; usr->user; ++usr)
+			shape_init(usr->shape + dir, rates[1][dir]);
+	}
+
+	struct ftp_conf const conf = {
+		.port = ft_atoi(av[idx]),
+		.root = root,
+		.users = users,
+		.max_clients = (unsigned)max_clients,
+		.threads = (unsigned)threads,
+		.backend = uring ? EV_URING : EV_EPOLL,
+		.max_output = (size_t)max_output,
+		.backlog = backlog,
+		.timeouts = {
+			[FTP_TIMER_IDLE]  = (unsigned)timeouts[FTP_TIMER_IDLE] * 1000,
+			[FTP_TIMER_LOGIN] = (unsigned)timeouts[FTP_TIMER_LOGIN] * 1000,
+			[FTP_TIMER_DATA]  = (unsigned)timeouts[FTP_TIMER_DATA] * 1000,
+		},
+		.slow = (unsigned)slow,
+		.sync = (enum xfer_sync)sync,
+		.pasv = pasv_ports ? &pool : NULL,
+		.pasv_addr = addr,
+		.shape = shape,
+		.rates = { rates[2][XFER_SEND], rates[2][XFER_RECV] },
+	};
 
-		if (ftp_srv_start(&srv, &_rfds, &to))
-			goto abort;
+	raise_nofile();
+
+	/* Every passive port is bound upfront, transfers only accept */
+	if (pasv_ports && pasv_open(&pool, (uint16_t)first, last - first + 1))
+		goto abort;
+
+	if (zmode_start((unsigned)zthreads)) {
+		if (pasv_ports) pasv_close(&pool);
+		goto abort;
 	}
 
+	if (xpool_start((unsigned)xthreads, FTP_XFER_QUANTUM)) {
+		zmode_stop();
+		if (pasv_ports) pasv_close(&pool);
+		goto abort;
+	}
+
+	/* Files are sent with sendfile, which has no MSG_NOSIGNAL: a peer
+	 * closing its data connection must only fail the transfer */
+	signal(SIGPIPE, SIG_IGN);
+
+	int const ret = serve(&conf, av[0]);
+
+	xpool_stop();
+	zmode_stop();
+
+	if (pasv_ports) pasv_close(&pool);
+	if (ret)
+		goto abort;
+
 	return EXIT_SUCCESS;
 
 abort:
@@ -0,0 +1,82 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   shape.c                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "shape.h"
+
+#include <stdbool.h>
+
+#define SHAPE_NS (1000000000ULL)
+
+void shape_init(struct shape *shape, uint64_t rate)
+{
+	uint64_t const burst = rate / SHAPE_BURST;
+
+	*shape = (struct shape){ .rate = rate,
+		.burst = burst > SHAPE_CHUNK ? burst : SHAPE_CHUNK };
+}
+
+/**
+ * @return Nanoseconds `bytes` take at the bucket rate
+ */
+static inline uint64_t shape_ns(struct shape const *shape, uint64_t bytes)
+{
+	return (uint64_t)((unsigned __int128)bytes * SHAPE_NS / shape->rate);
+}
+
+size_t shape_grant(struct shape *const *levels, size_t quantum,
+                   uint64_t now, uint64_t *wait)
+{
+	size_t const need = quantum < SHAPE_CHUNK ? quantum : SHAPE_CHUNK;
+	size_t grant = quantum;
+
+	*wait = 0;
+	for (unsigned i = 0; i < SHAPE_LEVELS && levels[i]; ++i) {
+		struct shape const *const shape = levels[i];
+		uint64_t const tat = __atomic_load_n(&shape->tat,
+		                                     __ATOMIC_RELAXED);
+		uint64_t const debt = tat > now ? tat - now : 0;
+		uint64_t const owed = (uint64_t)((unsigned __int128)debt *
+		                                 shape->rate / SHAPE_NS);
+		uint64_t const room = owed < shape->burst
+			? shape->burst - owed : 0;
+
+		if (room < grant)
+			grant = (size_t)room;
+
+		/* Debt left once `need` bytes fit in the burst again */
+		uint64_t const left = shape_ns(shape, shape->burst - need);
+		if (debt > left && debt - left > *wait)
+			*wait = debt - left;
+	}
+	if (grant >= need)
+		return grant;
+	if (*wait == 0)
+		*wait = 1;
+	return 0;
+}
+
+void shape_charge(struct shape *const *levels, uint64_t bytes,
+                  uint64_t now)
+{
+	for (unsigned i = 0; i < SHAPE_LEVELS && levels[i]; ++i) {
+		struct shape *const shape = levels[i];
+		uint64_t const cost = shape_ns(shape, bytes);
+		uint64_t tat = __atomic_load_n(&shape->tat, __ATOMIC_RELAXED);
+		uint64_t next;
+
+		/* Idle time is not saved up, the burst bounds what follows */
+		do next = (tat > now ? tat : now) + cost;
+		while (!__atomic_compare_exchange_n(&shape->tat, &tat, next,
+		                                    true, __ATOMIC_RELAXED,
+		                                    __ATOMIC_RELAXED));
+	}
+}
@@ -0,0 +1,66 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   shape.h                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file shape.h
+ * @brief
+ * Bandwidth shaping: token buckets kept as the time their debt is paid
+ * back (GCRA), a single word updated lock-free so that sessions of every
+ * thread share them. Transfers get the bytes each of their buckets
+ * grants per round, rate limited ones wait for their socket no more
+ * until enough is granted again: no thread ever sleeps for them.
+ */
+#ifndef __SHAPE_H
+# define __SHAPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHAPE_LEVELS          (3) /**< Session, user and server buckets   */
+#define SHAPE_CHUNK   (16 * 1024) /**< Bytes granted at least per round   */
+#define SHAPE_BURST          (10) /**< Burst, a tenth of a second of rate */
+
+/**
+ * Token bucket
+ */
+struct shape {
+	uint64_t rate;  /**< Bytes per second, 0 for unlimited         */
+	uint64_t burst; /**< Bytes granted at once after idling        */
+	uint64_t tat;   /**< Time the debt is paid back, in nanoseconds,
+	                     accessed atomically                       */
+};
+
+/**
+ * @param rate [in] Bytes per second, 0 for unlimited
+ */
+void shape_init(struct shape *shape, uint64_t rate);
+
+/**
+ * Bytes a transfer may move now, every bucket agreeing
+ * @param levels  [in] Buckets, up to the first NULL, unlimited ones left
+ *                     out
+ * @param quantum [in] Bytes wanted at most
+ * @param now     [in] Current time in nanoseconds
+ * @param wait   [out] Delay before retrying, when nothing is granted
+ * @return             Bytes granted, 0 until `wait` is over
+ */
+size_t shape_grant(struct shape *const *levels, size_t quantum,
+                   uint64_t now, uint64_t *wait);
+
+/**
+ * Account moved bytes to every bucket, they may exceed those granted:
+ * the debt delays the next grants
+ */
+void shape_charge(struct shape *const *levels, uint64_t bytes,
+                  uint64_t now);
+
+#endif /* !__SHAPE_H */
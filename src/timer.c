@@ -0,0 +1,201 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   timer.c                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "timer.h"
+
+#include <string.h>
+
+#define L0_MASK (TIMER_L0_SIZE - 1)
+#define LN_MASK (TIMER_LN_SIZE - 1)
+#define LN_SHIFT(LVL) (TIMER_L0_BITS + ((LVL) - 1) * TIMER_LN_BITS)
+
+static __always_inline void list_add(struct timer_list *list,
+                                     struct timer *timer)
+{
+	if ((timer->next = list->first))
+		timer->next->pprev = &timer->next;
+	list->first = timer;
+	timer->pprev = &list->first;
+}
+
+static __always_inline void list_del(struct timer *timer)
+{
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	*timer->pprev = timer->next;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+static __always_inline void list_move(struct timer_list *dst,
+                                      struct timer_list *src)
+{
+	if ((dst->first = src->first))
+		dst->first->pprev = &dst->first;
+	src->first = NULL;
+}
+
+static void wheel_insert(struct timer_wheel *wheel, struct timer *timer)
+{
+	if (timer->expire < wheel->now)
+		timer->expire = wheel->now;
+
+	uint64_t const delta = timer->expire - wheel->now;
+
+	if (delta < TIMER_L0_SIZE) {
+		unsigned const slot = timer->expire & L0_MASK;
+
+		timer->level = 0;
+		timer->slot = (uint8_t)slot;
+		wheel->l0_map[slot / 64] |= 1ULL << (slot % 64);
+		list_add(wheel->l0 + slot, timer);
+		return;
+	}
+
+	if (delta > TIMER_MAX_DELAY)
+		timer->expire = wheel->now + TIMER_MAX_DELAY;
+
+	int level = 1;
+	while (level < TIMER_LEVELS - 1 &&
+	       delta >> (LN_SHIFT(level) + TIMER_LN_BITS))
+		++level;
+
+	unsigned const slot = (timer->expire >> LN_SHIFT(level)) & LN_MASK;
+
+	timer->level = (int8_t)level;
+	timer->slot = (uint8_t)slot;
+	wheel->ln_map[level - 1] |= 1ULL << slot;
+	list_add(wheel->ln[level - 1] + slot, timer);
+}
+
+static void wheel_remove(struct timer_wheel *wheel, struct timer *timer)
+{
+	list_del(timer);
+
+	/* Keep occupancy maps in sync, so lookups stay O(1) */
+	if (timer->level == 0) {
+		if (wheel->l0[timer->slot].first == NULL)
+			wheel->l0_map[timer->slot / 64] &= ~(1ULL << (timer->slot % 64));
+	} else if (timer->level > 0) {
+		if (wheel->ln[timer->level - 1][timer->slot].first == NULL)
+			wheel->ln_map[timer->level - 1] &= ~(1ULL << timer->slot);
+	}
+	timer->level = -1;
+}
+
+static int l0_next(struct timer_wheel const *wheel, unsigned idx)
+{
+	unsigned word = idx / 64;
+	uint64_t bits = wheel->l0_map[word] & (~0ULL << (idx % 64));
+
+	while (bits == 0) {
+		if (++word == TIMER_L0_SIZE / 64) return -1;
+		bits = wheel->l0_map[word];
+	}
+	return (int)(word * 64 + (unsigned)__builtin_ctzll(bits));
+}
+
+static void cascade(struct timer_wheel *wheel)
+{
+	for (int level = 1; level < TIMER_LEVELS; ++level) {
+		unsigned const slot = (wheel->now >> LN_SHIFT(level)) & LN_MASK;
+		struct timer_list list;
+
+		list_move(&list, wheel->ln[level - 1] + slot);
+		wheel->ln_map[level - 1] &= ~(1ULL << slot);
+
+		for (struct timer *timer; (timer = list.first);) {
+			list_del(timer);
+			wheel_insert(wheel, timer);
+		}
+
+		/* Upper level only moves when this one wraps */
+		if (slot) break;
+	}
+}
+
+void timer_init(struct timer_wheel *wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof *wheel);
+	wheel->now = now;
+}
+
+void timer_arm(struct timer_wheel *wheel, struct timer *timer,
+               uint64_t expire)
+{
+	if (timer_pending(timer))
+		wheel_remove(wheel, timer);
+	else
+		++wheel->count;
+
+	timer->expire = expire;
+	wheel_insert(wheel, timer);
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+	if (!timer_pending(timer)) return;
+
+	wheel_remove(wheel, timer);
+	--wheel->count;
+}
+
+void timer_advance(struct timer_wheel *wheel, uint64_t now)
+{
+	while (wheel->now <= now) {
+		unsigned const idx = wheel->now & L0_MASK;
+
+		if (idx == 0) cascade(wheel);
+
+		/* Nothing left, jump straight to now */
+		if (wheel->count == 0) {
+			wheel->now = now + 1;
+			break;
+		}
+
+		/* Skip empty slots, up to the next cascade at most */
+		int const next = l0_next(wheel, idx);
+		if (next != (int)idx) {
+			uint64_t const skip = next < 0
+				? TIMER_L0_SIZE - idx : (unsigned)next - idx;
+			wheel->now = wheel->now + skip > now + 1
+				? now + 1 : wheel->now + skip;
+			continue;
+		}
+
+		/* Detach the slot first: callbacks re-arming at `now` land in
+		 * the next tick instead of the slot being processed */
+		struct timer_list list;
+
+		list_move(&list, wheel->l0 + idx);
+		wheel->l0_map[idx / 64] &= ~(1ULL << (idx % 64));
+		++wheel->now;
+
+		for (struct timer *timer; (timer = list.first);) {
+			list_del(timer);
+			timer->level = -1;
+			--wheel->count;
+			timer->fn(timer);
+		}
+	}
+}
+
+int timer_next(struct timer_wheel const *wheel)
+{
+	if (wheel->count == 0) return -1;
+
+	/* Ticks are counted from the last processed one */
+	unsigned const idx = wheel->now & L0_MASK;
+	int const next = l0_next(wheel, idx);
+
+	return (next < 0 ? TIMER_L0_SIZE - (int)idx : next - (int)idx) + 1;
+}
@@ -0,0 +1,128 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   timer.h                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file timer.h
+ * @brief
+ * Hierarchical timer wheel, O(1) arm, cancel and expire
+ *
+ * Time is expressed in ticks (milliseconds for the server). The first
+ * level holds the next `TIMER_L0_SIZE` ticks with a slot per tick, each
+ * upper level covers `TIMER_LN_SIZE` times its lower level and is cascaded
+ * down when the lower level wraps.
+ */
+#ifndef __TIMER_H
+# define __TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_L0_BITS (8)
+#define TIMER_LN_BITS (6)
+#define TIMER_LEVELS  (4)
+#define TIMER_L0_SIZE (1 << TIMER_L0_BITS)
+#define TIMER_LN_SIZE (1 << TIMER_LN_BITS)
+
+/** Longest delay a timer can be armed with, longer ones are clamped */
+#define TIMER_MAX_DELAY \
+	((1ULL << (TIMER_L0_BITS + (TIMER_LEVELS - 1) * TIMER_LN_BITS)) - 1)
+
+struct timer;
+typedef void timer_fn_t(struct timer *timer);
+
+/**
+ * Timer definition, meant to be embedded in its owner
+ */
+struct timer {
+	struct timer *next;   /**< Next timer in the same slot           */
+	struct timer **pprev; /**< Link pointing to us, NULL if disarmed */
+	uint64_t expire;      /**< Expiration tick                       */
+	timer_fn_t *fn;       /**< Expiration callback                   */
+	int8_t level;         /**< Wheel level holding the timer         */
+	uint8_t slot;         /**< Slot in the level holding the timer   */
+};
+
+struct timer_list {
+	struct timer *first;
+};
+
+/**
+ * Timer wheel definition
+ */
+struct timer_wheel {
+	uint64_t now;   /**< Next tick to process      */
+	unsigned count; /**< Number of armed timers    */
+	uint64_t l0_map[TIMER_L0_SIZE / 64];
+	uint64_t ln_map[TIMER_LEVELS - 1];
+	struct timer_list l0[TIMER_L0_SIZE];
+	struct timer_list ln[TIMER_LEVELS - 1][TIMER_LN_SIZE];
+};
+
+/**
+ * Initialize a timer wheel
+ * @param wheel [out] Wheel to initialize
+ * @param now    [in] Current tick
+ */
+void timer_init(struct timer_wheel *wheel, uint64_t now);
+
+/**
+ * Initialize a disarmed timer
+ * @param timer [out] Timer to initialize
+ * @param fn     [in] Expiration callback
+ */
+static inline void timer_setup(struct timer *timer, timer_fn_t *fn)
+{
+	*timer = (struct timer){ .fn = fn, .level = -1 };
+}
+
+/**
+ * @param timer [in] Timer to check
+ * @return           Whether the timer is armed
+ */
+static inline bool timer_pending(struct timer const *timer)
+{
+	return timer->pprev != NULL;
+}
+
+/**
+ * Arm or re-arm a timer
+ * @param wheel [in,out] Targeted wheel
+ * @param timer [in,out] Timer to arm
+ * @param expire    [in] Expiration tick, past ones expire on next advance
+ */
+void timer_arm(struct timer_wheel *wheel, struct timer *timer,
+               uint64_t expire);
+
+/**
+ * Disarm a timer, nothing is done if it is not armed
+ * @param wheel [in,out] Targeted wheel
+ * @param timer [in,out] Timer to disarm
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * Run callbacks of every timer expired at `now`
+ * A callback may arm or cancel any timer, including itself.
+ * @param wheel [in,out] Targeted wheel
+ * @param now       [in] Current tick
+ */
+void timer_advance(struct timer_wheel *wheel, uint64_t now);
+
+/**
+ * @param wheel [in] Targeted wheel
+ * @return           Ticks to wait until the next call to `timer_advance`
+ *                   has something to do, -1 if no timer is armed
+ */
+int timer_next(struct timer_wheel const *wheel);
+
+#endif /* !__TIMER_H */
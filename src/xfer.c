@@ -0,0 +1,705 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   xfer.c                                             :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "xfer.h"
+#include "ascii.h"
+#include "clock.h"
+#include "listing.h"
+#include "zmode.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define XFER_PIPE_SIZE (256 * 1024) /**< Requested splice pipe capacity */
+#define XFER_STAGE     (256 * 1024) /**< Encoded bytes received at once */
+#define XFER_TEXT      (128 * 1024) /**< Text bytes translated at once  */
+
+#define XFER_BLOCK_MAX (65535)     /**< Bytes counted by a block header */
+#define XFER_BLOCK_HDR (3)         /**< Descriptor, then the count      */
+#define XFER_FRAME     (3 + 20)    /**< Header and a restart marker     */
+#define XFER_MARK_GAP  (64 << 20)  /**< Bytes sent between markers      */
+
+#define XFER_BLOCK_EOF  (0x40) /**< Last block of the file           */
+#define XFER_BLOCK_MARK (0x10) /**< Restart marker, no file contents */
+
+/**
+ * Open the pipe receptions are spliced through, as large as allowed: the
+ * fewer splices per received byte, the better
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int xfer_pipe(struct xfer *xfer)
+{
+	if (pipe2(xfer->pipe, O_NONBLOCK | O_CLOEXEC)) return -1;
+
+	int const size = fcntl(xfer->pipe[1], F_SETPIPE_SZ, XFER_PIPE_SIZE);
+	xfer->pipe_size = size > 0 ? (size_t)size
+		: (size_t)fcntl(xfer->pipe[1], F_GETPIPE_SZ);
+	return 0;
+}
+
+/**
+ * Grow the staging buffer to what a setup needs at least, each one asks
+ * for its own
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int xfer_room(struct xfer *xfer, size_t size)
+{
+	if (size <= xfer->room) return 0;
+
+	char *const buf = realloc(xfer->buf, size);
+
+	if (buf == NULL) return -1;
+	xfer->buf = buf;
+	xfer->room = size;
+	return 0;
+}
+
+int xfer_deflate(struct xfer *xfer, int level)
+{
+	bool const send = xfer->dir == XFER_SEND;
+
+	if ((xfer->z = malloc(sizeof *xfer->z)) == NULL)
+		return -1;
+	if (zmode_init(xfer->z, send ? level : -1)) {
+		free(xfer->z);
+		xfer->z = NULL;
+		return -1;
+	}
+	return xfer_room(xfer, send ? zmode_bound() : XFER_STAGE);
+}
+
+int xfer_block(struct xfer *xfer)
+{
+	xfer->block = true;
+	xfer->mark = xfer->off + XFER_MARK_GAP;
+	return xfer_room(xfer, XFER_FRAME);
+}
+
+int xfer_ascii(struct xfer *xfer)
+{
+	xfer->ascii = true;
+	if ((xfer->text = malloc(XFER_TEXT + 1)) == NULL)
+		return -1;
+
+	/* Translated bytes are staged, behind a block header in block mode */
+	return xfer_room(xfer, XFER_BLOCK_HDR + 2 * XFER_TEXT);
+}
+
+int xfer_listing(struct xfer *xfer, bool names, char const *name)
+{
+	if ((xfer->list = malloc(sizeof *xfer->list)) == NULL)
+		return -1;
+	if (listing_init(xfer->list, names, name)) {
+		free(xfer->list);
+		xfer->list = NULL;
+		return -1;
+	}
+	return xfer_room(xfer, XFER_BLOCK_HDR + XFER_TEXT);
+}
+
+/**
+ * @return Whether receptions go through the pipe
+ */
+static inline bool xfer_spliced(struct xfer const *xfer)
+{
+	return xfer->dir == XFER_RECV && xfer->z == NULL && !xfer->ascii;
+}
+
+int xfer_connect(struct xfer *xfer, struct sockaddr_in const *addr)
+{
+	if (xfer_spliced(xfer) && xfer_pipe(xfer))
+		return -1;
+
+	int const sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+	                        SOCK_CLOEXEC, 0);
+	if (sock < 0) return -1;
+
+	if (connect(sock, (struct sockaddr const *)addr, sizeof *addr) &&
+	    errno != EINPROGRESS) {
+		int const err = errno;
+
+		close(sock);
+		return (errno = err), -1;
+	}
+	xfer->socket = sock;
+	xfer->connected = false;
+	return 0;
+}
+
+int xfer_attach(struct xfer *xfer, int sock)
+{
+	xfer->socket = sock;
+	xfer->connected = true;
+	return xfer_spliced(xfer) ? xfer_pipe(xfer) : 0;
+}
+
+int xfer_established(struct xfer *xfer)
+{
+	int err = 0;
+
+	if (getsockopt(xfer->socket, SOL_SOCKET, SO_ERROR, &err,
+	               &(socklen_t){ sizeof err }))
+		return -1;
+	if (err) return (errno = err), -1;
+	xfer->connected = true;
+	return 0;
+}
+
+/**
+ * Fail on the file side
+ * @param err [in] Failure, 0 for a file which took no byte
+ */
+static int xfer_local(struct xfer *xfer, int err)
+{
+	xfer->local = true;
+	return (errno = err ? err : EIO), -1;
+}
+
+/**
+ * Read the next bytes of the file, or list its next entries, then
+ * translate text with its line endings expanded
+ * @param out [out] Room for `want` bytes, twice as many for text
+ * @param want [in] Bytes read at most, `XFER_TEXT` at most and
+ *                  `LISTING_LINE` at least
+ * @return          Staged bytes, 0 once the file is read, -1 otherwise
+ *                  (errno is set)
+ */
+static ssize_t xfer_encode(struct xfer *xfer, char *out, size_t want)
+{
+	uint64_t const left = xfer->end - xfer->off;
+	char *const in = xfer->ascii ? xfer->text : out;
+
+	if (left < want) want = (size_t)left;
+	if (want == 0) return 0;
+
+	ssize_t const rd = xfer->list
+		? listing_read(xfer->list, xfer->file, in, want)
+		: pread(xfer->file, in, want, (off_t)xfer->off);
+	if (rd <= 0) {
+		/* File shrank since it was opened, or is listed whole: what
+		 * is left is sent */
+		if (rd == 0) xfer->end = xfer->off;
+		return rd;
+	}
+	xfer->off += (uint64_t)rd;
+	return xfer->ascii ? (ssize_t)ascii_encode(out, in, (size_t)rd) : rd;
+}
+
+/**
+ * Stage the header of a block
+ * @param len [in] Bytes following the header
+ */
+static void xfer_header(struct xfer *xfer, uint8_t desc, size_t len)
+{
+	uint8_t *const hdr = (uint8_t *)xfer->buf;
+
+	xfer->desc = desc;
+	hdr[0] = desc;
+	hdr[1] = (uint8_t)(len >> 8);
+	hdr[2] = (uint8_t)len;
+}
+
+/**
+ * @return Whether a restart marker is due before the next block
+ */
+static inline bool xfer_marked(struct xfer const *xfer)
+{
+	return xfer->off >= xfer->mark && xfer->off < xfer->end;
+}
+
+/**
+ * Stage a restart marker block, the file offset in decimal
+ * @return Staged bytes
+ */
+static size_t xfer_marker(struct xfer *xfer)
+{
+	size_t const len = (size_t)snprintf(xfer->buf + XFER_BLOCK_HDR,
+	                                    XFER_FRAME - XFER_BLOCK_HDR, "%lu",
+	                                    xfer->off);
+
+	xfer_header(xfer, XFER_BLOCK_MARK, len);
+	xfer->mark = xfer->off + XFER_MARK_GAP;
+	return XFER_BLOCK_HDR + len;
+}
+
+/**
+ * Stage the next encoded bytes: compressed, translated or listed, then
+ * compressed or framed in a block
+ * @return Staged bytes, 0 once the file is sent, -1 otherwise (errno is
+ *         set)
+ */
+static ssize_t xfer_stage(struct xfer *xfer)
+{
+	struct zmode *const z = xfer->z;
+	unsigned const grow = xfer->ascii ? 2 : 1;
+	ssize_t n;
+
+	if (z && !xfer->ascii && !xfer->list)
+		return zmode_deflate(z, xfer->file, &xfer->off, &xfer->end,
+		                     xfer->buf);
+	if (z) {
+		/* Text expands twice at most, blocks are staged expanded */
+		size_t const room = z->batch * (size_t)ZMODE_BLOCK / grow;
+
+		if (z->ended) return 0;
+		if ((n = xfer_encode(xfer, z->in, room < XFER_TEXT
+		                     ? room : XFER_TEXT)) < 0)
+			return -1;
+		return zmode_compress(z, (size_t)n, xfer->off == xfer->end,
+		                      xfer->buf);
+	}
+	if (!xfer->block)
+		return xfer_encode(xfer, xfer->buf, XFER_TEXT);
+
+	/* One block at a time, an empty one ends an empty file */
+	if (xfer->desc & XFER_BLOCK_EOF) return 0;
+	if (xfer_marked(xfer)) return (ssize_t)xfer_marker(xfer);
+	if ((n = xfer_encode(xfer, xfer->buf + XFER_BLOCK_HDR,
+	                     XFER_BLOCK_MAX / grow)) < 0)
+		return -1;
+	xfer_header(xfer, xfer->off == xfer->end ? XFER_BLOCK_EOF : 0,
+	            (size_t)n);
+	return XFER_BLOCK_HDR + n;
+}
+
+/**
+ * Send staged bytes, the next ones are encoded from the file once they
+ * run out
+ */
+static int xfer_send_staged(struct xfer *xfer, size_t quantum)
+{
+	while (quantum) {
+		if (xfer->head == xfer->tail) {
+			uint64_t const off = xfer->off;
+			ssize_t const n = xfer_stage(xfer);
+			if (n < 0)
+				return xfer_local(xfer, errno);
+			if (n == 0)
+				return XFER_DONE;
+			xfer->count += xfer->off - off;
+			xfer->head = 0;
+			xfer->tail = (size_t)n;
+		}
+
+		size_t const n = xfer->tail - xfer->head < quantum
+			? xfer->tail - xfer->head : quantum;
+		ssize_t const wr = send(xfer->socket, xfer->buf + xfer->head, n,
+		                        MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (wr < 0)
+			return errno == EAGAIN ? XFER_AGAIN : -1;
+		xfer->head += (size_t)wr;
+		quantum -= (size_t)wr;
+
+		/* Short send: the socket is full, save a failing call */
+		if ((size_t)wr < n)
+			return XFER_AGAIN;
+	}
+	return XFER_MORE;
+}
+
+/**
+ * Stage the header of the next block: a restart marker once in a while,
+ * file contents otherwise, the last block being flagged
+ */
+static void xfer_frame(struct xfer *xfer)
+{
+	if (xfer_marked(xfer)) {
+		xfer->left = 0;
+		xfer->tail = xfer_marker(xfer);
+	} else {
+		size_t const len = xfer->end - xfer->off < XFER_BLOCK_MAX
+			? (size_t)(xfer->end - xfer->off) : XFER_BLOCK_MAX;
+
+		xfer_header(xfer, xfer->off + len == xfer->end
+		            ? XFER_BLOCK_EOF : 0, len);
+		xfer->left = len;
+		xfer->tail = XFER_BLOCK_HDR;
+	}
+	xfer->head = 0;
+}
+
+/**
+ * Send blocks, headers are corked along with the contents which are sent
+ * straight from the page cache
+ */
+static int xfer_send_block(struct xfer *xfer, size_t quantum)
+{
+	while (quantum) {
+		if (xfer->head < xfer->tail) {
+			ssize_t const wr = send(xfer->socket, xfer->buf + xfer->head,
+			                        xfer->tail - xfer->head,
+			                        (xfer->left ? MSG_MORE : 0) |
+			                        MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (wr < 0)
+				return errno == EAGAIN ? XFER_AGAIN : -1;
+			xfer->head += (size_t)wr;
+			if (xfer->head < xfer->tail)
+				return XFER_AGAIN;
+			continue;
+		}
+
+		if (xfer->left == 0) {
+			if (xfer->desc & XFER_BLOCK_EOF)
+				return XFER_DONE;
+			xfer_frame(xfer);
+			continue;
+		}
+
+		size_t const n = xfer->left < quantum ? xfer->left : quantum;
+		off_t off = (off_t)xfer->off;
+		ssize_t const wr = sendfile(xfer->socket, xfer->file, &off, n);
+		if (wr < 0)
+			return errno == EAGAIN ? XFER_AGAIN : -1;
+
+		/* File shrank since it was opened, the header told otherwise */
+		if (wr == 0)
+			return xfer_local(xfer, 0);
+		xfer->off += (uint64_t)wr;
+		xfer->count += (uint64_t)wr;
+		xfer->left -= (size_t)wr;
+		quantum -= (size_t)wr;
+		if ((size_t)wr < n)
+			return XFER_AGAIN;
+	}
+	return XFER_MORE;
+}
+
+int xfer_send(struct xfer *xfer, size_t quantum)
+{
+	if (xfer->z || xfer->ascii || xfer->list)
+		return xfer_send_staged(xfer, quantum);
+	if (xfer->block)
+		return xfer_send_block(xfer, quantum);
+	while (xfer->off < xfer->end) {
+		if (quantum == 0) return XFER_MORE;
+
+		size_t const n = xfer->end - xfer->off < quantum
+			? (size_t)(xfer->end - xfer->off) : quantum;
+		off_t off = (off_t)xfer->off;
+
+		/* File offset is left untouched, the position is ours */
+		ssize_t const wr = sendfile(xfer->socket, xfer->file, &off, n);
+		if (wr < 0)
+			return errno == EAGAIN ? XFER_AGAIN : -1;
+
+		/* File shrank since it was opened, what is left is sent */
+		if (wr == 0) {
+			xfer->end = xfer->off;
+			break;
+		}
+		xfer->off += (uint64_t)wr;
+		xfer->count += (uint64_t)wr;
+		quantum -= (size_t)wr;
+
+		/* Short send: the socket is full, save a failing call */
+		if ((size_t)wr < n && xfer->off < xfer->end)
+			return XFER_AGAIN;
+	}
+	return XFER_DONE;
+}
+
+/**
+ * End of a reception: room allocated past the received bytes is given
+ * back, then the file is synced as requested
+ */
+static int xfer_received(struct xfer *xfer)
+{
+	struct stat st;
+
+	/* Allocated room left unused lies past the end of file, truncating
+	 * to the end of file releases it (hole punching stops there) */
+	if (xfer->end > xfer->off && (fstat(xfer->file, &st) ||
+	    ((uint64_t)st.st_size <= xfer->off &&
+	     ftruncate(xfer->file, st.st_size))))
+		return xfer_local(xfer, errno);
+	if (xfer->sync == XFER_SYNC_DATA && fdatasync(xfer->file))
+		return xfer_local(xfer, errno);
+	return XFER_DONE;
+}
+
+/**
+ * Write decoded bytes at the file offset
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int xfer_write(struct xfer *xfer, char const *data, size_t len)
+{
+	while (len) {
+		ssize_t const wr = pwrite(xfer->file, data, len, (off_t)xfer->off);
+		if (wr <= 0) return xfer_local(xfer, wr < 0 ? errno : 0);
+		data += wr;
+		len -= (size_t)wr;
+		xfer->off += (uint64_t)wr;
+		xfer->count += (uint64_t)wr;
+	}
+	return 0;
+}
+
+/**
+ * Write received text with its line endings stripped, the carriage
+ * return ending it is held until the next bytes
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int xfer_translate(struct xfer *xfer, char const *in, size_t len)
+{
+	while (len) {
+		size_t const n = len < XFER_TEXT ? len : XFER_TEXT;
+
+		if (xfer_write(xfer, xfer->text,
+		               ascii_decode(xfer->text, in, n, &xfer->cr)))
+			return -1;
+		in += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Write received bytes decoded, a deflate stream followed by garbage
+ * fails the transfer
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int xfer_decode(struct xfer *xfer, char const *in, size_t len)
+{
+	char const *out;
+	ssize_t n;
+
+	if (xfer->z == NULL)
+		return xfer_translate(xfer, in, len);
+
+	while ((n = zmode_inflate(xfer->z, &in, &len, &out)) > 0)
+		if (xfer->ascii ? xfer_translate(xfer, out, (size_t)n)
+		                : xfer_write(xfer, out, (size_t)n))
+			return -1;
+	return n < 0 || len ? (errno = EBADMSG), -1 : 0;
+}
+
+/**
+ * Start writing back the bytes written since `start`, as requested
+ */
+static void xfer_writeback(struct xfer const *xfer, uint64_t start)
+{
+	if (xfer->sync != XFER_SYNC_NONE && xfer->off > start)
+		sync_file_range(xfer->file, (off_t)start,
+		                (off_t)(xfer->off - start), SYNC_FILE_RANGE_WRITE);
+}
+
+/**
+ * End of an encoded reception, a deflate stream cut short fails it
+ */
+static int xfer_decoded(struct xfer *xfer)
+{
+	if (xfer->z && !xfer->z->ended)
+		return (errno = EBADMSG), -1;
+
+	/* Carriage return ending the file is data */
+	if (xfer->cr && xfer_write(xfer, "\r", 1))
+		return -1;
+	return xfer_received(xfer);
+}
+
+/**
+ * Receive encoded bytes and write them decoded
+ */
+static int xfer_recv_staged(struct xfer *xfer, size_t quantum)
+{
+	size_t const room = xfer->z ? XFER_STAGE : XFER_TEXT;
+
+	while (quantum) {
+		ssize_t const rd = recv(xfer->socket, xfer->buf,
+		                        quantum < room ? quantum : room,
+		                        MSG_DONTWAIT);
+		if (rd < 0)
+			return errno == EAGAIN ? XFER_AGAIN : -1;
+		if (rd == 0)
+			return xfer_decoded(xfer);
+
+		uint64_t const start = xfer->off;
+
+		if (xfer_decode(xfer, xfer->buf, (size_t)rd))
+			return -1;
+		xfer_writeback(xfer, start);
+		quantum -= (size_t)rd;
+	}
+	return XFER_MORE;
+}
+
+/**
+ * Splice received bytes to the file through the pipe, drained right away:
+ * the page cache takes it all
+ * @param want [in] Bytes received at most, the pipe capacity at most
+ * @return          Bytes received, 0 once the peer closed, -1 otherwise
+ *                  (errno is set)
+ */
+static ssize_t xfer_splice(struct xfer *xfer, size_t want)
+{
+	ssize_t const in = splice(xfer->socket, NULL, xfer->pipe[1], NULL,
+	                          want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (in <= 0)
+		return in;
+
+	uint64_t const start = xfer->off;
+
+	for (size_t left = (size_t)in; left; ) {
+		loff_t off = (loff_t)xfer->off;
+		ssize_t const out = splice(xfer->pipe[0], NULL, xfer->file,
+		                           &off, left, SPLICE_F_MOVE);
+		if (out <= 0)
+			return xfer_local(xfer, out < 0 ? errno : 0);
+		xfer->off += (uint64_t)out;
+		xfer->count += (uint64_t)out;
+		left -= (size_t)out;
+	}
+	xfer_writeback(xfer, start);
+	return in;
+}
+
+/**
+ * Receive a block of text into the staging buffer, then write it with its
+ * line endings stripped
+ * @param want [in] Bytes received at most
+ * @return          Bytes received, 0 once the peer closed, -1 otherwise
+ *                  (errno is set)
+ */
+static ssize_t xfer_recv_text(struct xfer *xfer, size_t want)
+{
+	ssize_t const rd = recv(xfer->socket, xfer->buf, want < XFER_TEXT
+	                        ? want : XFER_TEXT, MSG_DONTWAIT);
+	if (rd <= 0)
+		return rd;
+
+	uint64_t const start = xfer->off;
+
+	if (xfer_translate(xfer, xfer->buf, (size_t)rd))
+		return -1;
+	xfer_writeback(xfer, start);
+	return rd;
+}
+
+/**
+ * Receive blocks, headers and markers are read on their own: bytes past
+ * the last block belong to the next transfer. Markers are skipped, the
+ * peer restarts from file offsets. Text is translated, spliced otherwise.
+ */
+static int xfer_recv_block(struct xfer *xfer, size_t quantum)
+{
+	while (quantum) {
+		ssize_t rd;
+
+		/* Header, parsed once whole */
+		if (xfer->tail < XFER_BLOCK_HDR) {
+			rd = recv(xfer->socket, xfer->buf + xfer->tail,
+			          XFER_BLOCK_HDR - xfer->tail, MSG_DONTWAIT);
+			if (rd > 0 && (xfer->tail += (size_t)rd) == XFER_BLOCK_HDR) {
+				uint8_t const *const hdr = (uint8_t const *)xfer->buf;
+
+				xfer->desc = hdr[0];
+				xfer->left = (size_t)hdr[1] << 8 | hdr[2];
+			}
+		} else if (xfer->desc & XFER_BLOCK_MARK) {
+			rd = recv(xfer->socket, xfer->buf, xfer->left < XFER_FRAME
+			          ? xfer->left : XFER_FRAME, MSG_DONTWAIT);
+			if (rd > 0) xfer->left -= (size_t)rd;
+		} else if (xfer->ascii) {
+			rd = xfer_recv_text(xfer, xfer->left < quantum
+			                    ? xfer->left : quantum);
+			if (rd > 0) xfer->left -= (size_t)rd;
+		} else {
+			size_t const want = quantum < xfer->pipe_size
+				? quantum : xfer->pipe_size;
+			rd = xfer_splice(xfer, xfer->left < want ? xfer->left : want);
+			if (rd > 0) xfer->left -= (size_t)rd;
+		}
+		if (rd < 0)
+			return errno == EAGAIN ? XFER_AGAIN : -1;
+
+		/* Peer closing before the last block cuts the file short */
+		if (rd == 0)
+			return (errno = EBADMSG), -1;
+
+		/* Headers count too, empty blocks cannot hold the reactor */
+		quantum -= (size_t)rd < quantum ? (size_t)rd : quantum;
+
+		if (xfer->tail == XFER_BLOCK_HDR && xfer->left == 0) {
+			if (xfer->desc & XFER_BLOCK_EOF)
+				return xfer_decoded(xfer);
+			xfer->tail = 0;
+		}
+	}
+	return XFER_MORE;
+}
+
+int xfer_recv(struct xfer *xfer, size_t quantum)
+{
+	if (xfer->block)
+		return xfer_recv_block(xfer, quantum);
+	if (xfer->z || xfer->ascii)
+		return xfer_recv_staged(xfer, quantum);
+	while (quantum) {
+		size_t const want = quantum < xfer->pipe_size
+			? quantum : xfer->pipe_size;
+		ssize_t const in = xfer_splice(xfer, want);
+		if (in < 0)
+			return errno == EAGAIN ? XFER_AGAIN : -1;
+
+		/* Peer closes the data connection once the file is sent */
+		if (in == 0)
+			return xfer_received(xfer);
+
+		/* A short splice may only mean the pipe ran out of slots: the
+		 * socket is drained until it fails */
+		quantum -= (size_t)in;
+	}
+	return XFER_MORE;
+}
+
+int xfer_run(struct xfer *xfer, size_t quantum)
+{
+	uint64_t const count = xfer->count;
+	uint64_t now = 0;
+
+	/* Chunks are sized to what every bucket grants, never slept on */
+	if (xfer->shape[0]) {
+		now = clk_ns(clk_ticks());
+		quantum = shape_grant(xfer->shape, quantum, now, &xfer->wait);
+		if (quantum == 0)
+			return XFER_LIMIT;
+	}
+
+	int const res = xfer->dir == XFER_RECV ? xfer_recv(xfer, quantum)
+	                                       : xfer_send(xfer, quantum);
+
+	if (xfer->shape[0] && xfer->count != count)
+		shape_charge(xfer->shape, xfer->count - count, now);
+	return res;
+}
+
+void xfer_close(struct xfer *xfer)
+{
+	if (xfer->socket >= 0) close(xfer->socket);
+	if (xfer->file >= 0) close(xfer->file);
+	if (xfer->pipe[0] >= 0) close(xfer->pipe[0]);
+	if (xfer->pipe[1] >= 0) close(xfer->pipe[1]);
+	if (xfer->z) zmode_fini(xfer->z);
+	free(xfer->z);
+	if (xfer->list) listing_fini(xfer->list);
+	free(xfer->list);
+	free(xfer->buf);
+	free(xfer->text);
+	xfer_init(xfer);
+}
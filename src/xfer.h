@@ -0,0 +1,202 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   xfer.h                                             :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file xfer.h
+ * @brief
+ * Data connections and the transfers running over them, non-blocking: a
+ * transfer moves at most a quantum per call and tells its caller whether
+ * to wait for the socket or to call again
+ */
+#ifndef __XFER_H
+# define __XFER_H
+
+#include "shape.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+struct listing;
+struct zmode;
+
+/**
+ * Transfer progress
+ */
+enum xfer_res {
+	XFER_DONE = 0, /**< Every byte is transferred                 */
+	XFER_AGAIN,    /**< Wait until the socket is ready again       */
+	XFER_MORE,     /**< Quantum spent, call again                  */
+	XFER_LIMIT,    /**< Rate limited, call again after `wait`      */
+};
+
+enum xfer_dir {
+	XFER_SEND = 0, /**< File to socket, until the file end          */
+	XFER_RECV,     /**< Socket to file, until the peer closes       */
+	XFER_DIR_MAX,
+};
+
+/**
+ * Durability of received files
+ */
+enum xfer_sync {
+	XFER_SYNC_NONE = 0,  /**< Left to the kernel writeback          */
+	XFER_SYNC_WRITEBACK, /**< Writeback started as bytes are written,
+	                          dirty pages do not pile up             */
+	XFER_SYNC_DATA,      /**< Also synced before the transfer ends  */
+};
+
+/**
+ * Data connection and transfer state
+ */
+struct xfer {
+	int socket;          /**< Data connection, -1 when closed     */
+	int file;            /**< Transferred file, -1 when none      */
+	int pipe[2];         /**< Receptions go through, -1 when none */
+	size_t pipe_size;    /**< Pipe capacity                       */
+	enum xfer_dir dir;
+	enum xfer_sync sync;
+	bool connected;      /**< Data connection established         */
+	bool local;          /**< Failed on the file side             */
+	uint64_t off;        /**< Next byte of the file               */
+	uint64_t end;        /**< Offset a sent file ends at, received
+	                          files may be allocated up to it      */
+	uint64_t count;      /**< Bytes transferred                   */
+	struct zmode *z;     /**< MODE Z state, NULL for raw bytes    */
+	struct listing *list; /**< Listing sent instead of the file
+	                           contents, NULL for a file          */
+	char *buf;           /**< Encoded bytes staged between the
+	                          file and the socket                 */
+	size_t room;         /**< Size of the staging buffer          */
+	size_t head;         /**< First staged byte not passed on yet */
+	size_t tail;         /**< End of the staged bytes             */
+	bool ascii;          /**< TYPE A, lines end with CRLF on the
+	                          data connection                     */
+	char *text;          /**< Text bytes of the file, before or
+	                          after their translation             */
+	bool cr;             /**< Received carriage return held       */
+	bool block;          /**< MODE B, blocks end the file in band */
+	uint8_t desc;        /**< Descriptor of the current block     */
+	size_t left;         /**< Bytes left in the current block     */
+	uint64_t mark;       /**< Offset of the next restart marker   */
+	struct shape *shape[SHAPE_LEVELS]; /**< Rate limits, up to the
+	                                        first NULL             */
+	uint64_t wait;       /**< Rate limited for, in nanoseconds    */
+};
+
+static inline void xfer_init(struct xfer *xfer)
+{
+	*xfer = (struct xfer){ .socket = -1, .file = -1, .pipe = { -1, -1 } };
+}
+
+/**
+ * @return Whether a transfer runs, its data connection may still be
+ *         awaited
+ */
+static inline bool xfer_active(struct xfer const *xfer)
+{
+	return xfer->file >= 0;
+}
+
+/**
+ * Compress the data stream (MODE Z), decompress it for receptions. Set up
+ * before the data connection, `dir` is expected to be set.
+ * @param level [in] Compression level of sent files
+ * @return           0 on success, -1 otherwise (errno is set)
+ */
+int xfer_deflate(struct xfer *xfer, int level);
+
+/**
+ * Translate line endings (TYPE A), before compression or framing. Set up
+ * before the data connection, `dir` is expected to be set.
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int xfer_ascii(struct xfer *xfer);
+
+/**
+ * Send the listing of `file`, a directory or a single entry, instead of
+ * its contents: entries are listed as they are sent, `end` is lowered to
+ * the listing size once listed. Set up before the data connection.
+ * @param names [in] Names only (NLST), `ls -l` like lines otherwise
+ * @param name  [in] Name a single entry is listed by, NULL to list the
+ *                   entries of a directory
+ * @return           0 on success, -1 otherwise (errno is set)
+ */
+int xfer_listing(struct xfer *xfer, bool names, char const *name);
+
+/**
+ * Frame the data stream in blocks (MODE B): the file end is told in band,
+ * the data connection may serve the next transfers. Sent files carry
+ * restart markers, their offset in decimal. Set up before the data
+ * connection, `dir` and `off` are expected to be set.
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int xfer_block(struct xfer *xfer);
+
+/**
+ * Start connecting to an active mode data address, the socket becomes
+ * writable once the connection is established or failed. Raw receptions
+ * get their pipe, `dir` and the encoding are expected to be set.
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int xfer_connect(struct xfer *xfer, struct sockaddr_in const *addr);
+
+/**
+ * Take a passive mode data connection over, accepted already. Raw
+ * receptions get their pipe, `dir` and the encoding are expected to be
+ * set.
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int xfer_attach(struct xfer *xfer, int sock);
+
+/**
+ * Check a connection started by `xfer_connect`, once writable
+ * @return 0 once established, -1 otherwise (errno is set)
+ */
+int xfer_established(struct xfer *xfer);
+
+/**
+ * Send the file straight from the page cache, `[off, end)` range, or
+ * through the staging buffer once encoded
+ * @param quantum [in] Bytes sent at most
+ * @return             Progress, -1 on failure (errno is set)
+ */
+int xfer_send(struct xfer *xfer, size_t quantum);
+
+/**
+ * Receive into the file from `off` on, spliced through the pipe: bytes
+ * go from the socket to the page cache without being copied to user
+ * space, unless decoded first. Unused room allocated up to `end` is
+ * released once done.
+ * @param quantum [in] Bytes received at most
+ * @return             Progress, -1 on failure (errno is set)
+ */
+int xfer_recv(struct xfer *xfer, size_t quantum);
+
+/**
+ * Move a transfer on, in its direction, by what its rate limits grant:
+ * the data connection is better left unwatched until `wait` is over once
+ * limited
+ * @param quantum [in] Bytes moved at most
+ * @return             Progress, -1 on failure (errno is set)
+ */
+int xfer_run(struct xfer *xfer, size_t quantum);
+
+/**
+ * Close the data connection, the pipe and the file, the connection is closed
+ * gracefully: bytes sent already still reach the peer
+ */
+void xfer_close(struct xfer *xfer);
+
+#endif /* !__XFER_H */
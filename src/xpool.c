@@ -0,0 +1,407 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   xpool.c                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "xpool.h"
+#include "clock.h"
+#include "ev.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#define XPOOL_TABLE (64) /**< Initial size of a worker job table */
+
+/**
+ * Worker thread, its reactor watches the data connections of the
+ * transfers it owns
+ */
+struct xworker {
+	pthread_t thread;
+	struct ev ev;
+	int fd;                  /**< Event, wakes the worker up        */
+	struct xjob *inbox;      /**< Submitted transfers, lock-free    */
+	struct xjob **jobs;      /**< Transfers indexed by data socket  */
+	unsigned size;           /**< Size of the job table             */
+	struct xjob *running;    /**< Transfers owned                   */
+	struct xjob *ready;      /**< Transfers going on next round     */
+	unsigned npaced;         /**< Rate limited transfers            */
+	uint32_t seq;            /**< Next events tag                   */
+	bool stop;
+};
+
+static struct xworker *g_workers;
+static unsigned g_nworkers;
+static unsigned g_next;          /**< Worker of the next transfer */
+static size_t g_quantum;
+
+/**
+ * Push to a lock-free list, latest first
+ */
+static void xlist_push(struct xjob **head, struct xjob *job)
+{
+	struct xjob *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+
+	do job->next = old;
+	while (!__atomic_compare_exchange_n(head, &old, job, true,
+	                                    __ATOMIC_RELEASE,
+	                                    __ATOMIC_RELAXED));
+}
+
+/**
+ * Take a lock-free list whole, pushers never wait for the taker
+ * @return Jobs in pushing order
+ */
+static struct xjob *xlist_take(struct xjob **head)
+{
+	struct xjob *job = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+	struct xjob *fifo = NULL;
+
+	while (job) {
+		struct xjob *const next = job->next;
+
+		job->next = fifo;
+		fifo = job;
+		job = next;
+	}
+	return fifo;
+}
+
+int xqueue_open(struct xqueue *q)
+{
+	q->head = NULL;
+	q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return q->fd < 0 ? -1 : 0;
+}
+
+void xqueue_close(struct xqueue *q)
+{
+	close(q->fd);
+}
+
+struct xjob *xqueue_take(struct xqueue *q)
+{
+	eventfd_t n;
+
+	/* Reset first, a completion pushed meanwhile raises it again */
+	eventfd_read(q->fd, &n);
+	return xlist_take(&q->head);
+}
+
+/**
+ * Grow the job table so that it holds a descriptor
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+static int xwork_slot(struct xworker *w, int fd)
+{
+	if ((unsigned)fd < w->size) return 0;
+
+	unsigned size = w->size ? w->size : XPOOL_TABLE;
+	while (size <= (unsigned)fd) size *= 2;
+
+	struct xjob **const jobs = realloc(w->jobs, size * sizeof *jobs);
+	if (jobs == NULL) return -1;
+
+	memset(jobs + w->size, 0, (size - w->size) * sizeof *jobs);
+	w->jobs = jobs;
+	w->size = size;
+	return 0;
+}
+
+/**
+ * Queue a transfer which may go on without waiting for its socket, it
+ * gets another quantum once the ready descriptors are handled
+ */
+static void xwork_ready(struct xworker *w, struct xjob *job)
+{
+	if (job->rprev) return;
+	if ((job->rnext = w->ready)) w->ready->rprev = &job->rnext;
+	job->rprev = &w->ready;
+	w->ready = job;
+}
+
+static void xwork_unready(struct xjob *job)
+{
+	if (job->rprev == NULL) return;
+	if ((*job->rprev = job->rnext)) job->rnext->rprev = job->rprev;
+	job->rprev = NULL;
+}
+
+/**
+ * Hand a transfer back to its owner, which may reuse it right away
+ * @param err [in] Transfer errno, 0 on success
+ */
+static void xwork_end(struct xworker *w, struct xjob *job, int err)
+{
+	struct xqueue *const done = job->done;
+	int const sock = job->xfer->socket;
+
+	xwork_unready(job);
+	if (job->paced) {
+		job->paced = false;
+		--w->npaced;
+	}
+	if ((*job->lprev = job->lnext)) job->lnext->lprev = job->lprev;
+	if ((unsigned)sock < w->size && w->jobs[sock] == job) {
+		ev_del(&w->ev, sock);
+		w->jobs[sock] = NULL;
+	}
+	job->err = err;
+	__atomic_store_n(&job->count, job->xfer->count, __ATOMIC_RELAXED);
+	xlist_push(&done->head, job);
+	eventfd_write(done->fd, 1);
+}
+
+/**
+ * Take a submitted transfer over, it goes on once its socket is ready
+ */
+static void xwork_start(struct xworker *w, struct xjob *job)
+{
+	struct xfer const *const xfer = job->xfer;
+	int const sock = xfer->socket;
+
+	job->tag = w->seq++ & EV_TAG_MASK;
+	job->rprev = NULL;
+	if ((job->lnext = w->running)) w->running->lprev = &job->lnext;
+	job->lprev = &w->running;
+	w->running = job;
+
+	/* Not connected yet: connected once writable */
+	if (xwork_slot(w, sock) ||
+	    ev_add(&w->ev, sock, xfer->connected && xfer->dir == XFER_RECV
+	           ? EV_READ : EV_WRITE, job->tag))
+		return xwork_end(w, job, errno);
+	w->jobs[sock] = job;
+}
+
+/**
+ * Leave a rate limited transfer unwatched until its buckets grant enough
+ * again
+ */
+static void xwork_pace(struct xworker *w, struct xjob *job)
+{
+	ev_del(&w->ev, job->xfer->socket);
+	job->paced = true;
+	job->wake = clk_ns(clk_ticks()) + job->xfer->wait;
+	++w->npaced;
+}
+
+/**
+ * Watch again the rate limited transfers whose wait is over
+ * @return Milliseconds until the next one is, -1 if none is left
+ */
+static int xwork_resume(struct xworker *w)
+{
+	uint64_t const now = clk_ns(clk_ticks());
+	uint64_t next = UINT64_MAX;
+	struct xjob *job, *lnext;
+
+	for (job = w->running; job; job = lnext) {
+		struct xfer const *const xfer = job->xfer;
+		uint32_t const events =
+			xfer->dir == XFER_RECV ? EV_READ : EV_WRITE;
+
+		lnext = job->lnext;
+		if (!job->paced)
+			continue;
+		if (job->wake > now) {
+			if (job->wake < next) next = job->wake;
+			continue;
+		}
+		job->paced = false;
+		--w->npaced;
+		if (ev_add(&w->ev, xfer->socket, events, job->tag))
+			xwork_end(w, job, errno);
+	}
+	return next == UINT64_MAX ? -1 : (int)((next - now + 999999) / 1000000);
+}
+
+/**
+ * Move a transfer on, by a quantum at most
+ */
+static void xwork_pump(struct xworker *w, struct xjob *job)
+{
+	struct xfer *const xfer = job->xfer;
+
+	if (!xfer->connected) {
+		if (xfer_established(xfer))
+			return xwork_end(w, job, errno);
+
+		/* Receptions wait for input from now on */
+		if (xfer->dir == XFER_RECV &&
+		    ev_mod(&w->ev, xfer->socket, EV_READ, job->tag))
+			return xwork_end(w, job, errno);
+	}
+
+	int const res = xfer_run(xfer, g_quantum);
+	if (res < 0)
+		return xwork_end(w, job, errno);
+	if (res == XFER_DONE)
+		return xwork_end(w, job, 0);
+
+	__atomic_store_n(&job->count, xfer->count, __ATOMIC_RELAXED);
+	if (res == XFER_MORE)
+		xwork_ready(w, job);
+	else if (res == XFER_LIMIT)
+		xwork_pace(w, job);
+}
+
+/**
+ * Take submitted transfers over, hand cancelled ones back
+ */
+static void xwork_wake(struct xworker *w)
+{
+	struct xjob *job, *next;
+	eventfd_t n;
+
+	eventfd_read(w->fd, &n);
+	for (job = xlist_take(&w->inbox); job; job = next) {
+		next = job->next;
+		xwork_start(w, job);
+	}
+	for (job = w->running; job; job = next) {
+		next = job->lnext;
+		if (__atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE))
+			xwork_end(w, job, ECANCELED);
+	}
+}
+
+/**
+ * Give every ready transfer a quantum, those still ready afterwards wait
+ * for the next round: one huge transfer never starves the others
+ */
+static void xwork_round(struct xworker *w)
+{
+	struct xjob *round = w->ready;
+
+	if (round) round->rprev = &round;
+	w->ready = NULL;
+	while (round) {
+		struct xjob *const job = round;
+
+		xwork_unready(job);
+		xwork_pump(w, job);
+	}
+}
+
+static void *xwork_run(void *arg)
+{
+	struct xworker *const w = arg;
+
+	while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+		ev_event_t evs[EV_MAX_EVENTS];
+
+		/* Ready transfers only poll, rate limited ones wait for their
+		 * turn, a failed wait is retried */
+		int timeout = w->npaced ? xwork_resume(w) : -1;
+		if (w->ready) timeout = 0;
+
+		int const n = ev_wait(&w->ev, evs, EV_MAX_EVENTS, timeout);
+
+		for (int i = 0; i < n; ++i) {
+			int const fd = evs[i].fd;
+
+			if (fd == w->fd) {
+				xwork_wake(w);
+				continue;
+			}
+
+			/* Late events of a transfer handed back already */
+			struct xjob *const job =
+				(unsigned)fd < w->size ? w->jobs[fd] : NULL;
+			if (job && job->tag == evs[i].tag &&
+			    job->rprev == NULL && !job->paced)
+				xwork_pump(w, job);
+		}
+		xwork_round(w);
+	}
+	return NULL;
+}
+
+int xpool_start(unsigned threads, size_t quantum)
+{
+	int err = 0;
+
+	g_quantum = quantum;
+	if (threads == 0) return 0;
+	if ((g_workers = calloc(threads, sizeof *g_workers)) == NULL)
+		return -1;
+
+	for (g_nworkers = 0; g_nworkers < threads; ++g_nworkers) {
+		struct xworker *const w = g_workers + g_nworkers;
+
+		if ((w->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+			err = errno;
+			break;
+		}
+		if (ev_open(&w->ev, EV_EPOLL)) {
+			err = errno;
+			close(w->fd);
+			break;
+		}
+		if (ev_add(&w->ev, w->fd, EV_READ, 0) ||
+		    (errno = pthread_create(&w->thread, NULL, xwork_run, w))) {
+			err = errno;
+			ev_close(&w->ev);
+			close(w->fd);
+			break;
+		}
+	}
+	if (err) {
+		xpool_stop();
+		return (errno = err), -1;
+	}
+	return 0;
+}
+
+void xpool_stop(void)
+{
+	while (g_nworkers) {
+		struct xworker *const w = g_workers + --g_nworkers;
+
+		__atomic_store_n(&w->stop, true, __ATOMIC_RELEASE);
+		eventfd_write(w->fd, 1);
+		pthread_join(w->thread, NULL);
+		ev_close(&w->ev);
+		close(w->fd);
+		free(w->jobs);
+	}
+	free(g_workers);
+	g_workers = NULL;
+}
+
+bool xpool_active(void)
+{
+	return g_nworkers != 0;
+}
+
+void xpool_submit(struct xjob *job)
+{
+	unsigned const i =
+		__atomic_fetch_add(&g_next, 1, __ATOMIC_RELAXED) % g_nworkers;
+	struct xworker *const w = g_workers + i;
+
+	job->worker = w;
+	job->cancel = false;
+	job->count = job->xfer->count;
+	xlist_push(&w->inbox, job);
+	eventfd_write(w->fd, 1);
+}
+
+void xpool_cancel(struct xjob *job)
+{
+	__atomic_store_n(&job->cancel, true, __ATOMIC_RELEASE);
+	eventfd_write(job->worker->fd, 1);
+}
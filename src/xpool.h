@@ -0,0 +1,115 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   xpool.h                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file xpool.h
+ * @brief
+ * Transfer workers: once its data connection is opened, a transfer moves
+ * on a worker thread until it is over, the control reactors only handle
+ * commands meanwhile. Completions are handed back through a lock-free
+ * queue per reactor.
+ */
+#ifndef __XPOOL_H
+# define __XPOOL_H
+
+#include "xfer.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct xworker;
+
+/**
+ * Transfer handed over to a worker, owned by it until queued back
+ */
+struct xjob {
+	struct xjob *next;       /**< Queue link                        */
+	struct xfer *xfer;
+	struct xqueue *done;     /**< Completion queue of the owner     */
+	struct xworker *worker;
+	int err;                 /**< Transfer errno, 0 on success      */
+	bool cancel;             /**< Ends the transfer, `ECANCELED`    */
+	bool busy;               /**< Set by the owner until queued back */
+	uint64_t count;          /**< Bytes transferred so far          */
+	uint32_t tag;            /**< Worker events tag                 */
+	bool paced;              /**< Rate limited, unwatched           */
+	uint64_t wake;           /**< Watched again then, nanoseconds   */
+	struct xjob *rnext;      /**< Worker ready list                 */
+	struct xjob **rprev;
+	struct xjob *lnext;      /**< Worker running list               */
+	struct xjob **lprev;
+};
+
+/**
+ * Completion queue: workers push, the owner takes every completion at once
+ * when its event is readable
+ */
+struct xqueue {
+	struct xjob *head;       /**< Pushed completions, latest first  */
+	int fd;                  /**< Event, readable once pushed       */
+};
+
+/**
+ * @return 0 on success, -1 otherwise (errno is set)
+ */
+int xqueue_open(struct xqueue *q);
+
+void xqueue_close(struct xqueue *q);
+
+/**
+ * Take the queued completions, the event is reset
+ * @return Completions in queuing order, linked by `next`
+ */
+struct xjob *xqueue_take(struct xqueue *q);
+
+/**
+ * Start the transfer workers
+ * @param threads [in] Number of workers, none to move transfers on the
+ *                     reactors
+ * @param quantum [in] Bytes a transfer moves per round
+ * @return             0 on success, -1 otherwise (errno is set)
+ */
+int xpool_start(unsigned threads, size_t quantum);
+
+/**
+ * Stop the workers, once every transfer is taken back
+ */
+void xpool_stop(void);
+
+/**
+ * @return Whether transfers move on workers
+ */
+bool xpool_active(void);
+
+/**
+ * Hand a transfer over, its data connection opened or being connected:
+ * `xfer`, `done` are expected to be set. It is queued back once over.
+ */
+void xpool_submit(struct xjob *job);
+
+/**
+ * Ask a transfer to end, it is queued back as soon as its worker gets to
+ * it: within a quantum
+ */
+void xpool_cancel(struct xjob *job);
+
+/**
+ * @return Bytes transferred so far by a submitted transfer, safe to call
+ *         from any thread
+ */
+static inline uint64_t xjob_count(struct xjob const *job)
+{
+	return __atomic_load_n(&job->count, __ATOMIC_RELAXED);
+}
+
+#endif /* !__XPOOL_H */
@@ -0,0 +1,362 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   zmode.c                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "zmode.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ZMODE_SAMPLE (16 * 1024) /**< Bytes per probed sample           */
+#define ZMODE_SAMPLES         (4) /**< Samples spread over a probed file */
+#define ZMODE_GAIN           (95) /**< Stored above this ratio, percent  */
+
+/**
+ * Block compressed on its own, ends on a byte boundary so that blocks are
+ * concatenated into a single deflate stream
+ */
+struct zblk {
+	char const *in;
+	size_t len;
+	char *out;
+	size_t olen;     /**< Room, then bytes produced      */
+	uint32_t adler;  /**< Checksum of `in`               */
+	int level;
+	bool last;       /**< Ends the stream                */
+	bool failed;
+};
+
+/**
+ * Batch of blocks, taken one at a time by helpers and the caller
+ */
+struct zjob {
+	struct zjob *next;
+	struct zblk *blks;
+	unsigned n;
+	unsigned taken;  /**< Blocks handed out */
+	unsigned done;   /**< Blocks compressed */
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_done = PTHREAD_COND_INITIALIZER;
+static struct zjob *g_jobs;     /**< Jobs with blocks left to take */
+static pthread_t *g_helpers;
+static unsigned g_nhelpers;
+static bool g_stop;
+
+/**
+ * @return Room a block output needs, sync marker included
+ */
+static size_t zblk_room(void)
+{
+	return compressBound(ZMODE_BLOCK) + 16;
+}
+
+static void zblk_run(struct zblk *blk)
+{
+	z_stream strm = { 0 };
+	size_t const room = blk->olen;
+
+	blk->adler = (uint32_t)adler32(adler32(0, Z_NULL, 0),
+	                               (Bytef const *)blk->in, (uInt)blk->len);
+	blk->olen = 0;
+	blk->failed = true;
+
+	/* Raw deflate, the zlib header and trailer wrap the whole stream */
+	if (deflateInit2(&strm, blk->level, Z_DEFLATED, -MAX_WBITS, 8,
+	                 Z_DEFAULT_STRATEGY) != Z_OK)
+		return;
+
+	strm.next_in = (Bytef *)blk->in;
+	strm.avail_in = (uInt)blk->len;
+	strm.next_out = (Bytef *)blk->out;
+	strm.avail_out = (uInt)room;
+
+	int const ret = deflate(&strm, blk->last ? Z_FINISH : Z_SYNC_FLUSH);
+
+	blk->olen = room - strm.avail_out;
+	blk->failed = strm.avail_in || ret != (blk->last ? Z_STREAM_END : Z_OK);
+	deflateEnd(&strm);
+}
+
+/**
+ * Take the next block of a job, unlinked once every block is taken
+ * @note Called with `g_lock` held
+ */
+static struct zblk *zjob_take(struct zjob *job)
+{
+	if (job->taken == job->n) return NULL;
+
+	struct zblk *const blk = job->blks + job->taken++;
+
+	if (job->taken == job->n) {
+		struct zjob **link = &g_jobs;
+
+		while (*link && *link != job) link = &(*link)->next;
+		if (*link) *link = job->next;
+	}
+	return blk;
+}
+
+static void *zmode_run(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&g_lock);
+	while (!g_stop) {
+		struct zjob *const job = g_jobs;
+		struct zblk *const blk = job ? zjob_take(job) : NULL;
+
+		if (blk == NULL) {
+			pthread_cond_wait(&g_work, &g_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&g_lock);
+		zblk_run(blk);
+		pthread_mutex_lock(&g_lock);
+		if (++job->done == job->n)
+			pthread_cond_broadcast(&g_done);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return NULL;
+}
+
+/**
+ * Compress every block of a job, helpers lend a hand, and wait for them
+ */
+static void zjob_run(struct zjob *job)
+{
+	struct zblk *blk;
+
+	pthread_mutex_lock(&g_lock);
+	if (job->n > 1 && g_nhelpers) {
+		job->next = g_jobs;
+		g_jobs = job;
+		if (job->n > 2) pthread_cond_broadcast(&g_work);
+		else pthread_cond_signal(&g_work);
+	}
+	while ((blk = zjob_take(job))) {
+		pthread_mutex_unlock(&g_lock);
+		zblk_run(blk);
+		pthread_mutex_lock(&g_lock);
+		++job->done;
+	}
+	while (job->done < job->n)
+		pthread_cond_wait(&g_done, &g_lock);
+	pthread_mutex_unlock(&g_lock);
+}
+
+int zmode_start(unsigned threads)
+{
+	int err = 0;
+
+	g_stop = false;
+	if (threads == 0) return 0;
+	if ((g_helpers = calloc(threads, sizeof *g_helpers)) == NULL)
+		return -1;
+
+	for (g_nhelpers = 0; g_nhelpers < threads; ++g_nhelpers)
+		if ((err = pthread_create(g_helpers + g_nhelpers, NULL, zmode_run,
+		                          NULL)))
+			break;
+	if (err) {
+		zmode_stop();
+		return (errno = err), -1;
+	}
+	return 0;
+}
+
+void zmode_stop(void)
+{
+	pthread_mutex_lock(&g_lock);
+	g_stop = true;
+	pthread_cond_broadcast(&g_work);
+	pthread_mutex_unlock(&g_lock);
+
+	while (g_nhelpers)
+		pthread_join(g_helpers[--g_nhelpers], NULL);
+	free(g_helpers);
+	g_helpers = NULL;
+}
+
+int zmode_init(struct zmode *z, int level)
+{
+	unsigned const helpers = __atomic_load_n(&g_nhelpers, __ATOMIC_RELAXED);
+
+	*z = (struct zmode){
+		.level = level,
+		.batch = helpers + 1 < ZMODE_BATCH ? helpers + 1 : ZMODE_BATCH };
+
+	if (level < 0) {
+		if ((z->in = malloc(ZMODE_OUT)) == NULL)
+			return -1;
+		if (inflateInit(&z->strm) != Z_OK) {
+			free(z->in);
+			return (errno = ENOMEM), -1;
+		}
+		return 0;
+	}
+	return (z->in = malloc(ZMODE_BATCH * ZMODE_BLOCK)) ? 0 : -1;
+}
+
+void zmode_fini(struct zmode *z)
+{
+	if (z->level < 0)
+		inflateEnd(&z->strm);
+	free(z->in);
+}
+
+size_t zmode_bound(void)
+{
+	/* zlib header, blocks, then the checksum */
+	return 2 + ZMODE_BATCH * zblk_room() + 4;
+}
+
+/**
+ * Store rather than compress a file whose samples do not shrink at the
+ * fastest level. Samples are spread over the file: a compressible header
+ * must not hide incompressible contents.
+ * @param out [in] Scratch room, `zblk_room` bytes at least
+ */
+static void zmode_probe(struct zmode *z, int file, uint64_t off,
+                        uint64_t end, char *out)
+{
+	if (z->level == 0 || end - off < ZMODE_SAMPLE * ZMODE_SAMPLES)
+		return;
+
+	uint64_t const step = (end - off - ZMODE_SAMPLE) / (ZMODE_SAMPLES - 1);
+	size_t len = 0;
+
+	for (unsigned i = 0; i < ZMODE_SAMPLES; ++i) {
+		ssize_t const rd = pread(file, z->in + len, ZMODE_SAMPLE,
+		                         (off_t)(off + i * step));
+		if (rd <= 0) return;
+		len += (size_t)rd;
+	}
+
+	struct zblk blk = {
+		.in = z->in, .len = len, .out = out, .olen = zblk_room(),
+		.level = 1, .last = true };
+
+	zblk_run(&blk);
+	if (!blk.failed && blk.olen * 100 >= len * ZMODE_GAIN)
+		z->level = 0;
+}
+
+ssize_t zmode_compress(struct zmode *z, size_t len, bool last, char *out)
+{
+	char *p = out;
+
+	if (z->ended) return 0;
+
+	if (!z->begun) {
+		/* CMF: deflate with a 32K window, FLG: level hint and check */
+		unsigned const cmf = 0x78;
+		unsigned flg = (z->level == 0 || z->level == 1 ? 0u
+			: z->level < 6 ? 1u : z->level == 6 ? 2u : 3u) << 6;
+
+		flg += 31 - (cmf << 8 | flg) % 31;
+		*p++ = (char)cmf;
+		*p++ = (char)flg;
+		z->adler = (uint32_t)adler32(0, Z_NULL, 0);
+		z->begun = true;
+	}
+
+	/* An empty last block ends an empty stream */
+	size_t const room = zblk_room();
+	struct zblk blks[ZMODE_BATCH];
+	unsigned n = 0;
+
+	do {
+		size_t const at = n * (size_t)ZMODE_BLOCK;
+		size_t const blen = len - at < ZMODE_BLOCK ? len - at : ZMODE_BLOCK;
+
+		blks[n] = (struct zblk){
+			.in = z->in + at, .len = blen, .out = p + n * room,
+			.olen = room, .level = z->level,
+			.last = last && at + blen == len };
+		++n;
+	} while (n * (size_t)ZMODE_BLOCK < len);
+
+	zjob_run(&(struct zjob){ .blks = blks, .n = n });
+
+	/* Compressed blocks are packed, each one at most fills its slot */
+	for (unsigned i = 0; i < n; ++i) {
+		if (blks[i].failed)
+			return (errno = ENOMEM), -1;
+		memmove(p, blks[i].out, blks[i].olen);
+		p += blks[i].olen;
+		z->adler = (uint32_t)adler32_combine(z->adler, blks[i].adler,
+		                                     (z_off_t)blks[i].len);
+	}
+
+	if (last) {
+		for (int shift = 24; shift >= 0; shift -= 8)
+			*p++ = (char)(z->adler >> shift);
+		z->ended = true;
+	}
+	return p - out;
+}
+
+ssize_t zmode_deflate(struct zmode *z, int file, uint64_t *off,
+                      uint64_t *end, char *out)
+{
+	if (z->ended) return 0;
+	if (!z->begun)
+		zmode_probe(z, file, *off, *end, out);
+
+	/* Whole batch read at once, a shorter read means the file shrank */
+	uint64_t const left = *end - *off;
+	size_t const want = left < (uint64_t)z->batch * ZMODE_BLOCK
+		? (size_t)left : z->batch * ZMODE_BLOCK;
+	size_t len = 0;
+
+	while (len < want) {
+		ssize_t const rd = pread(file, z->in + len, want - len,
+		                         (off_t)(*off + len));
+		if (rd < 0) return -1;
+		if (rd == 0) {
+			*end = *off + len;
+			break;
+		}
+		len += (size_t)rd;
+	}
+
+	ssize_t const n = zmode_compress(z, len, *off + len == *end, out);
+
+	if (n > 0) *off += len;
+	return n;
+}
+
+ssize_t zmode_inflate(struct zmode *z, char const **in, size_t *len,
+                      char const **out)
+{
+	if (z->ended) return 0;
+
+	z->strm.next_in = (Bytef *)*in;
+	z->strm.avail_in = (uInt)*len;
+	z->strm.next_out = (Bytef *)z->in;
+	z->strm.avail_out = ZMODE_OUT;
+
+	int const ret = inflate(&z->strm, Z_NO_FLUSH);
+
+	*in += *len - z->strm.avail_in;
+	*len = z->strm.avail_in;
+	if (ret == Z_STREAM_END)
+		z->ended = true;
+	else if (ret != Z_OK && ret != Z_BUF_ERROR)
+		return (errno = EBADMSG), -1;
+	*out = z->in;
+	return ZMODE_OUT - z->strm.avail_out;
+}
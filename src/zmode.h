@@ -0,0 +1,110 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*                                                        :::      ::::::::   */
+/*   zmode.h                                            :+:      :+:    :+:   */
+/*                                                    +:+ +:+         +:+     */
+/*   By: alucas- <alucas-@student.42.fr>            +#+  +:+       +#+        */
+/*                                                +#+#+#+#+#+   +#+           */
+/*   Created: 1970/01/01 00:00:42 by alucas-           #+#    #+#             */
+/*   Updated: 1970/01/01 00:00:42 by alucas-          ###   ########.fr       */
+/*                                                                            */
+/* ************************************************************************** */
+
+/**
+ * @file zmode.h
+ * @brief
+ * MODE Z transfers, a single zlib stream per transfer. Sent files are cut
+ * into blocks compressed independently of each other (pigz style), so
+ * that a batch of blocks is compressed by helper threads at once, the
+ * caller taking its share. Files found incompressible by a sampling probe
+ * are stored instead.
+ */
+#ifndef __ZMODE_H
+# define __ZMODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <zlib.h>
+
+#define ZMODE_LEVEL           (6) /**< Default compression level         */
+#define ZMODE_BLOCK  (128 * 1024) /**< File bytes per compressed block    */
+#define ZMODE_BATCH           (4) /**< Blocks compressed at once at most  */
+#define ZMODE_OUT    (256 * 1024) /**< Inflated bytes per file write      */
+
+/**
+ * Compression or decompression state of a transfer
+ */
+struct zmode {
+	int level;       /**< Level of the next blocks, 0 to store them */
+	bool begun;      /**< zlib header produced                      */
+	bool ended;      /**< Last block and trailer produced, or stream
+	                      end reached for decompression             */
+	uint32_t adler;  /**< Checksum of the file bytes compressed     */
+	unsigned batch;  /**< Blocks per batch                          */
+	char *in;        /**< File bytes of the batch, or inflated ones */
+	z_stream strm;   /**< Decompression only                        */
+};
+
+/**
+ * Start the compression helpers, shared by every transfer
+ * @param threads [in] Number of helpers, 0 to compress on the caller only
+ * @return             0 on success, -1 otherwise (errno is set)
+ */
+int zmode_start(unsigned threads);
+
+/**
+ * Stop the compression helpers, no compression may be running
+ */
+void zmode_stop(void);
+
+/**
+ * @param level [in] Compression level, -1 to decompress
+ * @return           0 on success, -1 otherwise (errno is set)
+ */
+int zmode_init(struct zmode *z, int level);
+
+void zmode_fini(struct zmode *z);
+
+/**
+ * @return Room `zmode_deflate` output needs
+ */
+size_t zmode_bound(void);
+
+/**
+ * Compress the next batch of blocks staged by the caller in `z->in`,
+ * `z->batch * ZMODE_BLOCK` bytes at most
+ * @param len  [in] Staged bytes
+ * @param last [in] Whether they end the stream
+ * @param out [out] Compressed bytes, `zmode_bound` bytes of room
+ * @return          Bytes produced, 0 once the stream ended, -1 on failure
+ *                  (errno is set)
+ */
+ssize_t zmode_compress(struct zmode *z, size_t len, bool last, char *out);
+
+/**
+ * Compress the next batch of blocks read from the file, the last one
+ * ends the stream
+ * @param off [in/out] File offset, moved past the compressed bytes
+ * @param end [in/out] File end, lowered when the file shrank
+ * @param out    [out] Compressed bytes, `zmode_bound` bytes of room
+ * @return             Bytes produced, 0 once the stream ended, -1 on
+ *                     failure (errno is set)
+ */
+ssize_t zmode_deflate(struct zmode *z, int file, uint64_t *off,
+                      uint64_t *end, char *out);
+
+/**
+ * Decompress received bytes, up to `ZMODE_OUT` at once
+ * @param in  [in/out] Compressed bytes, moved past the consumed ones
+ * @param len [in/out] Bytes left in `in`
+ * @param out    [out] Decompressed bytes, within `z->in`
+ * @return             Bytes produced, 0 once `in` is consumed or the
+ *                     stream ended, -1 when it is corrupt (errno is set)
+ */
+ssize_t zmode_inflate(struct zmode *z, char const **in, size_t *len,
+                      char const **out);
+
+#endif /* !__ZMODE_H */